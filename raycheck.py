@@ -6,6 +6,8 @@ import os
 import shutil
 import subprocess
 import argparse
+import json
+import time
 import colorama
 import hashlib
 from colorama import Fore, Style
@@ -413,6 +415,9 @@ def check_ref_signature(refcache_dir, refbin, json, cubemap):
 
 
 def raycheck(args):
+    """Renders every scene and compares it with the reference. Returns the
+    number of tests that are worse than their cutoff."""
+    failures = 0
     refcache_dir = (
         os.path.join(args.out, "refcache") if not args.refcache else args.refcache
     )
@@ -424,7 +429,7 @@ def raycheck(args):
     if not check_dirs([scene_dir, args.out]) or (
         args.exec and not check_files([args.exec, args.refbin])
     ):
-        return
+        return 1
 
     cmd_args = ["-r", "5"]
     if args.json:
@@ -626,12 +631,14 @@ flag to the raycheck script.\n\n
             # Use comparisons with epsilon smaller than the precision of the
             # serialized format to dodge this problem.
             if rmsd >= cutoffs_rmsd[name] + 1e-7:
+                failures += 1
                 _warn(
                     "{} RMSD {:.6f} is greater than cutoff {:.6f}".format(
                         name, rmsd, cutoffs_rmsd[name]
                     )
                 )
             if ssim < cutoffs_ssim[name] - 1e-7:
+                failures += 1
                 _warn(
                     "{} SSIM {:.6f} is lower than cutoff {:.6f}".format(
                         name, ssim, cutoffs_ssim[name]
@@ -643,6 +650,223 @@ flag to the raycheck script.\n\n
                 args.regression_cutoffs
             )
         )
+    return failures
+
+
+# Performance metrics recorded per scene, and which direction is worse.
+PERF_METRICS = {
+    "wall_s": "higher",
+    "rays_per_s": "lower",
+    "peak_rss_mb": "higher",
+    "load_s": "higher",
+    "build_s": "higher",
+}
+
+# Timings below this many seconds are too noisy to call a regression.
+PERF_TIME_FLOOR = 0.05
+
+
+def perf_corpus(args):
+    """The fixed list of scenes to time: one path per line in the corpus file,
+    relative to the scene directory. Without a corpus file every scene is
+    timed, which makes results comparable only between identical trees."""
+    if os.path.isfile(args.perf_corpus):
+        scenes = []
+        with open(args.perf_corpus) as f:
+            for line in f:
+                line = line.strip()
+                if line and not line.startswith("#"):
+                    scenes.append(line)
+        return scenes
+    _warn(
+        "Corpus file {} does not exist, timing every scene in {}".format(
+            args.perf_corpus, args.scenes
+        )
+    )
+    scenes = []
+    for root, _, files in os.walk(args.scenes):
+        for fn in files:
+            if fn.endswith(".json"):
+                scenes.append(os.path.relpath(os.path.join(root, fn), args.scenes))
+    return sorted(scenes)
+
+
+def perf_settings(args, perfdir):
+    """Writes the render settings for timing runs: the --json settings, if any,
+    with the thread count pinned."""
+    settings = {}
+    if args.json:
+        with open(args.json) as f:
+            settings = json.load(f)
+    settings["threads"] = args.threads
+    path = os.path.join(perfdir, "settings.json")
+    with open(path, "w") as f:
+        json.dump(settings, f, indent=2)
+    return path
+
+
+def perf_run_once(args, cmd, tracefn, statsfn):
+    """Runs one render and returns its metrics, or None if it failed."""
+
+    def pin():
+        # Keep the renderer on the same CPUs from run to run
+        if hasattr(os, "sched_setaffinity"):
+            cpus = sorted(os.sched_getaffinity(0))[: args.threads]
+            os.sched_setaffinity(0, cpus)
+
+    start = time.perf_counter()
+    proc = subprocess.Popen(
+        cmd,
+        stdout=subprocess.DEVNULL,
+        stderr=subprocess.DEVNULL,
+        preexec_fn=pin if os.name == "posix" else None,
+    )
+    deadline = start + args.timelimit
+    while True:
+        pid, status, usage = os.wait4(proc.pid, os.WNOHANG)
+        if pid:
+            break
+        if time.perf_counter() > deadline:
+            proc.kill()
+            os.wait4(proc.pid, 0)
+            return None
+        time.sleep(0.005)
+    wall = time.perf_counter() - start
+    if not os.WIFEXITED(status) or os.WEXITSTATUS(status) != 0:
+        return None
+
+    with open(statsfn) as f:
+        stats = json.load(f)
+    with open(tracefn) as f:
+        events = json.load(f)["traceEvents"]
+
+    # ru_maxrss is in kilobytes on Linux and bytes on macOS
+    rss = usage.ru_maxrss / (1024 * 1024 if sys.platform == "darwin" else 1024)
+    load_us = sum(e["dur"] for e in events if e.get("name") == "loadScene")
+    build_us = sum(
+        e["dur"]
+        for e in events
+        if e.get("ph") == "X" and e.get("name", "").startswith("build ")
+    )
+    render_s = (
+        stats["render_ms"] + stats["aa_ms"] + stats.get("denoise_ms", 0.0)
+    ) / 1000
+    return {
+        "wall_s": wall,
+        "rays_per_s": stats["rays"] / render_s if render_s > 0 else 0.0,
+        "peak_rss_mb": rss,
+        "load_s": load_us / 1e6,
+        "build_s": build_us / 1e6,
+    }
+
+
+def perf_regressions(name, base, cur, tolerance):
+    found = []
+    for metric, worse in PERF_METRICS.items():
+        if metric not in base or metric not in cur:
+            continue
+        b, c = base[metric], cur[metric]
+        if metric.endswith("_s") and max(b, c) < PERF_TIME_FLOOR:
+            continue
+        if worse == "higher":
+            regressed = c > b * (1 + tolerance)
+        else:
+            regressed = c < b * (1 - tolerance)
+        if regressed:
+            found.append(
+                "{} {} went from {:.4g} to {:.4g} ({:+.1f}%)".format(
+                    name, metric, b, c, 100 * (c - b) / b if b else 0.0
+                )
+            )
+    return found
+
+
+def perfcheck(args):
+    """Times the perf corpus and compares it with the stored baseline. Returns
+    the number of regressions."""
+    if not check_files([args.exec]) or not check_dirs([args.scenes]):
+        return 1
+    perfdir = os.path.join(args.out, "perf")
+    os.makedirs(perfdir, exist_ok=True)
+    settings = perf_settings(args, perfdir)
+
+    results = {}
+    for scene in perf_corpus(args):
+        rayfn = os.path.join(args.scenes, scene)
+        outstem = "_".join(Path(os.path.splitext(scene)[0]).parts)
+        imagefn = os.path.join(perfdir, outstem + ".png")
+        tracefn = os.path.join(perfdir, outstem + ".trace.json")
+        statsfn = os.path.join(perfdir, outstem + ".stats.json")
+        cmd = [args.exec, "--trace-out", tracefn, "-r", "5", "-j", settings]
+        if args.cubemap:
+            cmd += ["-c", args.cubemap]
+        cmd += ["-o", statsfn, rayfn, imagefn]
+        _info("Timing: {}".format(" ".join(cmd)))
+
+        runs = []
+        for _ in range(args.perf_repeat):
+            m = perf_run_once(args, cmd, tracefn, statsfn)
+            if m is None:
+                _error("{} failed or timed out".format(outstem))
+                runs = []
+                break
+            runs.append(m)
+        if not runs:
+            continue
+
+        # The fastest run is the least disturbed by the rest of the machine
+        best = {}
+        for metric, worse in PERF_METRICS.items():
+            values = [r[metric] for r in runs]
+            best[metric] = min(values) if worse == "higher" else max(values)
+        results[outstem] = best
+        _info(
+            "{}: {:.3f} s, {:.3g} rays/s, {:.1f} MB, load {:.3f} s, build {:.3f} s".format(
+                outstem,
+                best["wall_s"],
+                best["rays_per_s"],
+                best["peak_rss_mb"],
+                best["load_s"],
+                best["build_s"],
+            )
+        )
+
+    history = {"baseline": None, "runs": []}
+    if os.path.isfile(args.perf_history):
+        with open(args.perf_history) as f:
+            history = json.load(f)
+
+    run = {
+        "time": time.strftime("%Y-%m-%dT%H:%M:%S"),
+        "exec": args.exec,
+        "threads": args.threads,
+        "results": results,
+    }
+    regressions = []
+    baseline = history.get("baseline")
+    if baseline and baseline.get("threads") != args.threads:
+        _warn(
+            "Baseline was recorded with {} threads, not {}; not comparing".format(
+                baseline.get("threads"), args.threads
+            )
+        )
+    elif baseline:
+        for name, cur in results.items():
+            if name in baseline["results"]:
+                regressions += perf_regressions(
+                    name, baseline["results"][name], cur, args.perf_tolerance
+                )
+    for r in regressions:
+        _error(r)
+
+    history["runs"].append(run)
+    if not baseline or args.perf_update_baseline:
+        _info("Recording this run as the performance baseline")
+        history["baseline"] = run
+    with open(args.perf_history, "w") as f:
+        json.dump(history, f, indent=2)
+    _info("Performance history written to {}".format(args.perf_history))
+    return len(regressions)
 
 
 def main():
@@ -709,9 +933,56 @@ def main():
         action="store_true",
         dest="suppress_memo",
     )
+    parser.add_argument(
+        "--perf",
+        help="Also time a fixed corpus of scenes and fail on image or performance regressions",
+        action="store_true",
+    )
+    parser.add_argument(
+        "--perf-corpus",
+        metavar="FILE",
+        help="Scenes to time, one path per line relative to --scenes",
+        default="perf_corpus.txt",
+    )
+    parser.add_argument(
+        "--perf-history",
+        metavar="FILE",
+        help="JSON file holding the performance baseline and every timed run",
+        default="perf_history.json",
+    )
+    parser.add_argument(
+        "--perf-tolerance",
+        metavar="FRACTION",
+        help="Relative change in any metric that counts as a regression",
+        type=float,
+        default=0.10,
+    )
+    parser.add_argument(
+        "--perf-repeat",
+        metavar="N",
+        help="Renders per scene; the best of them is recorded",
+        type=int,
+        default=3,
+    )
+    parser.add_argument(
+        "--perf-update-baseline",
+        help="Make this run the baseline for later comparisons",
+        action="store_true",
+    )
+    parser.add_argument(
+        "--threads",
+        metavar="N",
+        help="Render thread count for timing runs, pinned to as many CPUs",
+        type=int,
+        default=4,
+    )
     args = parser.parse_args()
 
-    raycheck(args)
+    failures = raycheck(args)
+    if args.perf:
+        failures += perfcheck(args)
+        if failures:
+            _fatal("{} image or performance regressions".format(failures))
 
 
 if __name__ == "__main__":
@@ -3,9 +3,13 @@
 #pragma warning(disable : 4786)
 
 #include "RayTracer.h"
+#include "fileio/costmap.h"
+#include "fileio/timeline.h"
+#include "scene/bvh.h"
 #include "scene/light.h"
 #include "scene/material.h"
 #include "scene/ray.h"
+#include "scene/sampler.h"
 
 #include "parser/JsonParser.h"
 #include "parser/Parser.h"
@@ -14,9 +18,11 @@
 
 #include "ui/TraceUI.h"
 #include <algorithm>
+#include <chrono>
 #include <cmath>
 #include <glm/glm.hpp>
 #include <glm/gtx/io.hpp>
+#include <optional>
 #include <string.h> // for memset
 
 #include <fstream>
@@ -33,20 +39,144 @@ bool debugMode = false;
 bool reflectMode = true;
 bool refractMode = true;
 
+namespace {
+// Counts the work done on one pixel while it is in scope and adds it to
+// the pixel's entry in the cost buffer.
+class CostScope {
+public:
+  explicit CostScope(float *out)
+      : out(out), start(std::chrono::steady_clock::now()) {
+    ray_cost = &cost;
+  }
+  ~CostScope() {
+    ray_cost = nullptr;
+    out[COST_NS] += std::chrono::duration<float, std::nano>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+    out[COST_RAYS] += cost.rays;
+    out[COST_PRIM_TESTS] += cost.primTests;
+    out[COST_BOX_TESTS] += cost.boxTests;
+  }
+
+private:
+  float *out;
+  std::chrono::steady_clock::time_point start;
+  RayCost cost;
+};
+
+// The mirror reflection of r at i.
+ray reflectedRay(const ray &r, const isect &i) {
+  glm::dvec3 n = glm::normalize(i.getN());
+  auto intersectionPos = r.at(i);  // + ray epsilon * dir
+  glm::dvec3 r_dir = glm::normalize(r.getDirection());
+
+  auto nMatrix = 2.0 * glm::outerProduct(n, n);
+  glm::dmat3 reflectMat = identity - nMatrix;
+
+  auto reflectionDirection = reflectMat * r_dir;
+  return ray(intersectionPos + RAY_EPSILON * reflectionDirection, reflectionDirection, r.getAtten(), ray::REFLECTION, r.ior());
+}
+
+// The ray r refracts into at i, or nothing on total internal reflection.
+std::optional<ray> refractedRay(const ray &r, const isect &i,
+                                const Material &m) {
+  glm::dvec3 n = glm::normalize(i.getN());
+  auto intersectionPos = r.at(i);  // + ray epsilon * dir
+  glm::dvec3 r_dir = glm::normalize(r.getDirection());
+
+  // assume we are in air into object
+  double ref_ratio = 1.0 / m.index(i);
+  glm::dvec3 N = n;
+
+  // flip from object into air
+  if (glm::dot(r_dir, n) >= 0.0) {
+    ref_ratio = 1.0 / ref_ratio;
+    N = -N;
+  }
+
+  double cos_theta1 = glm::dot(-N, r_dir);
+  double sin2_theta2 = ref_ratio * ref_ratio * (1.0 - cos_theta1 * cos_theta1); // sin^2 = 1-cos^2
+
+  if (sin2_theta2 > 1.0)
+    return std::nullopt;
+
+  double cos_theta2 = sqrt(std::max(0.0, 1.0 - sin2_theta2));  // cos θ₂
+
+  auto w_norm = cos_theta2 * N;
+  auto w_t = r_dir + cos_theta1 * N; // -wtan + w_norm = -w_in, for the w_tan we want -> wtan = win + wnorm
+  auto refractionDirection = glm::normalize(w_t * ref_ratio - w_norm);
+
+  return ray(intersectionPos + RAY_EPSILON * refractionDirection, refractionDirection, r.getAtten(), ray::REFRACTION);
+}
+
+// Where the camera ray of the pixel being traced should record its first
+// hit for the denoiser, if anywhere. Cleared once it has.
+thread_local float *ray_aux = nullptr;
+
+void recordAux(float *out, const ray &r, const isect &i) {
+  glm::dvec3 n = glm::normalize(i.getN());
+  glm::dvec3 albedo = i.getMaterial().kd(i);
+  out[AUX_NX] = (float)n[0];
+  out[AUX_NY] = (float)n[1];
+  out[AUX_NZ] = (float)n[2];
+  out[AUX_DEPTH] = (float)(i.getT() * glm::length(r.getDirection()));
+  out[AUX_R] = (float)albedo[0];
+  out[AUX_G] = (float)albedo[1];
+  out[AUX_B] = (float)albedo[2];
+}
+
+// A ray of a wavefront: the pixel it lands in, how much its color counts
+// there, and the random numbers it shades with.
+struct PathRay {
+  ray r;
+  glm::dvec3 weight;
+  int pixel;
+  uint64_t key;
+  Sampler sampler;
+};
+
+// Spread the low 10 bits of v out to every third bit.
+uint64_t spreadBits(uint64_t v) {
+  v &= 0x3ff;
+  v = (v | (v << 16)) & 0x30000ff;
+  v = (v | (v << 8)) & 0x300f00f;
+  v = (v | (v << 4)) & 0x30c30c3;
+  v = (v | (v << 2)) & 0x9249249;
+  return v;
+}
+
+// Sort key that brings rays heading the same way from nearby origins
+// together: the direction octant, then the Morton code of the origin
+// within the scene bounds.
+uint64_t coherenceKey(const ray &r, const glm::dvec3 &lo,
+                      const glm::dvec3 &scale) {
+  glm::dvec3 d = r.getDirection();
+  uint64_t octant = (d[0] < 0.0 ? 1 : 0) | (d[1] < 0.0 ? 2 : 0) |
+                    (d[2] < 0.0 ? 4 : 0);
+  glm::dvec3 q = (r.getPosition() - lo) * scale;
+  uint64_t morton = 0;
+  for (int a = 0; a < 3; ++a) {
+    double c = std::clamp(q[a], 0.0, 1023.0);
+    morton |= spreadBits((uint64_t)c) << a;
+  }
+  return (octant << 30) | morton;
+}
+} // namespace
+
 // Trace a top-level ray through pixel(i,j), i.e. normalized window coordinates
 // (x,y), through the projection plane, and out into the scene. All we do is
 // enter the main ray-tracing method, getting things started by plugging in an
 // initial ray weight of (0.0,0.0,0.0) and an initial recursion depth of 0.
 
 glm::dvec3 RayTracer::trace(double x, double y) {
-  // Clear out the ray cache in the scene for debugging purposes,
+  // The debugging view shows the rays of the last pixel traced
   if (TraceUI::m_debug) {
-    scene->clearIntersectCache();
+    scene->getRayLog().clearThread();
   }
 
   ray r(glm::dvec3(0, 0, 0), glm::dvec3(0, 0, 0), glm::dvec3(1, 1, 1),
         ray::VISIBILITY);
-  scene->getCamera().rayThrough(x, y, r);
+  camera.rayThrough(x, y, r);
   double dummy;
   glm::dvec3 ret =
       traceRay(r, glm::dvec3(1.0, 1.0, 1.0), traceUI->getDepth(), dummy);
@@ -63,8 +193,19 @@ glm::dvec3 RayTracer::tracePixel(int i, int j) {
   double x = double(i) / double(buffer_width);
   double y = double(j) / double(buffer_height);
 
-  unsigned char *pixel = buffer.data() + (i + j * buffer_width) * 3;
-  col = trace(x, y);
+  unsigned char *pixel = pixelPtr(i, j);
+  Sampler sampler(sampleSeed, i, j);
+  SamplerScope scope(sampler);
+  ray_aux = auxPtr(i, j);
+  ray_pixel = glm::ivec2(i, j);
+  if (recordCosts) {
+    CostScope cost(costPtr(i, j));
+    col = trace(x, y);
+  } else {
+    col = trace(x, y);
+  }
+  ray_aux = nullptr;
+  ray_pixel = glm::ivec2(-1, -1);
 
   pixel[0] = (int)(255.0 * col[0]);
   pixel[1] = (int)(255.0 * col[1]);
@@ -75,6 +216,126 @@ glm::dvec3 RayTracer::tracePixel(int i, int j) {
 #define VERBOSE 0
 
 
+void RayTracer::tracePacket(int i, int j) {
+  static_assert(BVH::PACKET_SIZE == 4, "packets are 2x2 blocks of pixels");
+  static const int di[4] = {0, 1, 0, 1};
+  static const int dj[4] = {0, 0, 1, 1};
+
+  const glm::dvec3 zero(0.0), one(1.0);
+  ray rays[4] = {{zero, zero, one}, {zero, zero, one}, {zero, zero, one},
+                 {zero, zero, one}};
+  for (int k = 0; k < 4; ++k)
+    camera.rayThrough(double(i + di[k]) / double(buffer_width),
+                      double(j + dj[k]) / double(buffer_height), rays[k]);
+
+  isect hits[4];
+  unsigned found = scene->intersect(rays, 4, hits);
+
+  // The rays go their own ways after the first hit, so reflection and
+  // refraction are traced one ray at a time.
+  int depth = traceUI->getDepth();
+  for (int k = 0; k < 4; ++k) {
+    glm::dvec3 col(0.0);
+    if ((found & (1u << k)) && depth >= 0) {
+      Sampler sampler(sampleSeed, i + di[k], j + dj[k]);
+      SamplerScope scope(sampler);
+      if (float *out = auxPtr(i + di[k], j + dj[k]))
+        recordAux(out, rays[k], hits[k]);
+      double dummy;
+      col = shadeHit(rays[k], hits[k], glm::dvec3(1.0), depth, dummy);
+    }
+    col = glm::clamp(col, 0.0, 1.0);
+    unsigned char *pixel = pixelPtr(i + di[k], j + dj[k]);
+    pixel[0] = (int)(255.0 * col[0]);
+    pixel[1] = (int)(255.0 * col[1]);
+    pixel[2] = (int)(255.0 * col[2]);
+  }
+}
+
+void RayTracer::traceWavefront(int j0, int j1) {
+  const int width = col_end - col_begin;
+  std::vector<glm::dvec3> colors((size_t)width * (j1 - j0), glm::dvec3(0.0));
+  std::vector<PathRay> rays, next;
+  std::vector<isect> hits;
+  std::vector<uint32_t> shading;
+
+  const glm::dvec3 zero(0.0), one(1.0);
+  rays.reserve(colors.size());
+  for (int j = j0; j < j1; ++j)
+    for (int i = col_begin; i < col_end; ++i) {
+      PathRay p{ray(zero, zero, one), one, (j - j0) * width + (i - col_begin),
+                0, Sampler(sampleSeed, i, j)};
+      camera.rayThrough(double(i) / double(buffer_width),
+                        double(j) / double(buffer_height), p.r);
+      rays.push_back(p);
+    }
+
+  glm::dvec3 lo = scene->bounds().getMin();
+  glm::dvec3 extent = scene->bounds().getMax() - lo;
+  glm::dvec3 scale;
+  for (int a = 0; a < 3; ++a)
+    scale[a] = std::isfinite(extent[a]) && extent[a] > 0.0
+                   ? 1023.0 / extent[a]
+                   : 0.0;
+
+  // One generation of rays per pass, each a bounce deeper than the last
+  const int maxDepth = traceUI->getDepth();
+  for (int depth = maxDepth; depth >= 0 && !rays.empty(); --depth) {
+    for (PathRay &p : rays)
+      p.key = coherenceKey(p.r, lo, scale);
+    std::sort(rays.begin(), rays.end(),
+              [](const PathRay &a, const PathRay &b) { return a.key < b.key; });
+
+    hits.assign(rays.size(), isect());
+    shading.clear();
+    for (size_t k = 0; k < rays.size(); ++k)
+      if (scene->intersect(rays[k].r, hits[k]))
+        shading.push_back((uint32_t)k);
+
+    std::stable_sort(shading.begin(), shading.end(),
+                     [&hits](uint32_t a, uint32_t b) {
+                       return hits[a].getMaterialIndex() <
+                              hits[b].getMaterialIndex();
+                     });
+
+    next.clear();
+    for (uint32_t k : shading) {
+      PathRay &p = rays[k];
+      const isect &i = hits[k];
+      const Material &m = i.getMaterial();
+      if (depth == maxDepth && !aux.empty())
+        recordAux(auxPtr(col_begin + p.pixel % width, j0 + p.pixel / width),
+                  p.r, i);
+      {
+        SamplerScope scope(p.sampler);
+        colors[p.pixel] += p.weight * m.shade(scene.get(), p.r, i);
+      }
+      if (depth == 0)
+        continue;
+      // Children shade with streams of their own, so the numbers a ray
+      // gets don't depend on how the wavefront was sorted.
+      if (reflectMode)
+        next.push_back({reflectedRay(p.r, i), p.weight * m.kr(i), p.pixel, 0,
+                        p.sampler.fork(1)});
+      if (refractMode && m.Trans())
+        if (std::optional<ray> refraction = refractedRay(p.r, i, m))
+          next.push_back(
+              {*refraction, p.weight, p.pixel, 0, p.sampler.fork(2)});
+    }
+    rays.swap(next);
+  }
+
+  for (int j = j0; j < j1; ++j)
+    for (int i = col_begin; i < col_end; ++i) {
+      glm::dvec3 col = glm::clamp(
+          colors[(j - j0) * width + (i - col_begin)], 0.0, 1.0);
+      unsigned char *pixel = pixelPtr(i, j);
+      pixel[0] = (int)(255.0 * col[0]);
+      pixel[1] = (int)(255.0 * col[1]);
+      pixel[2] = (int)(255.0 * col[2]);
+    }
+}
+
 // Do recursive ray tracing! You'll want to insert a lot of code here (or places
 // called from here) to handle reflection, refraction, etc etc.
 glm::dvec3 RayTracer::traceRay(ray &r, const glm::dvec3 &thresh, int depth,
@@ -90,68 +351,11 @@ glm::dvec3 RayTracer::traceRay(ray &r, const glm::dvec3 &thresh, int depth,
 #endif
 
   if (scene->intersect(r, i)) {
-    // YOUR CODE HERE
-
-    // An intersection occurred!  We've got work to do. For now, this code gets
-    // the material for the surface that was intersected, and asks that material
-    // to provide a color for the ray.
-
-    // This is a great place to insert code for recursive ray tracing. Instead
-    // of just returning the result of shade(), add some more steps: add in the
-    // contributions from reflected and refracted rays.
-
-    // assume for now contributions from refracted and reflected are additive
-    // all falloff is from distance
-
-    // just sum here the colors is done recursively and we can add independently i think
-
-    // shoot of reflection and refeaction and sum to color, the shade accounted by them is done
-
-
-    // main ray
-    const Material &m = i.getMaterial();
-    colorC += m.shade(scene.get(), r, i);
-
-    glm::dvec3 n = glm::normalize(i.getN());
-    auto intersectionPos = r.at(i);  // + ray epsilon * dir
-    glm::dvec3 r_dir = glm::normalize(r.getDirection());
-
-    // reflection
-    if (reflectMode) {
-      auto nMatrix = 2.0 * glm::outerProduct(n, n);
-      glm::dmat3 reflectMat = identity - nMatrix;
-
-      auto reflectionDirection = reflectMat * r_dir;
-      ray reflection(intersectionPos + RAY_EPSILON * reflectionDirection, reflectionDirection, r.getAtten(), ray::REFLECTION, r.ior());
-      colorC += m.kr(i) * traceRay(reflection, thresh, depth - 1, t);
-    }
-
-    // refraction
-    if (refractMode && m.Trans()) {
-      // assume we are in air into object
-      double ref_ratio = 1.0 / m.index(i);
-      glm::dvec3 N = n;
-
-      // flip from object into air
-      if (glm::dot(r_dir, n) >= 0.0) {
-        ref_ratio = 1.0 / ref_ratio;
-        N = -N;
-      }
-
-      double cos_theta1 = glm::dot(-N, r_dir);
-      double sin2_theta2 = ref_ratio * ref_ratio * (1.0 - cos_theta1 * cos_theta1); // sin^2 = 1-cos^2
-
-      if (sin2_theta2 <= 1.0) {
-        double cos_theta2 = sqrt(std::max(0.0, 1.0 - sin2_theta2));  // cos θ₂
-
-        auto w_norm = cos_theta2 * N;
-        auto w_t = r_dir + cos_theta1 * N; // -wtan + w_norm = -w_in, for the w_tan we want -> wtan = win + wnorm
-        auto refractionDirection = glm::normalize(w_t * ref_ratio - w_norm);
-
-        ray refraction(intersectionPos + RAY_EPSILON * refractionDirection, refractionDirection, r.getAtten(), ray::REFRACTION);
-        colorC += traceRay(refraction, thresh, depth - 1, t);;
-      }
+    if (ray_aux) {
+      recordAux(ray_aux, r, i);
+      ray_aux = nullptr;
     }
+    colorC = shadeHit(r, i, thresh, depth, t);
   } else {
     // No intersection. This ray travels to infinity, so we color
     // it according to the background color, which in this (simple)
@@ -172,12 +376,68 @@ glm::dvec3 RayTracer::traceRay(ray &r, const glm::dvec3 &thresh, int depth,
   return colorC;
 }
 
-RayTracer::RayTracer()
-    : scene(nullptr), buffer(0), thresh(0), buffer_width(0), buffer_height(0),
-      m_bBufferReady(false) {
+// Color of ray r at its closest hit i: the surface shading plus what's seen
+// in its reflection and refraction.
+glm::dvec3 RayTracer::shadeHit(ray &r, const isect &i,
+                               const glm::dvec3 &thresh, int depth,
+                               double &t) {
+  glm::dvec3 colorC(0);
+
+  // YOUR CODE HERE
+
+  // An intersection occurred!  We've got work to do. For now, this code gets
+  // the material for the surface that was intersected, and asks that material
+  // to provide a color for the ray.
+
+  // This is a great place to insert code for recursive ray tracing. Instead
+  // of just returning the result of shade(), add some more steps: add in the
+  // contributions from reflected and refracted rays.
+
+  // assume for now contributions from refracted and reflected are additive
+  // all falloff is from distance
+
+  // just sum here the colors is done recursively and we can add independently i think
+
+  // shoot of reflection and refeaction and sum to color, the shade accounted by them is done
+
+
+  // main ray
+  const Material &m = i.getMaterial();
+  colorC += m.shade(scene.get(), r, i);
+
+  // Each branch draws from a stream of its own, forked the same way
+  // traceWavefront() forks them, so both modes give a ray the same numbers
+  auto traceBranch = [&](ray &branch, uint32_t id) {
+    if (!ray_sampler)
+      return traceRay(branch, thresh, depth - 1, t);
+    Sampler sampler = ray_sampler->fork(id);
+    SamplerScope scope(sampler);
+    return traceRay(branch, thresh, depth - 1, t);
+  };
+
+  // reflection
+  if (reflectMode) {
+    ray reflection = reflectedRay(r, i);
+    colorC += m.kr(i) * traceBranch(reflection, 1);
+  }
+
+  // refraction
+  if (refractMode && m.Trans()) {
+    if (std::optional<ray> refraction = refractedRay(r, i, m))
+      colorC += traceBranch(*refraction, 2);
+  }
+  return colorC;
 }
 
-RayTracer::~RayTracer() {}
+RayTracer::RayTracer()
+    : stopTrace(false), scene(nullptr), buffer(0), thresh(0), buffer_width(0),
+      buffer_height(0), band_start(0), m_bBufferReady(false), nextRow(0),
+      workersDone(0) {}
+
+RayTracer::~RayTracer() {
+  stopTrace = true;
+  waitRender();
+}
 
 void RayTracer::getBuffer(unsigned char *&buf, int &w, int &h) {
   buf = buffer.data();
@@ -186,10 +446,11 @@ void RayTracer::getBuffer(unsigned char *&buf, int &w, int &h) {
 }
 
 double RayTracer::aspectRatio() {
-  return sceneLoaded() ? scene->getCamera().getAspectRatio() : 1;
+  return sceneLoaded() ? camera.getAspectRatio() : 1;
 }
 
 bool RayTracer::loadScene(const char *fn) {
+  TimelineScope t("loadScene", "load", fn);
   ifstream ifs(fn);
   if (!ifs) {
     string msg("Error: couldn't read scene file ");
@@ -217,6 +478,7 @@ bool RayTracer::loadScene(const char *fn) {
     Tokenizer tokenizer(ifs, false);
     Parser parser(tokenizer, path);
     try {
+      TimelineScope t("parse .ray", "load");
       scene.reset(parser.parseScene());
     } catch (SyntaxErrorException &pe) {
       traceUI->alert(pe.formattedMessage());
@@ -253,38 +515,112 @@ bool RayTracer::loadScene(const char *fn) {
   if (!sceneLoaded())
     return false;
 
+  prepareScene();
+  camera = scene->getCamera();
   return true;
 }
 
-void RayTracer::traceSetup(int w, int h) {
-  size_t newBufferSize = w * h * 3;
+std::shared_ptr<Scene> RayTracer::releaseScene() {
+  waitRender();
+  return std::move(scene);
+}
+
+void RayTracer::setScene(std::shared_ptr<Scene> s) {
+  waitRender();
+  scene = std::move(s);
+  if (scene) {
+    prepareScene();
+    camera = scene->getCamera();
+  }
+}
+
+// Compress the scene's meshes if asked to, build or drop its BVH and light
+// tree, and start or stop its ray log to match the settings. This is the
+// only place the log is configured: the scene may be shared with other
+// tracers, which all set it before any of them starts tracing.
+void RayTracer::prepareScene() {
+  if (traceUI->meshCompressSwitch())
+    scene->compressMeshes();
+  if (traceUI->kdSwitch())
+    scene->buildBVH(traceUI->getLeafSize(), traceUI->bvhCompressSwitch());
+  else
+    scene->clearBVH();
+  if (traceUI->getLightSamples() > 0)
+    scene->buildLightTree();
+  else
+    scene->clearLightTree();
+
+  RayLog &log = scene->getRayLog();
+  if (traceUI->getRayLogStride() > 0) {
+    RayLogFilter filter;
+    filter.stride = traceUI->getRayLogStride();
+    const std::vector<int> &region = traceUI->getRayLogRegion();
+    if (region.size() == 4) {
+      filter.x0 = region[0];
+      filter.y0 = region[1];
+      filter.x1 = region[2];
+      filter.y1 = region[3];
+    }
+    log.start(filter, traceUI->getRayLogCapacity());
+  } else {
+    log.stop();
+  }
+}
+
+void RayTracer::traceSetup(int w, int h, int rows) {
+  // Never resize the buffer out from under running workers
+  waitRender();
+
+  if (rows <= 0 || rows > h)
+    rows = h;
+  size_t newBufferSize = w * rows * 3;
   if (newBufferSize != buffer.size()) {
     bufferSize = newBufferSize;
     buffer.resize(bufferSize);
   }
   buffer_width = w;
   buffer_height = h;
+  band_start = 0;
+  col_begin = 0;
+  col_end = w;
   std::fill(buffer.begin(), buffer.end(), 0);
+  if (recordCosts)
+    costs.assign(buffer.size() / 3 * COST_CHANNELS, 0.0f);
+  else
+    costs.clear();
+  if (traceUI->denoiseSwitch())
+    aux.assign(buffer.size() / 3 * AUX_CHANNELS, 0.0f);
+  else
+    aux.clear();
   m_bBufferReady = true;
+  stopTrace = false;
 
   /*
    * Sync with TraceUI
    */
 
-  threads = traceUI->getThreads();
+  threads = std::clamp(slot_count > 0 ? slot_count : traceUI->getThreads(), 1,
+                       MAX_THREADS - slot_first);
   block_size = traceUI->getBlockSize();
   thresh = traceUI->getThreshold();
   samples = traceUI->getSuperSamples();
   aaThresh = traceUI->getAaThreshold();
-
-  // YOUR CODE HERE
-  // FIXME: Additional initializations
+  sampleSeed = (uint32_t)traceUI->getSampleSeed();
+
+  // Packets are only for plain renders; cost maps, the ray log and the
+  // debugger want to see every ray on its own.
+  bool logRays = scene && scene->getRayLog().isOn();
+  bool plain = !recordCosts && !logRays && !TraceUI::m_debug;
+  usePackets = traceUI->packetSwitch() && plain;
+  useWavefront = traceUI->wavefrontSwitch() && plain;
 }
 
 /*
  * RayTracer::traceImage
  *
  *	Trace the image and store the pixel data in RayTracer::buffer.
+ *	Returns as soon as the worker threads are launched; use checkRender()
+ *	or waitRender() to find out when they are done.
  *
  *	Arguments:
  *		w:	width of the image buffer
@@ -294,89 +630,188 @@ void RayTracer::traceSetup(int w, int h) {
 void RayTracer::traceImage(int w, int h) {
   // Always call traceSetup before rendering anything.
   traceSetup(w, h);
+  startWorkers(0, h, TRACE_PASS);
+}
 
-  // YOUR CODE HERE
-  // FIXME: Start one or more threads for ray tracing
-  //
-  // TIPS: Ideally, the traceImage should be executed asynchronously,
-  //       i.e. returns IMMEDIATELY after working threads are launched.
-  //
-  //       An asynchronous traceImage lets the GUI update your results
-  //       while rendering.
-
-  for (int j = 0; j < h; ++j) {
-    for (int i = 0; i < w; ++i) {
-      tracePixel(i, j);
+int RayTracer::aaImage() {
+  // samples and aaThresh have been synchronized with TraceUI by
+  // RayTracer::traceSetup()
+  waitRender();
+  startWorkers(band_start, band_start + (int)buffer.size() / (buffer_width * 3),
+               AA_PASS);
+  return 0;
+}
+
+void RayTracer::denoiseImage() {
+  waitRender();
+  denoiseRegion(col_begin, band_start, col_end,
+                band_start + (int)buffer.size() / (buffer_width * 3));
+}
+
+void RayTracer::denoiseRegion(int x0, int y0, int x1, int y1) {
+  if (aux.empty() || stopTrace)
+    return;
+  TimelineScope t("denoise");
+  Denoiser d(buffer.data(), aux.data(), buffer_width, x0, y0 - band_start, x1,
+             y1 - band_start, traceUI->getDenoisePasses());
+  denoiser = &d;
+  // Each pass reads what the last one wrote, so they can't overlap
+  for (denoisePass = 0; denoisePass < d.passes() && !stopTrace;
+       ++denoisePass) {
+    startWorkers(y0, y1, DENOISE_PASS);
+    waitRender();
+  }
+  denoiser = nullptr;
+}
+
+void RayTracer::traceBands(int w, int h, int rows, const BandSink &sink) {
+  // A band denoised on its own would be filtered differently along its
+  // edges than the rows around it, leaving seams. Trace each band with
+  // enough rows to either side that its own rows see what they would in the
+  // whole image, and hand only the band itself to the sink.
+  int margin =
+      traceUI->denoiseSwitch() ? Denoiser::reach(traceUI->getDenoisePasses())
+                               : 0;
+  rows = std::clamp(rows, 1, h);
+  traceSetup(w, h, rows + 2 * margin);
+
+  // The buffer is stored bottom-up, but image writers want the top scanline
+  // first, so walk the bands from the top of the image down.
+  for (int top = h; top > 0 && !stopTrace; top -= rows) {
+    int first = std::max(0, top - rows);
+    int lo = std::max(0, first - margin), hi = std::min(h, top + margin);
+    band_start = lo;
+    std::fill(buffer.begin(), buffer.end(), 0);
+    std::fill(costs.begin(), costs.end(), 0.0f);
+    std::fill(aux.begin(), aux.end(), 0.0f);
+
+    startWorkers(lo, hi, TRACE_PASS);
+    waitRender();
+    if (traceUI->aaSwitch()) {
+      startWorkers(lo, hi, AA_PASS);
+      waitRender();
     }
+    denoiseRegion(col_begin, lo, col_end, hi);
+    if (!stopTrace)
+      sink(buffer.data() + (size_t)(first - lo) * w * 3, first, top - first);
   }
+}
 
-  m_bBufferReady = true;
+float *RayTracer::costPtr(int i, int j) {
+  return costs.data() + (i + (j - band_start) * buffer_width) * COST_CHANNELS;
 }
 
-int RayTracer::aaImage() {
-  // YOUR CODE HERE
-  // FIXME: Implement Anti-aliasing here
-  //
-  // TIP: samples and aaThresh have been synchronized with TraceUI by
-  //      RayTracer::traceSetup() function
+void RayTracer::traceRegion(int x0, int y0, int x1, int y1) {
+  waitRender();
+  col_begin = std::max(x0, 0);
+  col_end = std::min(x1, buffer_width);
 
-  std::vector accum(buffer_width * buffer_height, glm::dvec3(0.0));
+  startWorkers(y0, y1, TRACE_PASS);
+  waitRender();
+  if (traceUI->aaSwitch()) {
+    startWorkers(y0, y1, AA_PASS);
+    waitRender();
+  }
 
-  for (int j = 0; j < buffer_height; ++j) {
-    for (int i = 0; i < buffer_width; ++i) {
-      glm::dvec3 res(0.0);
+  col_begin = 0;
+  col_end = buffer_width;
+}
 
-      for (int sy = 0; sy < samples; ++sy) {
-        for (int sx = 0; sx < samples; ++sx) {
-          auto x = (i + (sx + 0.5) / samples ) / buffer_width;
-          auto y = (j + (sy + 0.5) / samples ) / buffer_height;
+void RayTracer::startWorkers(int j0, int j1, Pass pass) {
+  waitRender();
+  nextRow = j0;
+  workersDone = 0;
+  for (unsigned int id = 0; id < threads; ++id)
+    workers.emplace_back(&RayTracer::workerMain, this, slot_first + id, j1,
+                         pass);
+}
 
-          res += trace(x, y);
-        }
+void RayTracer::workerMain(unsigned int id, int j1, Pass pass) {
+  static const char *const ROW_NAMES[] = {"trace row", "antialias row",
+                                          "denoise row"};
+  ray_thread_id = id;
+  timelineNameThread("render thread " + std::to_string(id));
+  int step = 1;
+  if (pass == TRACE_PASS && sceneLoaded())
+    step = useWavefront ? WAVEFRONT_ROWS : usePackets ? 2 : 1;
+  for (int j = nextRow.fetch_add(step); j < j1 && !stopTrace;
+       j = nextRow.fetch_add(step)) {
+    TimelineScope t(ROW_NAMES[pass], "render", j);
+    if (pass == AA_PASS) {
+      aaRow(j);
+    } else if (pass == DENOISE_PASS) {
+      denoiser->filterRow(denoisePass, j - band_start);
+    } else if (useWavefront && step > 1) {
+      traceWavefront(j, std::min(j + step, j1));
+    } else if (step == 2 && j + 1 < j1) {
+      int i = col_begin;
+      for (; i + 1 < col_end; i += 2)
+        tracePacket(i, j);
+      for (; i < col_end; ++i) {
+        tracePixel(i, j);
+        tracePixel(i, j + 1);
       }
-
-      res /= (samples * samples);
-      accum[i + j * buffer_width] = res;
+    } else {
+      for (int i = col_begin; i < col_end; ++i)
+        tracePixel(i, j);
     }
   }
+  ++workersDone;
+}
 
-  for (int j = 0; j < buffer_height; ++j) {
-    for (int i = 0; i < buffer_width; ++i) {
-      setPixel(i, j, glm::clamp(accum[i + j * buffer_width], 0.0, 1.0));
+// Supersample every traced pixel of scanline j with samples x samples
+// subpixel positions, the first two dimensions of each sample.
+void RayTracer::aaRow(int j) {
+  std::vector<glm::dvec3> row(buffer_width, glm::dvec3(0.0));
+
+  for (int i = col_begin; i < col_end; ++i) {
+    glm::dvec3 res(0.0);
+    std::optional<CostScope> cost;
+    if (recordCosts)
+      cost.emplace(costPtr(i, j));
+
+    Sampler sampler(sampleSeed, i, j);
+    SamplerScope scope(sampler);
+    ray_pixel = glm::ivec2(i, j);
+    for (int s = 0; s < samples * samples; ++s) {
+      sampler.startSample(s);
+      glm::dvec2 u = sampler.next2D();
+      auto x = (i + u[0]) / buffer_width;
+      auto y = (j + u[1]) / buffer_height;
+
+      res += trace(x, y);
     }
+
+    row[i] = res / double(samples * samples);
   }
+  ray_pixel = glm::ivec2(-1, -1);
 
-  return 0;
+  for (int i = col_begin; i < col_end; ++i)
+    setPixel(i, j, glm::clamp(row[i], 0.0, 1.0));
 }
 
 bool RayTracer::checkRender() {
-  // YOUR CODE HERE
-  // FIXME: Return true if tracing is done.
-  //        This is a helper routine for GUI.
-  //
-  // TIPS: Introduce an array to track the status of each worker thread.
-  //       This array is maintained by the worker threads.
-  return true;
+  // Workers bump workersDone on their way out; tracing is done once all of
+  // them have.
+  return workersDone == workers.size();
 }
 
 void RayTracer::waitRender() {
-  // YOUR CODE HERE
-  // FIXME: Wait until the rendering process is done.
-  //        This function is essential if you are using an asynchronous
-  //        traceImage implementation.
-  //
-  // TIPS: Join all worker threads here.
+  for (auto &worker : workers)
+    worker.join();
+  workers.clear();
+  workersDone = 0;
 }
 
 
 glm::dvec3 RayTracer::getPixel(int i, int j) {
-  unsigned char *pixel = buffer.data() + (i + j * buffer_width) * 3;
+  unsigned char *pixel = pixelPtr(i, j);
   return glm::dvec3((double)pixel[0] / 255.0, (double)pixel[1] / 255.0,
                     (double)pixel[2] / 255.0);
 }
 
 void RayTracer::setPixel(int i, int j, glm::dvec3 color) {
-  unsigned char *pixel = buffer.data() + (i + j * buffer_width) * 3;
+  unsigned char *pixel = pixelPtr(i, j);
 
   pixel[0] = (int)(255.0 * color[0]);
   pixel[1] = (int)(255.0 * color[1]);
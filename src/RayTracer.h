@@ -5,13 +5,18 @@
 
 // The main ray tracer.
 
+#include "scene/camera.h"
 #include "scene/cubeMap.h"
+#include "scene/denoiser.h"
 #include "scene/ray.h"
+#include <atomic>
+#include <functional>
 #include <glm/vec3.hpp>
 #include <mutex>
 #include <queue>
 #include <thread>
 #include <time.h>
+#include <vector>
 
 class Scene;
 class Pixel {
@@ -32,18 +37,43 @@ public:
   glm::dvec3 tracePixel(int i, int j);
   glm::dvec3 traceRay(ray &r, const glm::dvec3 &thresh, int depth,
                       double &length);
+  glm::dvec3 shadeHit(ray &r, const isect &i, const glm::dvec3 &thresh,
+                      int depth, double &length);
 
   glm::dvec3 getPixel(int i, int j);
   void setPixel(int i, int j, glm::dvec3 color);
   void getBuffer(unsigned char *&buf, int &w, int &h);
   double aspectRatio();
 
+  // Receives a finished band of the image: `count` rows starting at image
+  // row `first`, stored bottom-up like the main buffer.
+  typedef std::function<void(const unsigned char *rows, int first, int count)>
+      BandSink;
+
   void traceImage(int w, int h);
   int aaImage();
+  // Run the denoiser over the image, if it is on, once tracing and
+  // anti-aliasing are done. Blocks until it is finished.
+  void denoiseImage();
   bool checkRender();
   void waitRender();
 
-  void traceSetup(int w, int h);
+  // Render the image in horizontal bands of `rows` scanlines, top band first,
+  // handing each finished (and anti-aliased and denoised, if enabled) band to
+  // `sink`. Only one band is ever resident, so memory stays bounded for huge
+  // images. With the denoiser on, the rows around each band are traced with
+  // it so the bands filter without seams.
+  void traceBands(int w, int h, int rows, const BandSink &sink);
+
+  // Size the buffer for a w x h image. If rows > 0, the buffer only holds a
+  // band of that many scanlines; see traceBands().
+  void traceSetup(int w, int h, int rows = 0);
+
+  // Trace (and anti-alias, if enabled) columns [x0, x1) of rows [y0, y1),
+  // blocking until done. The buffer must already hold the whole image; see
+  // traceSetup(). Regions aren't denoised on their own, which would leave
+  // seams between them; call denoiseImage() once they're all in.
+  void traceRegion(int x0, int y0, int x1, int y1);
 
   bool loadScene(const char *fn);
   bool sceneLoaded() { return scene != 0; }
@@ -53,17 +83,96 @@ public:
 
   const Scene &getScene() { return *scene; }
 
+  // Move the loaded scene out of / into the tracer, so callers can keep
+  // scenes resident between renders without reparsing them. A scene may be
+  // set on several tracers at once; it is only read while tracing.
+  std::shared_ptr<Scene> releaseScene();
+  void setScene(std::shared_ptr<Scene> s);
+
+  // The tracer renders through its own copy of the scene camera, taken when
+  // the scene is loaded or set, so tracers sharing a scene can each move
+  // their camera independently.
+  Camera &getCamera() { return camera; }
+
+  // Restrict this tracer to `count` worker threads that use the ray counter
+  // slots starting at `first`, so several tracers can run side by side.
+  // A count of 0 goes back to the TraceUI thread setting.
+  void setThreadSlots(int first, int count) {
+    slot_first = first;
+    slot_count = count;
+  }
+
+  // Record per-pixel render cost in a side buffer aligned with the image
+  // buffer (see fileio/costmap.h for the channels). Takes effect at the next
+  // traceSetup(); nothing is measured while it is off.
+  void setCostMap(bool on) { recordCosts = on; }
+  const float *getCostBuffer() const {
+    return costs.empty() ? nullptr : costs.data();
+  }
+  // What each pixel's camera ray hit (see scene/denoiser.h), or null unless
+  // the denoiser is on. Regions traced elsewhere are copied in here so the
+  // whole image can be denoised at once.
+  float *getAuxBuffer() { return aux.empty() ? nullptr : aux.data(); }
+
   bool stopTrace;
 
 private:
   glm::dvec3 trace(double x, double y);
-
-  std::unique_ptr<Scene> scene;
+  // Trace the 2x2 block of pixels whose lower left corner is (i, j), with
+  // the four camera rays intersected as one packet.
+  void tracePacket(int i, int j);
+  // Trace rows [j0, j1) a bounce at a time instead of depth first. Each
+  // generation of rays is sorted by direction and origin so neighbors in
+  // the batch take similar paths, intersected as a batch, and then shaded
+  // grouped by material.
+  void traceWavefront(int j0, int j1);
+  void prepareScene();
+
+  // Worker threads pull scanlines in [j0, j1) off a shared counter until
+  // they run out, and trace, supersample or denoise them. With packets on,
+  // rows are claimed in pairs so they can be traced in 2x2 blocks; in
+  // wavefront mode they are claimed WAVEFRONT_ROWS at a time.
+  enum Pass { TRACE_PASS, AA_PASS, DENOISE_PASS };
+  static const int WAVEFRONT_ROWS = 16;
+  void startWorkers(int j0, int j1, Pass pass);
+  void workerMain(unsigned int id, int j1, Pass pass);
+  void aaRow(int j);
+  // Denoise columns [x0, x1) of rows [y0, y1), one pass at a time.
+  void denoiseRegion(int x0, int y0, int x1, int y1);
+
+  unsigned char *pixelPtr(int i, int j) {
+    return buffer.data() + (i + (j - band_start) * buffer_width) * 3;
+  }
+  float *costPtr(int i, int j);
+  float *auxPtr(int i, int j) {
+    return aux.empty() ? nullptr
+                       : aux.data() +
+                             (i + (j - band_start) * buffer_width) *
+                                 AUX_CHANNELS;
+  }
+
+  std::shared_ptr<Scene> scene;
+  Camera camera;
   std::vector<unsigned char> buffer;
+  std::vector<float> costs; // per-pixel cost, empty unless recordCosts
+  bool recordCosts = false;
+  std::vector<float> aux; // camera ray hits, empty unless denoising
+  Denoiser *denoiser = nullptr; // while denoiseRegion() runs
+  int denoisePass = 0;
+  bool usePackets = false;
+  bool useWavefront = false;
+  uint32_t sampleSeed = 0;
   double thresh;
   int buffer_width, buffer_height;
+  int band_start; // first image row held in buffer
+  int col_begin = 0, col_end = 0; // columns the workers trace
   bool m_bBufferReady;
 
+  std::vector<std::thread> workers;
+  int slot_first = 0, slot_count = 0;
+  std::atomic<int> nextRow;
+  std::atomic<unsigned int> workersDone;
+
   int bufferSize;
   unsigned int threads;
   int block_size;
@@ -9,6 +9,14 @@ using namespace std;
 const double HUGE_DOUBLE = 1e100;
 
 bool Box::intersectLocal(ray &r, isect &i) const {
+  if (!intersectShape(r, i))
+    return false;
+  i.setObject(this);
+  i.setMaterial(materialIndex);
+  return true;
+}
+
+bool Box::intersectShape(ray &r, isect &i) {
   glm::dvec3 p = r.getPosition();
   glm::dvec3 d = r.getDirection();
   //        d.normalize();
@@ -50,8 +58,6 @@ bool Box::intersectLocal(ray &r, isect &i) const {
     return false;
 
   i.setT(bestT);
-  i.setObject(this);
-  i.setMaterial(this->getMaterial());
 
   // glm::dvec3 intersect_point = r.at((float)i.t);
   glm::dvec3 intersect_point = r.at(i);
@@ -5,7 +5,7 @@
 
 class Cone : public SceneObject {
 public:
-  Cone(Scene *scene, Material *mat, double h = 1.0, double br = 1.0,
+  Cone(Scene *scene, const Material *mat, double h = 1.0, double br = 1.0,
        double tr = 0.0, bool cap = false)
       : SceneObject(scene, mat) {
     height = h;
@@ -54,8 +54,33 @@ public:
   bool intersectBody(const ray &r, isect &i) const;
   bool intersectCaps(const ray &r, isect &i) const;
 
+  // What the intersection test needs to know about a cone
+  struct Shape {
+    bool capped;
+    double height;
+    double b_radius;
+    double t_radius;
+    double beta_squared;
+    double gamma;
+
+    bool isGoodRoot(const glm::dvec3 &root) const {
+      return !(root[2] < 0 || root[2] > height);
+    }
+  };
+  Shape shape() const {
+    return {capped, height, b_radius, t_radius, beta_squared, gamma};
+  }
+
+  // The test against a cone of the given shape, without the object and
+  // material of the hit
+  static bool intersectShape(const Shape &s, ray &r, isect &i);
+
+  double getHeight() const { return height; }
+  double getBottomRadius() const { return b_radius; }
+  double getTopRadius() const { return t_radius; }
+  bool isCapped() const { return capped; }
+
 protected:
-  bool isGoodRoot(glm::dvec3 root) const;
   double radiusAt(double h) const;
 
   bool capped;
@@ -65,10 +90,6 @@ protected:
 
   double beta, beta_squared;
   double gamma, gamma_squared;
-
-protected:
-  void glDrawLocal(int quality, bool actualMaterials,
-                   bool actualTextures) const;
 };
 
 #endif // __CONE_H__
@@ -5,26 +5,28 @@
 using namespace std;
 
 bool Cylinder::intersectLocal(ray &r, isect &i) const {
-  // FIXME: check these suspicious initialization.
+  if (!intersectShape(capped, r, i))
+    return false;
   i.setObject(this);
-  i.setMaterial(this->getMaterial());
+  i.setMaterial(materialIndex);
+  return true;
+}
 
-  if (intersectCaps(r, i)) {
+bool Cylinder::intersectShape(bool capped, ray &r, isect &i) {
+  if (intersectCaps(capped, r, i)) {
     isect ii;
-    if (intersectBody(r, ii)) {
+    if (intersectBody(capped, r, ii)) {
       if (ii.getT() < i.getT()) {
         i = ii;
-        i.setObject(this);
-        i.setMaterial(this->getMaterial());
       }
     }
     return true;
   } else {
-    return intersectBody(r, i);
+    return intersectBody(capped, r, i);
   }
 }
 
-bool Cylinder::intersectBody(const ray &r, isect &i) const {
+bool Cylinder::intersectBody(bool capped, const ray &r, isect &i) {
   double x0 = r.getPosition()[0];
   double y0 = r.getPosition()[1];
   double x1 = r.getDirection()[0];
@@ -88,7 +90,7 @@ bool Cylinder::intersectBody(const ray &r, isect &i) const {
   return false;
 }
 
-bool Cylinder::intersectCaps(const ray &r, isect &i) const {
+bool Cylinder::intersectCaps(bool capped, const ray &r, isect &i) {
   if (!capped) {
     return false;
   }
@@ -5,7 +5,7 @@
 
 class Cylinder : public SceneObject {
 public:
-  Cylinder(Scene *scene, Material *mat)
+  Cylinder(Scene *scene, const Material *mat)
       : SceneObject(scene, mat), capped(true) {}
 
   virtual bool intersectLocal(ray &r, isect &i) const;
@@ -18,17 +18,17 @@ public:
     return localbounds;
   }
 
-  bool intersectBody(const ray &r, isect &i) const;
-  bool intersectCaps(const ray &r, isect &i) const;
+  // The test against the unit cylinder, capped or not, without the object
+  // and material of the hit
+  static bool intersectShape(bool capped, ray &r, isect &i);
+  static bool intersectBody(bool capped, const ray &r, isect &i);
+  static bool intersectCaps(bool capped, const ray &r, isect &i);
 
   void setCapped(bool capped) { this->capped = capped; }
+  bool isCapped() const { return capped; }
 
 protected:
   bool capped;
-
-protected:
-  void glDrawLocal(int quality, bool actualMaterials,
-                   bool actualTextures) const;
 };
 
 #endif // __CYLINDER_H__
@@ -7,6 +7,14 @@
 using namespace std;
 
 bool Sphere::intersectLocal(ray &r, isect &i) const {
+  if (!intersectShape(r, i))
+    return false;
+  i.setObject(this);
+  i.setMaterial(materialIndex);
+  return true;
+}
+
+bool Sphere::intersectShape(ray &r, isect &i) {
   r.setDirection(glm::normalize(r.getDirection()));
   glm::dvec3 v = -r.getPosition();
   double b = glm::dot(v, r.getDirection());
@@ -23,9 +31,6 @@ bool Sphere::intersectLocal(ray &r, isect &i) const {
     return false;
   }
 
-  i.setObject(this);
-  i.setMaterial(this->getMaterial());
-
   double t1 = b - discriminant;
 
   if (t1 > RAY_EPSILON) {
@@ -5,20 +5,20 @@
 
 class Sphere : public SceneObject {
 public:
-  Sphere(Scene *scene, Material *mat) : SceneObject(scene, mat) {}
+  Sphere(Scene *scene, const Material *mat) : SceneObject(scene, mat) {}
 
   virtual bool intersectLocal(ray &r, isect &i) const;
   virtual bool hasBoundingBoxCapability() const { return true; }
 
+  // The test against the unit sphere, without the object and material of
+  // the hit, for callers that keep their own copy of the sphere
+  static bool intersectShape(ray &r, isect &i);
+
   virtual BoundingBox ComputeLocalBoundingBox() {
     BoundingBox localbounds;
     localbounds.setMin(glm::dvec3(-1.0f, -1.0f, -1.0f));
     localbounds.setMax(glm::dvec3(1.0f, 1.0f, 1.0f));
     return localbounds;
   }
-
-protected:
-  void glDrawLocal(int quality, bool actualMaterials,
-                   bool actualTextures) const;
 };
 #endif // __SPHERE_H__
@@ -4,8 +4,15 @@
 
 using namespace std;
 
-// Test
 bool Square::intersectLocal(ray &r, isect &i) const {
+  if (!intersectShape(r, i))
+    return false;
+  i.setObject(this);
+  i.setMaterial(materialIndex);
+  return true;
+}
+
+bool Square::intersectShape(ray &r, isect &i) {
   glm::dvec3 p = r.getPosition();
   glm::dvec3 d = r.getDirection();
 
@@ -29,8 +36,6 @@ bool Square::intersectLocal(ray &r, isect &i) const {
     return false;
   }
 
-  i.setObject(this);
-  i.setMaterial(this->getMaterial());
   i.setT(t);
   if (d[2] > 0.0) {
     i.setN(glm::dvec3(0.0, 0.0, -1.0));
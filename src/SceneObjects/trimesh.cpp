@@ -13,11 +13,39 @@ extern TraceUI *traceUI;
 
 using namespace std;
 
-Trimesh::~Trimesh() {
-  for (auto f : faces)
-    delete f;
+namespace {
+const double SNORM16 = 32767.0;
+
+double signNotZero(double v) { return v < 0.0 ? -1.0 : 1.0; }
+
+// Map a unit vector onto the octahedron |x| + |y| + |z| = 1 and unfold the
+// lower half over the upper one, so two numbers in [-1, 1] are left.
+glm::dvec2 octEncode(const glm::dvec3 &n) {
+  double l1 = std::fabs(n[0]) + std::fabs(n[1]) + std::fabs(n[2]);
+  if (l1 == 0.0)
+    return glm::dvec2(0.0, 0.0);
+  double x = n[0] / l1, y = n[1] / l1;
+  if (n[2] < 0.0)
+    return glm::dvec2((1.0 - std::fabs(y)) * signNotZero(x),
+                      (1.0 - std::fabs(x)) * signNotZero(y));
+  return glm::dvec2(x, y);
 }
 
+glm::dvec3 octDecode(double x, double y) {
+  double z = 1.0 - std::fabs(x) - std::fabs(y);
+  if (z < 0.0) {
+    double fx = (1.0 - std::fabs(y)) * signNotZero(x);
+    y = (1.0 - std::fabs(x)) * signNotZero(y);
+    x = fx;
+  }
+  return glm::normalize(glm::dvec3(x, y, z));
+}
+
+uint8_t unorm8(double v) {
+  return (uint8_t)std::lround(255.0 * std::clamp(v, 0.0, 1.0));
+}
+} // namespace
+
 // must add vertices, normals, and materials IN ORDER
 void Trimesh::addVertex(const glm::dvec3 &v) { vertices.emplace_back(v); }
 
@@ -29,16 +57,19 @@ void Trimesh::addUV(const glm::dvec2 &uv) { uvCoords.emplace_back(uv); }
 
 // Returns false if the vertices a,b,c don't all exist
 bool Trimesh::addFace(int a, int b, int c) {
-  int vcnt = vertices.size();
+  int vcnt = vertexCount();
 
   if (a >= vcnt || b >= vcnt || c >= vcnt)
     return false;
 
-  TrimeshFace *newFace = new TrimeshFace(this, a, b, c);
-  if (!newFace->degen)
-    faces.push_back(newFace);
-  else
-    delete newFace;
+  // A face with two corners in the same place can't be hit
+  glm::dvec3 va = vertex(a), vb = vertex(b), vc = vertex(c);
+  if (va == vb || va == vc || vb == vc)
+    return true;
+
+  // Faces live in the scene's arena, next to the mesh's other faces
+  faceIds.insert(faceIds.end(), {(uint32_t)a, (uint32_t)b, (uint32_t)c});
+  faces.push_back(scene->create<TrimeshFace>(this, (uint32_t)faces.size()));
 
   // Don't add faces to the scene's object list so we can cull by bounding
   // box
@@ -58,20 +89,98 @@ const char *Trimesh::doubleCheck() {
   return 0;
 }
 
+bool Trimesh::compress() {
+  if (packed)
+    return false;
+
+  BoundingBox bounds = ComputeLocalBoundingBox();
+  center = 0.5 * (bounds.getMin() + bounds.getMax());
+  packedVertices.reserve(vertices.size());
+  for (const glm::dvec3 &v : vertices)
+    packedVertices.emplace_back(v - center);
+
+  packedNormals.reserve(normals.size());
+  for (const glm::dvec3 &n : normals) {
+    glm::dvec2 e = octEncode(n);
+    packedNormals.push_back({(int16_t)std::lround(e[0] * SNORM16),
+                             (int16_t)std::lround(e[1] * SNORM16)});
+  }
+
+  if (!uvCoords.empty()) {
+    glm::dvec2 uvMax = uvCoords[0];
+    uvMin = uvCoords[0];
+    for (const glm::dvec2 &uv : uvCoords) {
+      uvMin = glm::min(uvMin, uv);
+      uvMax = glm::max(uvMax, uv);
+    }
+    uvScale = (uvMax - uvMin) / 65535.0;
+    packedUVs.reserve(uvCoords.size());
+    for (const glm::dvec2 &uv : uvCoords) {
+      PackedUV p = {0, 0};
+      if (uvScale[0] > 0.0)
+        p.u = (uint16_t)std::lround((uv[0] - uvMin[0]) / uvScale[0]);
+      if (uvScale[1] > 0.0)
+        p.v = (uint16_t)std::lround((uv[1] - uvMin[1]) / uvScale[1]);
+      packedUVs.push_back(p);
+    }
+  }
+
+  packedColors.reserve(vertColors.size());
+  for (const glm::dvec3 &c : vertColors)
+    packedColors.push_back({unorm8(c[0]), unorm8(c[1]), unorm8(c[2]), 255});
+
+  if (vertices.size() <= 65536) {
+    packedFaceIds.assign(faceIds.begin(), faceIds.end());
+    std::vector<uint32_t>().swap(faceIds);
+  }
+
+  Vertices().swap(vertices);
+  Normals().swap(normals);
+  UVCoords().swap(uvCoords);
+  VertColors().swap(vertColors);
+  packed = true;
+  return true;
+}
+
+glm::dvec3 Trimesh::vertexNormal(size_t k) const {
+  if (!packed)
+    return normals[k];
+  return octDecode(packedNormals[k].x / SNORM16, packedNormals[k].y / SNORM16);
+}
+
+glm::dvec2 Trimesh::vertexUV(size_t k) const {
+  if (!packed)
+    return uvCoords[k];
+  return uvMin + glm::dvec2(packedUVs[k].u, packedUVs[k].v) * uvScale;
+}
+
+glm::dvec3 Trimesh::vertexColor(size_t k) const {
+  if (!packed)
+    return vertColors[k];
+  const PackedColor &c = packedColors[k];
+  return glm::dvec3(c.r, c.g, c.b) / 255.0;
+}
+
 bool Trimesh::intersectLocal(ray &r, isect &i) const {
-  bool have_one = false;
+  if (ray_cost)
+    ray_cost->primTests += faces.size();
+  const TrimeshFace *best = nullptr;
+  double tBest = 0.0, betaBest = 0.0, gammaBest = 0.0;
   for (auto face : faces) {
-    isect cur;
-    if (face->intersectLocal(r, cur)) {
-      if (!have_one || (cur.getT() < i.getT())) {
-        i = cur;
-        have_one = true;
-      }
+    double t, beta, gamma;
+    if (face->hitLocal(r, t, beta, gamma) && (!best || t < tBest)) {
+      best = face;
+      tBest = t;
+      betaBest = beta;
+      gammaBest = gamma;
     }
   }
-  if (!have_one)
+  if (!best) {
     i.setT(1000.0);
-  return have_one;
+    return false;
+  }
+  best->fillHit(i, tBest, betaBest, gammaBest);
+  return true;
 }
 
 bool TrimeshFace::intersect(ray &r, isect &i) const {
@@ -79,14 +188,19 @@ bool TrimeshFace::intersect(ray &r, isect &i) const {
 }
 
 
-// Intersect ray r with the triangle abc.  If it hits returns true,
-// and put the parameter in t and the barycentric coordinates of the
-// intersection in u (alpha) and v (beta).
 bool TrimeshFace::intersectLocal(ray &r, isect &i) const {
-  if (degen) {
+  double t, beta, gamma;
+  if (!hitLocal(r, t, beta, gamma))
     return false;
-  }
+  fillHit(i, t, beta, gamma);
+  return true;
+}
 
+// Intersect ray r with the triangle abc.  If it hits returns true,
+// and put the parameter in t and the barycentric coordinates of b and c
+// at the intersection in beta and gamma.
+bool TrimeshFace::hitLocal(const ray &r, double &t, double &beta,
+                           double &gamma) const {
   // YOUR CODE HERE
   //
   // FIXME: Add ray-trimesh intersection
@@ -94,14 +208,18 @@ bool TrimeshFace::intersectLocal(ray &r, isect &i) const {
   glm::dvec3 d = r.getDirection();
 
   // gives us the points in 3d space of abc
-  glm::dvec3 a_coords = parent->vertices[ids[0]];
-  glm::dvec3 b_coords = parent->vertices[ids[1]];
-  glm::dvec3 c_coords = parent->vertices[ids[2]];
+  glm::dvec3 a_coords = parent->vertex((*this)[0]);
+  glm::dvec3 b_coords = parent->vertex((*this)[1]);
+  glm::dvec3 c_coords = parent->vertex((*this)[2]);
+
+  // The plane's normal needn't be unit length for the tests below. If the
+  // corners have collapsed together it's zero, and nothing hits.
+  glm::dvec3 normal = glm::cross(b_coords - a_coords, c_coords - a_coords);
 
   // first find if ray has intersection with plane
   auto denominator =  glm::dot(d, normal);
   if (denominator == 0.0) return false;
-  double t = glm::dot((a_coords - p), normal) / denominator;
+  t = glm::dot((a_coords - p), normal) / denominator;
   if (t < RAY_EPSILON) return false;
 
   // now we have a t such that p + dt is on the plane, check if in bounds
@@ -116,7 +234,8 @@ bool TrimeshFace::intersectLocal(ray &r, isect &i) const {
   auto pb = plane_p - b_coords;
   auto pc = plane_p - c_coords;
 
-  if (!validPoint(ba, pa) || !validPoint(cb, pb) || !validPoint(ac, pc)) {
+  if (!validPoint(ba, pa, normal) || !validPoint(cb, pb, normal) ||
+      !validPoint(ac, pc, normal)) {
     return false;
   }
 
@@ -133,48 +252,49 @@ bool TrimeshFace::intersectLocal(ray &r, isect &i) const {
   glm::dmat2x2 mass_mat(a_r, b_r, c_r, d_r);
   auto res = glm::inverse(mass_mat) * glm::dvec2(glm::dot(cp1, p2p1), glm::dot(cp1, p3p1));
 
-  auto beta = res[0];
-  auto gamma = res[1];
+  beta = res[0];
+  gamma = res[1];
   auto alpha = 1 - beta - gamma; // there should be no problems since we already determined point as valid
   if (alpha < 0 || beta < 0 || gamma < 0) { // can also check if they are larger than 1 but thats chill I hope
     return false;
   }
+  return true;
+}
+
+void TrimeshFace::fillHit(isect &i, double t, double beta,
+                          double gamma) const {
+  double alpha = 1.0 - beta - gamma;
   i.setBary(alpha, beta, gamma);
 
-  auto n = normal;
-  if (parent->vertNorms && !parent->normals.empty()) {
-    n = alpha * parent->normals[ids[0]] +
-        beta * parent->normals[ids[1]] +
-        gamma * parent->normals[ids[2]];
+  const int ids[3] = {(*this)[0], (*this)[1], (*this)[2]};
+  glm::dvec3 n;
+  if (parent->vertNorms && parent->hasNormals()) {
+    n = alpha * parent->vertexNormal(ids[0]) +
+        beta * parent->vertexNormal(ids[1]) +
+        gamma * parent->vertexNormal(ids[2]);
     n = glm::normalize(n);
+  } else {
+    n = getNormal();
   }
 
   i.setT(t);
   i.setN(n);
   i.setObject(parent);
-
-// std::cout << "a: " << a_coords
-//           << " b: " << b_coords
-//           << " c: " << c_coords << std::endl;
-  if (!parent->uvCoords.empty()) {
+  i.setMaterial(parent->materialIndex);
+  if (parent->hasUVs()) {
     i.setUVCoordinates(
-alpha * parent->uvCoords[ids[0]] +
-      beta  * parent->uvCoords[ids[1]] +
-      gamma * parent->uvCoords[ids[2]]
+alpha * parent->vertexUV(ids[0]) +
+      beta  * parent->vertexUV(ids[1]) +
+      gamma * parent->vertexUV(ids[2])
     );
-    i.setMaterial(parent->material);
   }
-  else if (!parent->vertColors.empty()) {
-    Material m = parent->material;
-    m.setDiffuse(
-   alpha * parent->vertColors[ids[0]] +
-      beta  * parent->vertColors[ids[1]] +
-      gamma * parent->vertColors[ids[2]]
+  else if (parent->hasColors()) {
+    // The interpolated color replaces the material's diffuse color
+    i.setVertexColor(
+   alpha * parent->vertexColor(ids[0]) +
+      beta  * parent->vertexColor(ids[1]) +
+      gamma * parent->vertexColor(ids[2])
     );
-    i.setMaterial(m);
-  }
-  else {
-    i.setMaterial(parent->material);
   }
 
   /* To determine the color of an intersection, use the following rules:
@@ -183,17 +303,23 @@ alpha * parent->uvCoords[ids[0]] +
        the intersection using i.setUVCoordinates().
      - Otherwise, if the parent mesh has non-empty `vertexColors`,
        barycentrically interpolate the colors from the three vertices of the
-       face. Create a new material by copying the parent's material, set the
-       diffuse color of this material to the interpolated color, and then 
-       assign this material to the intersection.
-     - If neither is true, assign the parent's material to the intersection.
+       face and assign it with i.setVertexColor(); Material::kd() then uses
+       it in place of the parent's diffuse color.
+     - Either way the intersection refers to the parent's material.
   */
-
-  return true;
 }
 
 
-bool TrimeshFace::validPoint(glm::dvec3 &side_vec, glm::dvec3 &point_vec) const {
+glm::dvec3 TrimeshFace::getNormal() const {
+  glm::dvec3 a = parent->vertex((*this)[0]);
+  glm::dvec3 b = parent->vertex((*this)[1]);
+  glm::dvec3 c = parent->vertex((*this)[2]);
+  return glm::normalize(glm::cross(b - a, c - a));
+}
+
+bool TrimeshFace::validPoint(const glm::dvec3 &side_vec,
+                             const glm::dvec3 &point_vec,
+                             const glm::dvec3 &normal) const {
   return glm::dot(glm::cross(side_vec, point_vec), normal) >= 0;
 }
 
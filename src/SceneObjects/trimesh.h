@@ -3,6 +3,7 @@
 
 #include <list>
 #include <memory>
+#include <stdint.h>
 #include <vector>
 
 #include "../scene/kdTree.h"
@@ -25,15 +26,39 @@ class Trimesh : public SceneObject {
 
   Vertices vertices;
   Faces faces;
+  // Three vertex ids per face, in the order of `faces`
+  std::vector<uint32_t> faceIds;
   Normals normals;
   VertColors vertColors;
   UVCoords uvCoords;
   BoundingBox localBounds;
 
+  // The same data once compress()ed: positions as float offsets from the
+  // center of the mesh's box, normals octahedral-encoded in two 16-bit
+  // fixed point numbers, UVs in 16 bits across their range, and colors in
+  // 8 bits a channel. That's 24 bytes a vertex with everything, down from
+  // 88. Face vertex ids drop to 16 bits if there are few enough vertices.
+  struct PackedNormal {
+    int16_t x, y;
+  };
+  struct PackedUV {
+    uint16_t u, v;
+  };
+  struct PackedColor {
+    uint8_t r, g, b, a;
+  };
+  bool packed = false;
+  glm::dvec3 center;
+  glm::dvec2 uvMin, uvScale;
+  std::vector<glm::vec3> packedVertices;
+  std::vector<PackedNormal> packedNormals;
+  std::vector<PackedUV> packedUVs;
+  std::vector<PackedColor> packedColors;
+  std::vector<uint16_t> packedFaceIds; // replaces faceIds if not empty
+
 public:
-  Trimesh(Scene *scene, Material *mat, MatrixTransform transform)
-      : SceneObject(scene, mat), displayListWithMaterials(0),
-        displayListWithoutMaterials(0) {
+  Trimesh(Scene *scene, const Material *mat, MatrixTransform transform)
+      : SceneObject(scene, mat) {
     this->transform = transform;
     vertNorms = false;
   }
@@ -42,8 +67,6 @@ public:
 
   bool intersectLocal(ray &r, isect &i) const;
 
-  ~Trimesh();
-
   // must add vertices, normals, and materials IN ORDER
   void addVertex(const glm::dvec3 &);
   void addNormal(const glm::dvec3 &);
@@ -55,33 +78,61 @@ public:
 
   void generateNormals();
 
+  // Switch to the compact storage described above, once the mesh is
+  // complete; nothing may be added to it afterwards. Positions keep about
+  // seven significant digits relative to the mesh's size. Returns false if
+  // the mesh was already compressed.
+  bool compress();
+  bool isCompressed() const { return packed; }
+
   bool hasBoundingBoxCapability() const { return true; }
 
   BoundingBox ComputeLocalBoundingBox() {
     BoundingBox localbounds;
-    if (vertices.size() == 0)
+    if (vertexCount() == 0)
       return localbounds;
-    localbounds.setMax(vertices[0]);
-    localbounds.setMin(vertices[0]);
-    Vertices::const_iterator viter;
-    for (viter = vertices.begin(); viter != vertices.end(); ++viter) {
-      localbounds.setMax(glm::max(localbounds.getMax(), *viter));
-      localbounds.setMin(glm::min(localbounds.getMin(), *viter));
+    localbounds.setMax(vertex(0));
+    localbounds.setMin(vertex(0));
+    for (size_t k = 1; k < vertexCount(); ++k) {
+      localbounds.setMax(glm::max(localbounds.getMax(), vertex(k)));
+      localbounds.setMin(glm::min(localbounds.getMin(), vertex(k)));
     }
     localBounds = localbounds;
     return localbounds;
   }
 
-protected:
-  void glDrawLocal(int quality, bool actualMaterials,
-                   bool actualTextures) const;
-  mutable int displayListWithMaterials;
-  mutable int displayListWithoutMaterials;
+  const Faces &getFaces() const { return faces; }
+
+  // Per-vertex data, however it's stored. Positions are decoded on every
+  // intersection test, the rest only for the hit that's kept.
+  size_t vertexCount() const {
+    return packed ? packedVertices.size() : vertices.size();
+  }
+  glm::dvec3 vertex(size_t k) const {
+    return packed ? center + glm::dvec3(packedVertices[k]) : vertices[k];
+  }
+  bool hasNormals() const {
+    return packed ? !packedNormals.empty() : !normals.empty();
+  }
+  bool hasUVs() const {
+    return packed ? !packedUVs.empty() : !uvCoords.empty();
+  }
+  bool hasColors() const {
+    return packed ? !packedColors.empty() : !vertColors.empty();
+  }
+  // Vertex id k (0-2) of face `face`
+  size_t faceVertex(uint32_t face, int k) const {
+    size_t n = 3 * (size_t)face + k;
+    return packedFaceIds.empty() ? faceIds[n] : packedFaceIds[n];
+  }
+  glm::dvec3 vertexNormal(size_t k) const;
+  glm::dvec2 vertexUV(size_t k) const;
+  glm::dvec3 vertexColor(size_t k) const;
 };
 
 /* A triangle in a mesh. This class looks and behaves a lot like other
 SceneObjects (e.g. Trimesh, Sphere, etc.) and has many of the same members
-like intersectLocal() and a BoundingBox.
+like intersectLocal() and ComputeLocalBoundingBox().
 
 However, SceneObjects must have a MatrixTransform and a Material, and storing
 these in every single TrimeshFace would explode memory usage. Because of this,
@@ -89,74 +140,46 @@ TrimeshFace is treated as an implementation detail of Trimesh and is not within
 the SceneObject hierarchy.
 
 Access to materials and transform are provided by referencing the parent
-Trimesh object. */
+Trimesh object. A face is no more than its mesh and its place in the mesh:
+the vertex ids are kept in the mesh, and the plane is worked out from the
+vertices as they are stored, so it always agrees with them even once the
+mesh is compressed. */
 class TrimeshFace {
   Trimesh *parent;
-  int ids[3];
-  glm::dvec3 normal;
-  double dist;
-  BoundingBox bounds;
+  uint32_t index; // in the parent's faces
 
 public:
-  TrimeshFace(Trimesh *parent, int a, int b, int c) {
-    this->parent = parent;
-    ids[0] = a;
-    ids[1] = b;
-    ids[2] = c;
-
-    // Compute the face normal here, not on the fly
-    glm::dvec3 a_coords = parent->vertices[a];
-    glm::dvec3 b_coords = parent->vertices[b];
-    glm::dvec3 c_coords = parent->vertices[c];
-
-    glm::dvec3 vab = (b_coords - a_coords);
-    glm::dvec3 vac = (c_coords - a_coords);
-    glm::dvec3 vcb = (b_coords - c_coords);
-
-    if (glm::length(vab) == 0.0 || glm::length(vac) == 0.0 ||
-        glm::length(vcb) == 0.0)
-      degen = true;
-    else {
-      degen = false;
-      normal = glm::cross(b_coords - a_coords, c_coords - a_coords);
-      normal = glm::normalize(normal);
-      dist = glm::dot(normal, a_coords);
-    }
-    localbounds = ComputeLocalBoundingBox();
-    bounds = localbounds;
-  }
+  TrimeshFace(Trimesh *parent, uint32_t index)
+      : parent(parent), index(index) {}
 
-  BoundingBox localbounds;
-  bool degen;
+  int operator[](int i) const { return (int)parent->faceVertex(index, i); }
 
-  int operator[](int i) const { return ids[i]; }
-
-  glm::dvec3 getNormal() { return normal; }
+  // The unit normal of the face, wound counterclockwise
+  glm::dvec3 getNormal() const;
 
   bool intersect(ray &r, isect &i) const;
   bool intersectLocal(ray &r, isect &i) const;
   Trimesh *getParent() const { return parent; }
 
+  // intersectLocal() in two halves: finding where r hits the face, and
+  // filling in the hit from the vertex data. Meshes search their faces
+  // with the first and only fill in the closest hit.
+  bool hitLocal(const ray &r, double &t, double &beta, double &gamma) const;
+  void fillHit(isect &i, double t, double beta, double gamma) const;
+
   bool hasBoundingBoxCapability() const { return true; }
 
-  BoundingBox ComputeLocalBoundingBox() {
-    BoundingBox localbounds;
-    localbounds.setMax(
-        glm::max(parent->vertices[ids[0]], parent->vertices[ids[1]]));
-    localbounds.setMin(
-        glm::min(parent->vertices[ids[0]], parent->vertices[ids[1]]));
-
-    localbounds.setMax(
-        glm::max(parent->vertices[ids[2]], localbounds.getMax()));
-    localbounds.setMin(
-        glm::min(parent->vertices[ids[2]], localbounds.getMin()));
-    return localbounds;
+  BoundingBox ComputeLocalBoundingBox() const {
+    glm::dvec3 a = parent->vertex((*this)[0]);
+    glm::dvec3 b = parent->vertex((*this)[1]);
+    glm::dvec3 c = parent->vertex((*this)[2]);
+    return BoundingBox(glm::min(glm::min(a, b), c),
+                       glm::max(glm::max(a, b), c));
   }
 
-  const BoundingBox &getBoundingBox() const { return localbounds; }
 private:
-  bool validPoint(glm::dvec3 &side_vec, glm::dvec3 &point_vec) const;
-
+  bool validPoint(const glm::dvec3 &side_vec, const glm::dvec3 &point_vec,
+                  const glm::dvec3 &normal) const;
 };
 
 #endif // TRIMESH_H__
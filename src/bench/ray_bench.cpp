@@ -0,0 +1,543 @@
+//
+// ray_bench.cpp
+//
+// Micro-benchmarks for the intersection and shading kernels, plus whole
+// frames. Every kernel runs over the same seeded set of random rays a
+// number of times; the median rate is reported along with the spread, so
+// two builds can be compared run against run.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#ifndef _MSC_VER
+#include <unistd.h>
+#else
+extern char *optarg;
+extern int optind, opterr, optopt;
+extern int getopt(int argc, char **argv, const char *optstring);
+#endif
+
+#include "../RayTracer.h"
+#include "../SceneObjects/Box.h"
+#include "../SceneObjects/Cone.h"
+#include "../SceneObjects/Cylinder.h"
+#include "../SceneObjects/Sphere.h"
+#include "../SceneObjects/Square.h"
+#include "../SceneObjects/trimesh.h"
+#include "../scene/bvh.h"
+#include "../scene/light.h"
+#include "../scene/scene.h"
+#include "../ui/TraceUI.h"
+
+#include <glm/gtc/matrix_transform.hpp>
+
+using namespace std;
+
+extern TraceUI *traceUI;
+
+namespace {
+typedef std::chrono::steady_clock Clock;
+
+// The benchmarks only need the settings half of a UI
+class BenchUI : public TraceUI {
+public:
+  BenchUI(int depth) { m_nDepth = depth; }
+  void setWavefront(bool on) { m_wavefront = on; }
+  int run() { return 0; }
+  void alert(const string &msg) { cerr << msg << endl; }
+};
+
+// Counts hardware cache misses in this process, including the render
+// threads it starts, between start() and stop(). Where perf events aren't
+// available stop() returns -1.
+class CacheMisses {
+public:
+  CacheMisses() {
+#ifdef __linux__
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+  }
+  ~CacheMisses() {
+#ifdef __linux__
+    if (fd >= 0)
+      close(fd);
+#endif
+  }
+
+  void start() {
+#ifdef __linux__
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+  }
+
+  // Worker threads only hand their counts over when they exit, so the
+  // render must have been waited for.
+  long long stop() {
+#ifdef __linux__
+    long long count;
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+      if (read(fd, &count, sizeof(count)) == sizeof(count))
+        return count;
+    }
+#endif
+    return -1;
+  }
+
+private:
+  int fd = -1;
+};
+
+struct Options {
+  size_t rays = 1 << 16;
+  int reps = 9;
+  unsigned seed = 1;
+  int width = 256;
+  int triangles = 64;
+  string only; // run only kernels whose name contains this
+};
+
+// Rays from a shell of radius 4 around the origin, aimed at random points
+// of the [-1, 1] cube, so most of them come near the unit-sized test shapes.
+vector<ray> randomRays(size_t count, unsigned seed) {
+  std::mt19937_64 rng(seed);
+  std::uniform_real_distribution<double> u(-1.0, 1.0);
+  vector<ray> rays;
+  rays.reserve(count);
+  while (rays.size() < count) {
+    glm::dvec3 p(u(rng), u(rng), u(rng));
+    double len = glm::length(p);
+    if (len < 1e-3 || len > 1.0)
+      continue;
+    glm::dvec3 origin = p * (4.0 / len);
+    glm::dvec3 target(u(rng), u(rng), u(rng));
+    rays.emplace_back(origin, glm::normalize(target - origin),
+                      glm::dvec3(1.0, 1.0, 1.0), ray::VISIBILITY);
+  }
+  return rays;
+}
+
+struct Stats {
+  double median, min, max; // nanoseconds per test
+  double hitRate;
+};
+
+// Time `pass` reps times; each pass performs `tests` tests and returns how
+// many of them hit.
+template <typename Pass>
+Stats measure(const Options &opts, size_t tests, Pass pass) {
+  vector<double> ns;
+  size_t hits = 0;
+  pass(); // warm up caches and branch predictors
+  for (int k = 0; k < opts.reps; k++) {
+    auto start = Clock::now();
+    hits = pass();
+    double elapsed =
+        std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    ns.push_back(elapsed / tests);
+  }
+  std::sort(ns.begin(), ns.end());
+  return {ns[ns.size() / 2], ns.front(), ns.back(), double(hits) / tests};
+}
+
+void report(const string &name, const Stats &s, const char *unit = "test") {
+  cout << left << setw(24) << name << right << fixed << setprecision(2)
+       << setw(10) << s.median << " ns/" << setw(5) << left << unit << right
+       << setw(10) << 1e3 / s.median << " M/s" << "   min " << s.min
+       << "  max " << s.max << "  hits " << setprecision(1)
+       << 100.0 * s.hitRate << "%" << endl;
+}
+
+bool wanted(const Options &opts, const string &name) {
+  return opts.only.empty() || name.find(opts.only) != string::npos;
+}
+
+template <typename Shape>
+void benchShape(const Options &opts, const string &name, const Shape &shape,
+                vector<ray> &rays) {
+  if (!wanted(opts, name))
+    return;
+  Stats s = measure(opts, rays.size(), [&] {
+    size_t hits = 0;
+    for (ray &r : rays) {
+      isect i;
+      hits += shape.intersectLocal(r, i);
+    }
+    return hits;
+  });
+  report(name, s);
+}
+
+void benchTriangles(const Options &opts, Scene &scene, Material &mat,
+                    vector<ray> &rays) {
+  if (!wanted(opts, "TrimeshFace"))
+    return;
+
+  // A soup of small random triangles filling the unit cube
+  Trimesh mesh(&scene, &mat, MatrixTransform());
+  std::mt19937_64 rng(opts.seed + 1);
+  std::uniform_real_distribution<double> u(-1.0, 1.0);
+  for (int t = 0; t < opts.triangles; t++) {
+    glm::dvec3 c(u(rng), u(rng), u(rng));
+    for (int k = 0; k < 3; k++)
+      mesh.addVertex(c + 0.4 * glm::dvec3(u(rng), u(rng), u(rng)));
+    mesh.addFace(3 * t, 3 * t + 1, 3 * t + 2);
+  }
+
+  // Each ray is tested against every face of the mesh
+  size_t tests = rays.size() * opts.triangles;
+  Stats s = measure(opts, tests, [&] {
+    size_t hits = 0;
+    for (ray &r : rays) {
+      isect i;
+      hits += mesh.intersectLocal(r, i);
+    }
+    return hits;
+  });
+  report("TrimeshFace", s);
+}
+
+void benchBoundingBox(const Options &opts, vector<ray> &rays) {
+  if (!wanted(opts, "BoundingBox"))
+    return;
+  BoundingBox box(glm::dvec3(-1.0), glm::dvec3(1.0));
+  Stats s = measure(opts, rays.size(), [&] {
+    size_t hits = 0;
+    for (const ray &r : rays) {
+      double tmin, tmax;
+      hits += box.intersect(r, tmin, tmax);
+    }
+    return hits;
+  });
+  report("BoundingBox::intersect", s);
+}
+
+// A few seeded random spheres and boxes under a point and a directional
+// light, looked at from +z.
+Scene *randomScene(unsigned seed) {
+  Scene *scene = new Scene();
+  std::mt19937_64 rng(seed);
+  std::uniform_real_distribution<double> u(-1.0, 1.0);
+
+  Material mat(glm::dvec3(0.0), glm::dvec3(0.1), glm::dvec3(0.5),
+               glm::dvec3(0.6, 0.5, 0.4), glm::dvec3(0.2), glm::dvec3(0.0),
+               32.0, 1.0);
+  for (int k = 0; k < 24; k++) {
+    SceneObject *obj;
+    if (k % 2)
+      obj = scene->create<Sphere>(scene, &mat);
+    else
+      obj = scene->create<Box>(scene, &mat);
+    glm::dvec3 center(2.0 * u(rng), 2.0 * u(rng), 2.0 * u(rng));
+    double size = 0.2 + 0.2 * (u(rng) + 1.0);
+    glm::dmat4 xform = glm::scale(glm::translate(glm::dmat4(1.0), center),
+                                  glm::dvec3(size));
+    obj->setTransform(MatrixTransform(xform));
+    scene->add(obj);
+  }
+  scene->add(scene->create<PointLight>(scene, glm::dvec3(3.0, 4.0, 5.0),
+                                       glm::dvec3(1.0), 0.0f, 0.0f, 0.05f));
+  scene->add(scene->create<DirectionalLight>(
+      scene, glm::dvec3(-1.0, -2.0, -1.0), glm::dvec3(0.5)));
+  scene->addAmbient(glm::dvec3(0.1));
+
+  Camera &cam = scene->getCamera();
+  cam.setEye(glm::dvec3(0.0, 0.0, 7.0));
+  cam.setLook(glm::dvec3(0.0, 0.0, -1.0), glm::dvec3(0.0, 1.0, 0.0));
+  scene->buildBVH(traceUI->getLeafSize());
+  return scene;
+}
+
+// Frame-to-frame setup for a scene with one moving object: refitting the
+// BVH around it, against building the BVH from scratch.
+void benchRefit(const Options &opts) {
+  std::unique_ptr<Scene> scene(randomScene(opts.seed));
+  Geometry *mover = scene->getAllObjects().front();
+  const glm::dmat4 start = mover->getTransform().transform();
+
+  if (wanted(opts, "BVH refit")) {
+    int frame = 0;
+    Stats s = measure(opts, 1, [&] {
+      glm::dvec3 offset(0.1 * std::sin(0.1 * frame), 0.0, 0.0);
+      glm::dmat4 moved = glm::translate(glm::dmat4(1.0), offset) * start;
+      scene->setTransform(mover, MatrixTransform(moved));
+      frame++;
+      return 1;
+    });
+    report("BVH refit (1 object)", s, "frame");
+  }
+  if (wanted(opts, "BVH build")) {
+    Stats s = measure(opts, 1, [&] {
+      scene->clearBVH();
+      scene->buildBVH(traceUI->getLeafSize());
+      return 1;
+    });
+    report("BVH build", s, "frame");
+  }
+}
+
+// A soup of 64k small triangles filling the unit cube, with per-vertex
+// normals and UVs if asked for.
+Trimesh *triangleSoup(Scene &scene, const Material &mat, unsigned seed,
+                      bool attributes) {
+  Trimesh *mesh = scene.create<Trimesh>(&scene, &mat, MatrixTransform());
+  std::mt19937_64 rng(seed);
+  std::uniform_real_distribution<double> u(-1.0, 1.0);
+  for (int t = 0; t < 1 << 16; t++) {
+    glm::dvec3 c(u(rng), u(rng), u(rng));
+    for (int k = 0; k < 3; k++)
+      mesh->addVertex(c + 0.05 * glm::dvec3(u(rng), u(rng), u(rng)));
+    mesh->addFace(3 * t, 3 * t + 1, 3 * t + 2);
+  }
+  if (attributes) {
+    for (int k = 0; k < 3 << 16; k++) {
+      mesh->addNormal(
+          glm::normalize(glm::dvec3(u(rng), u(rng), u(rng)) + 1e-3));
+      mesh->addUV(glm::dvec2(0.5 * u(rng) + 0.5, 0.5 * u(rng) + 0.5));
+    }
+    mesh->vertNorms = true;
+  }
+  scene.add(mesh);
+  return mesh;
+}
+
+// Closest hits in the soup through the full and the compressed BVH, with
+// the memory each one's hierarchy and primitive boxes take, and through
+// the BVH into a compress()ed mesh with normals and UVs, whose hits cost
+// the most to decode.
+void benchBVH(const Options &opts, vector<ray> &rays) {
+  if (!wanted(opts, "BVH traverse"))
+    return;
+
+  struct Case {
+    const char *name;
+    bool packedMesh, compressed;
+  };
+  for (const Case &c : {Case{"BVH traverse", false, false},
+                        Case{"BVH traverse compressed", false, true},
+                        Case{"BVH traverse packed mesh", true, false}}) {
+    if (!wanted(opts, c.name))
+      continue;
+    Material mat;
+    Scene scene;
+    triangleSoup(scene, mat, opts.seed + 2, c.packedMesh);
+    if (c.packedMesh)
+      scene.compressMeshes();
+    scene.buildBVH(traceUI->getLeafSize(), c.compressed);
+    Stats s = measure(opts, rays.size(), [&] {
+      size_t hits = 0;
+      for (ray &r : rays) {
+        isect i;
+        hits += scene.intersect(r, i);
+      }
+      return hits;
+    });
+    report(c.name, s, "ray");
+    const BVH *bvh = scene.getBVH();
+    cout << "    " << bvh->nodeCount() << " nodes, " << bvh->primCount()
+         << " prims, " << setprecision(1) << bvh->nodeBytes() / 1024.0
+         << " KiB (" << double(bvh->nodeBytes()) / bvh->primCount()
+         << " bytes/prim)" << endl;
+  }
+}
+
+void benchShade(const Options &opts, vector<ray> &rays) {
+  if (!wanted(opts, "Material::shade"))
+    return;
+
+  std::unique_ptr<Scene> scene(randomScene(opts.seed));
+  vector<ray> hitRays;
+  vector<isect> hits;
+  for (ray &r : rays) {
+    isect i;
+    if (scene->intersect(r, i)) {
+      hitRays.push_back(r);
+      hits.push_back(i);
+    }
+  }
+  if (hits.empty())
+    return;
+
+  glm::dvec3 sum(0.0);
+  Stats s = measure(opts, hits.size(), [&] {
+    for (size_t k = 0; k < hits.size(); k++)
+      sum += hits[k].getMaterial().shade(scene.get(), hitRays[k], hits[k]);
+    return hits.size();
+  });
+  report("Material::shade", s, "shade");
+  if (sum.x < 0.0) // keep the shading from being optimized away
+    cerr << sum.x << endl;
+}
+
+// One scene file, or the random scene if `file` is empty.
+void benchFrame(const Options &opts, const string &file, const string &label) {
+  RayTracer tracer;
+  if (file.empty()) {
+    tracer.setScene(std::shared_ptr<Scene>(randomScene(opts.seed)));
+  } else if (!tracer.loadScene(file.c_str())) {
+    return;
+  }
+  int w = opts.width;
+  int h = std::max(1, (int)(w / tracer.aspectRatio() + 0.5));
+
+  CacheMisses counter;
+  vector<double> ns;
+  size_t rays = 0, totalRays = 0;
+  long long misses = 0;
+  int lookups = 0, hits = 0;
+  for (int k = 0; k <= opts.reps; k++) {
+    TraceUI::resetCount();
+    TraceUI::resetOccluderStats(lookups, hits);
+    counter.start();
+    auto start = Clock::now();
+    tracer.traceImage(w, h);
+    tracer.waitRender();
+    double elapsed =
+        std::chrono::duration<double, std::nano>(Clock::now() - start)
+            .count();
+    long long frameMisses = counter.stop();
+    rays = std::max(TraceUI::resetCount(), 1);
+    TraceUI::resetOccluderStats(lookups, hits);
+    if (k > 0) { // the first frame only warms up
+      ns.push_back(elapsed / rays);
+      totalRays += rays;
+      misses = frameMisses < 0 || misses < 0 ? -1 : misses + frameMisses;
+    }
+  }
+  std::sort(ns.begin(), ns.end());
+  Stats s{ns[ns.size() / 2], ns.front(), ns.back(), 1.0};
+  report(label, s, "ray");
+  cout << "    " << w << "x" << h << ", " << rays << " rays per frame, "
+       << TraceUI::m_threads << " threads";
+  if (misses >= 0)
+    cout << ", " << setprecision(2) << double(misses) / totalRays
+         << " cache misses per ray";
+  if (lookups > 0)
+    cout << ", occluder cache " << setprecision(1) << 100.0 * hits / lookups
+         << "% hits";
+  cout << endl;
+}
+
+// Full frames of the given scene files, or of a random scene if there are
+// none; reported per ray traced, counting every ray the frame spawned.
+// Every frame is traced both depth first and in wavefront mode, with the
+// cache misses per ray of each where the hardware counters can be read.
+void benchFrames(const Options &opts, BenchUI &ui,
+                 const vector<string> &files) {
+  vector<string> names = files.empty() ? vector<string>{"frame"} : files;
+  for (const string &name : names)
+    for (bool wavefront : {false, true}) {
+      string label =
+          (files.empty() ? string("frame (random scene)") : "frame " + name) +
+          (wavefront ? " wavefront" : "");
+      if (!wanted(opts, label))
+        continue;
+      ui.setWavefront(wavefront);
+      benchFrame(opts, files.empty() ? string() : name, label);
+    }
+  ui.setWavefront(false);
+}
+
+
+void usage(const char *progName) {
+  cerr << "usage: " << progName << " [options] [scene.json ...]" << endl
+       << "  -n <#>      rays per kernel pass (default 65536)" << endl
+       << "  -r <#>      timed repetitions (default 9)" << endl
+       << "  -s <#>      random seed (default 1)" << endl
+       << "  -t <#>      triangles in the TrimeshFace mesh (default 64)"
+       << endl
+       << "  -w <#>      full frame width (default 256)" << endl
+       << "  -d <#>      full frame recursion depth (default 2)" << endl
+       << "  -j <#>      full frame threads (default: all)" << endl
+       << "  -k <NAME>   only run kernels whose name contains NAME" << endl;
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  Options opts;
+  int depth = 2;
+  int i;
+  while ((i = getopt(argc, argv, "n:r:s:t:w:d:j:k:h")) != EOF) {
+    switch (i) {
+    case 'n':
+      opts.rays = std::max(atoi(optarg), 1);
+      break;
+    case 'r':
+      opts.reps = std::max(atoi(optarg), 1);
+      break;
+    case 's':
+      opts.seed = (unsigned)atoi(optarg);
+      break;
+    case 't':
+      opts.triangles = std::max(atoi(optarg), 1);
+      break;
+    case 'w':
+      opts.width = std::max(atoi(optarg), 1);
+      break;
+    case 'd':
+      depth = atoi(optarg);
+      break;
+    case 'j':
+      TraceUI::m_threads = std::clamp(atoi(optarg), 1, MAX_THREADS);
+      break;
+    case 'k':
+      opts.only = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  vector<string> files(argv + optind, argv + argc);
+
+  BenchUI ui(depth);
+  traceUI = &ui;
+
+  cout << "seed " << opts.seed << ", " << opts.rays << " rays, " << opts.reps
+       << " repetitions (median, min and max per test)" << endl;
+
+  Scene scene;
+  Material mat;
+  vector<ray> rays = randomRays(opts.rays, opts.seed);
+
+  benchShape(opts, "Sphere", Sphere(&scene, &mat), rays);
+  benchShape(opts, "Box", Box(&scene, &mat), rays);
+  benchShape(opts, "Square", Square(&scene, &mat), rays);
+  benchShape(opts, "Cylinder", Cylinder(&scene, &mat), rays);
+  benchShape(opts, "Cone", Cone(&scene, &mat, 1.0, 1.0, 0.0, true), rays);
+  benchTriangles(opts, scene, mat, rays);
+  benchBoundingBox(opts, rays);
+  benchBVH(opts, rays);
+  benchShade(opts, rays);
+  benchRefit(opts);
+  benchFrames(opts, ui, files);
+
+  traceUI = nullptr;
+  return 0;
+}
@@ -0,0 +1,70 @@
+#include "costmap.h"
+#include "images.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+using std::string;
+
+namespace {
+// Evenly spaced stops of the false-color ramp
+const float ramp[][3] = {{0.00f, 0.00f, 0.00f},
+                         {0.23f, 0.06f, 0.43f},
+                         {0.73f, 0.21f, 0.33f},
+                         {0.98f, 0.55f, 0.04f},
+                         {0.99f, 1.00f, 0.64f}};
+const int rampStops = sizeof(ramp) / sizeof(ramp[0]);
+
+void falseColor(float v, unsigned char *rgb) {
+  v = std::clamp(v, 0.0f, 1.0f) * (rampStops - 1);
+  int k = std::min((int)v, rampStops - 2);
+  float f = v - k;
+  for (int c = 0; c < 3; c++)
+    rgb[c] = (unsigned char)(255.0f *
+                             (ramp[k][c] + f * (ramp[k + 1][c] - ramp[k][c])));
+}
+} // namespace
+
+void writeCostHeatmap(const char *iname, int width, int height,
+                      const float *costs, int channel) {
+  size_t n = (size_t)width * height;
+  std::vector<float> level(n);
+  for (size_t p = 0; p < n; p++)
+    level[p] = std::log1p(std::max(costs[p * COST_CHANNELS + channel], 0.0f));
+
+  // Scale to the 99th percentile so a few outliers don't flatten the rest
+  float top = 0.0f;
+  if (n > 0) {
+    std::vector<float> sorted(level);
+    auto pct = sorted.begin() + (n - 1) * 99 / 100;
+    std::nth_element(sorted.begin(), pct, sorted.end());
+    top = *pct;
+  }
+  if (top <= 0.0f)
+    top = 1.0f;
+
+  std::vector<unsigned char> image(n * 3);
+  for (size_t p = 0; p < n; p++)
+    falseColor(level[p] / top, &image[p * 3]);
+  writeImage(iname, width, height, image.data());
+}
+
+void writeCostDump(const char *fname, int width, int height,
+                   const float *costs) {
+  FILE *f = fopen(fname, "wb");
+  if (!f)
+    throw string("Couldn't open ") + fname + " for writing";
+
+  int32_t header[3] = {width, height, COST_CHANNELS};
+  bool ok = fwrite("RCST", 1, 4, f) == 4 &&
+            fwrite(header, sizeof(header), 1, f) == 1;
+  for (int y = height - 1; ok && y >= 0; y--)
+    ok = fwrite(costs + (size_t)y * width * COST_CHANNELS,
+                sizeof(float) * COST_CHANNELS, width, f) == (size_t)width;
+  if (fclose(f) != 0 || !ok)
+    throw string("Error writing ") + fname;
+}
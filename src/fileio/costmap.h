@@ -0,0 +1,28 @@
+#ifndef FILEIO_COSTMAP_H
+#define FILEIO_COSTMAP_H
+
+/*
+ * Per-pixel render cost, as recorded by RayTracer::setCostMap(). A cost
+ * buffer holds COST_CHANNELS floats per pixel, rows bottom-up like the
+ * image buffer.
+ */
+enum CostChannel {
+  COST_NS,         // wall clock nanoseconds spent on the pixel
+  COST_RAYS,       // rays constructed
+  COST_PRIM_TESTS, // primitive intersection tests
+  COST_BOX_TESTS,  // bounding box tests
+  COST_CHANNELS
+};
+
+// Write one channel as a false-color image (black through purple and red to
+// yellow, on a log scale up to the 99th percentile).
+void writeCostHeatmap(const char *iname, int width, int height,
+                      const float *costs, int channel = COST_NS);
+
+// Dump the raw costs: the bytes "RCST", then width, height and the channel
+// count as 32-bit ints, then the floats, top row first. All values are in
+// host byte order.
+void writeCostDump(const char *fname, int width, int height,
+                   const float *costs);
+
+#endif
@@ -1,6 +1,7 @@
 #include "images.h"
 #include "bitmap.h"
 #include "pngimage.h"
+#include "timeline.h"
 #include <string>
 #if defined(_MSC_VER)
 #define strncasecmp _strnicmp
@@ -21,11 +22,13 @@ struct Backend {
   const char *ext;
   std::vector<uint8_t> (*reader)(const char *fname, int &width, int &height);
   void (*writer)(const char *iname, int width, int height, const void *data);
+  std::unique_ptr<ImageStreamWriter> (*streamer)(const char *iname, int width,
+                                                 int height);
 };
 
 Backend backends[] = {
-    {".bmp", readBMP, writeBMP},
-    {".png", readPNG, writePNG},
+    {".bmp", readBMP, writeBMP, nullptr},
+    {".png", readPNG, writePNG, openPNGStream},
 };
 
 const Backend *bmp_handler = &backends[0];
@@ -54,6 +57,7 @@ std::vector<uint8_t> readImage(const char *fname, int &width, int &height) {
 }
 
 void writeImage(const char *fname, int width, int height, const void *data) {
+  TimelineScope t("writeImage", "output", fname);
   auto handler = find_handler(fname);
   if (!handler) {
     std::cerr << "Unrecognized extension for file " << fname
@@ -62,3 +66,11 @@ void writeImage(const char *fname, int width, int height, const void *data) {
   }
   handler->writer(fname, width, height, data);
 }
+
+std::unique_ptr<ImageStreamWriter> openImageStream(const char *fname,
+                                                   int width, int height) {
+  auto handler = find_handler(fname);
+  if (!handler || !handler->streamer)
+    return nullptr;
+  return handler->streamer(fname, width, height);
+}
@@ -1,6 +1,7 @@
 #ifndef FILEIO_IMAGES_H
 #define FILEIO_IMAGES_H
 
+#include <memory>
 #include <stdint.h>
 #include <vector>
 
@@ -15,4 +16,21 @@ extern std::vector<uint8_t> readImage(const char *fname, int &width,
 extern void writeImage(const char *iname, int width, int height,
                        const void *data);
 
+/*
+ * Row-by-row image output for images too large to keep in memory.
+ * Rows are handed over in bands from the top of the image down; each band
+ * is stored bottom-up like the render buffer. finish() must be called once
+ * all height rows have been written.
+ */
+class ImageStreamWriter {
+public:
+  virtual ~ImageStreamWriter() {}
+  virtual void writeRows(const void *data, int count) = 0;
+  virtual void finish() = 0;
+};
+
+// Returns nullptr if the format of iname has no streaming writer.
+extern std::unique_ptr<ImageStreamWriter>
+openImageStream(const char *iname, int width, int height);
+
 #endif
@@ -1,8 +1,11 @@
 #include "pngimage.h"
+#include <algorithm>
 #include <png.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <string>
+#include <thread>
 #include <vector>
 #include <zlib.h>
 
@@ -24,6 +27,23 @@ using std::string;
 #define Trace(x) ;
 #endif
 
+namespace {
+PNGOptions pngOptions;
+
+const char *filterNames[] = {"none", "sub", "up", "avg", "paeth"};
+} // namespace
+
+void setPNGOptions(const PNGOptions &opts) { pngOptions = opts; }
+
+int pngFilterFromName(const char *name) {
+  if (!strcmp(name, "adaptive"))
+    return -1;
+  for (int i = 0; i < 5; i++)
+    if (!strcmp(name, filterNames[i]))
+      return i;
+  return -2;
+}
+
 void png_version_info(void) {
   fprintf(stderr, "   Compiled with libpng %s; using libpng %s.\n",
           PNG_LIBPNG_VER_STRING, png_libpng_ver);
@@ -224,6 +244,258 @@ std::vector<uint8_t> readPNG(const char *fname, int &width, int &height) {
   return data;
 }
 
+namespace {
+
+void applyOptions(png_structp png_ptr) {
+  if (pngOptions.compression >= 0)
+    png_set_compression_level(png_ptr, std::min(pngOptions.compression, 9));
+  if (pngOptions.filter >= 0) {
+    static const int flags[] = {PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP,
+                                PNG_FILTER_AVG, PNG_FILTER_PAETH};
+    png_set_filter(png_ptr, 0, flags[std::min(pngOptions.filter, 4)]);
+  }
+}
+
+/*
+ * Parallel PNG encoder.
+ *
+ * libpng filters and deflates on a single thread. Instead we split the image
+ * into horizontal strips and, on one thread per strip group, filter the rows
+ * and deflate each strip into its own raw deflate segment. Every segment but
+ * the last ends with a sync flush, so they concatenate byte-aligned into one
+ * valid deflate stream; each strip is primed with the preceding 32KB of
+ * filtered data as a dictionary, so the ratio stays close to a serial encode.
+ * The adler32 checksums of the strips are combined for the zlib trailer.
+ */
+constexpr int ROWS_PER_STRIP = 64;
+constexpr size_t DEFLATE_WINDOW = 32768;
+
+inline unsigned char paeth(int a, int b, int c) {
+  int p = a + b - c;
+  int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+  if (pa <= pb && pa <= pc)
+    return (unsigned char)a;
+  return (unsigned char)(pb <= pc ? b : c);
+}
+
+// Apply filter type ft to one row of RGB8 data. prev is the row above, or
+// nullptr for the first row.
+void filterRow(int ft, const unsigned char *row, const unsigned char *prev,
+               size_t n, unsigned char *out) {
+  constexpr size_t bpp = 3;
+  for (size_t x = 0; x < n; x++) {
+    int a = x >= bpp ? row[x - bpp] : 0;
+    int b = prev ? prev[x] : 0;
+    int c = (prev && x >= bpp) ? prev[x - bpp] : 0;
+    switch (ft) {
+    case 0:
+      out[x] = row[x];
+      break;
+    case 1:
+      out[x] = (unsigned char)(row[x] - a);
+      break;
+    case 2:
+      out[x] = (unsigned char)(row[x] - b);
+      break;
+    case 3:
+      out[x] = (unsigned char)(row[x] - ((a + b) >> 1));
+      break;
+    default:
+      out[x] = (unsigned char)(row[x] - paeth(a, b, c));
+      break;
+    }
+  }
+}
+
+// Filter a row into out (filter byte followed by the filtered bytes). For
+// adaptive filtering, pick the filter with the smallest sum of absolute
+// signed bytes, the same heuristic libpng uses.
+void encodeRow(int filter, const unsigned char *row, const unsigned char *prev,
+               size_t n, unsigned char *out) {
+  if (filter >= 0) {
+    out[0] = (unsigned char)filter;
+    filterRow(filter, row, prev, n, out + 1);
+    return;
+  }
+
+  std::vector<unsigned char> trial(n);
+  unsigned long best = ~0ul;
+  for (int ft = 0; ft < 5; ft++) {
+    filterRow(ft, row, prev, n, trial.data());
+    unsigned long sum = 0;
+    for (size_t x = 0; x < n; x++)
+      sum += trial[x] < 128 ? trial[x] : 256 - trial[x];
+    if (sum < best) {
+      best = sum;
+      out[0] = (unsigned char)ft;
+      memcpy(out + 1, trial.data(), n);
+    }
+  }
+}
+
+struct Strip {
+  int first, count; // PNG rows, top to bottom
+  std::vector<unsigned char> filtered;
+  std::vector<unsigned char> deflated;
+  uLong adler;
+};
+
+void deflateStrip(Strip &strip, const Strip *prev, bool last, int level) {
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    throw string("[write_png_file] deflateInit2 failed");
+
+  if (prev) {
+    size_t n = std::min(prev->filtered.size(), DEFLATE_WINDOW);
+    deflateSetDictionary(
+        &zs, prev->filtered.data() + prev->filtered.size() - n, (uInt)n);
+  }
+
+  strip.deflated.resize(deflateBound(&zs, strip.filtered.size()) + 16);
+  zs.next_in = strip.filtered.data();
+  zs.avail_in = (uInt)strip.filtered.size();
+  zs.next_out = strip.deflated.data();
+  zs.avail_out = (uInt)strip.deflated.size();
+  int ret = deflate(&zs, last ? Z_FINISH : Z_SYNC_FLUSH);
+  if (ret == Z_STREAM_ERROR || zs.avail_in != 0) {
+    deflateEnd(&zs);
+    throw string("[write_png_file] deflate failed");
+  }
+  strip.deflated.resize(zs.total_out);
+  deflateEnd(&zs);
+
+  strip.adler = adler32(adler32(0L, Z_NULL, 0), strip.filtered.data(),
+                        (uInt)strip.filtered.size());
+}
+
+void putU32(std::vector<unsigned char> &v, uint32_t x) {
+  v.push_back((unsigned char)(x >> 24));
+  v.push_back((unsigned char)(x >> 16));
+  v.push_back((unsigned char)(x >> 8));
+  v.push_back((unsigned char)x);
+}
+
+void writeChunk(FILE *fp, const char *type, const unsigned char *data,
+                size_t len) {
+  std::vector<unsigned char> hdr;
+  putU32(hdr, (uint32_t)len);
+  hdr.insert(hdr.end(), type, type + 4);
+  uLong crc = crc32(0L, Z_NULL, 0);
+  crc = crc32(crc, hdr.data() + 4, 4);
+  if (len)
+    crc = crc32(crc, data, (uInt)len);
+  std::vector<unsigned char> tail;
+  putU32(tail, (uint32_t)crc);
+
+  if (fwrite(hdr.data(), 1, hdr.size(), fp) != hdr.size() ||
+      (len && fwrite(data, 1, len, fp) != len) ||
+      fwrite(tail.data(), 1, tail.size(), fp) != tail.size())
+    throw string("[write_png_file] Error writing chunk ") + type;
+}
+
+void writePNGParallel(const char *fname, int width, int height,
+                      const void *data) {
+  const size_t rowBytes = (size_t)width * 3;
+  const int level = pngOptions.compression < 0
+                        ? Z_DEFAULT_COMPRESSION
+                        : std::min(pngOptions.compression, 9);
+  const unsigned char *pixels = (const unsigned char *)data;
+  // The buffer is stored bottom-up
+  auto pngRow = [&](int y) { return pixels + (height - y - 1) * rowBytes; };
+
+  std::vector<Strip> strips((height + ROWS_PER_STRIP - 1) / ROWS_PER_STRIP);
+  for (size_t s = 0; s < strips.size(); s++) {
+    strips[s].first = (int)s * ROWS_PER_STRIP;
+    strips[s].count = std::min(ROWS_PER_STRIP, height - strips[s].first);
+  }
+
+  // Filtering only reads raw pixels, so all strips can be filtered at once.
+  // Deflating needs the previous strip's filtered bytes as its dictionary,
+  // hence the second pass.
+  auto runParallel = [&](auto &&work) {
+    std::vector<std::thread> pool;
+    int nthreads = std::min<int>(pngOptions.threads, (int)strips.size());
+    for (int t = 0; t < nthreads; t++)
+      pool.emplace_back([&, t]() {
+        for (size_t s = t; s < strips.size(); s += nthreads)
+          work(s);
+      });
+    for (auto &th : pool)
+      th.join();
+  };
+
+  runParallel([&](size_t s) {
+    Strip &strip = strips[s];
+    strip.filtered.resize(strip.count * (rowBytes + 1));
+    for (int r = 0; r < strip.count; r++) {
+      int y = strip.first + r;
+      encodeRow(pngOptions.filter, pngRow(y), y > 0 ? pngRow(y - 1) : nullptr,
+                rowBytes, strip.filtered.data() + r * (rowBytes + 1));
+    }
+  });
+
+  std::vector<string> errors(strips.size());
+  runParallel([&](size_t s) {
+    try {
+      deflateStrip(strips[s], s > 0 ? &strips[s - 1] : nullptr,
+                   s + 1 == strips.size(), level);
+    } catch (const string &e) {
+      errors[s] = e;
+    }
+  });
+  for (const auto &e : errors)
+    if (!e.empty())
+      throw e;
+
+  FILE *fp = fopen(fname, "wb");
+  if (!fp)
+    throw string("[write_png_file] File could not be opened for "
+                 "writing: ") +
+        fname;
+
+  try {
+    static const unsigned char signature[8] = {137, 80, 78, 71,
+                                               13,  10, 26, 10};
+    if (fwrite(signature, 1, 8, fp) != 8)
+      throw string("[write_png_file] Error during writing header");
+
+    std::vector<unsigned char> ihdr;
+    putU32(ihdr, width);
+    putU32(ihdr, height);
+    ihdr.insert(ihdr.end(), {8, PNG_COLOR_TYPE_RGB, 0, 0, 0});
+    writeChunk(fp, "IHDR", ihdr.data(), ihdr.size());
+
+    // zlib header: deflate with a 32K window, FLEVEL hinting at the level
+    int flevel = level == Z_DEFAULT_COMPRESSION ? 2
+                 : level < 2                    ? 0
+                 : level < 6                    ? 1
+                 : level == 6                   ? 2
+                                                : 3;
+    unsigned cmf = 0x78, flg = flevel << 6;
+    flg += (31 - (cmf * 256 + flg) % 31) % 31;
+    const unsigned char zhdr[2] = {(unsigned char)cmf, (unsigned char)flg};
+    writeChunk(fp, "IDAT", zhdr, 2);
+
+    uLong adler = adler32(0L, Z_NULL, 0);
+    for (const auto &strip : strips) {
+      writeChunk(fp, "IDAT", strip.deflated.data(), strip.deflated.size());
+      adler = adler32_combine(adler, strip.adler, strip.filtered.size());
+    }
+
+    std::vector<unsigned char> trailer;
+    putU32(trailer, (uint32_t)adler);
+    writeChunk(fp, "IDAT", trailer.data(), trailer.size());
+    writeChunk(fp, "IEND", nullptr, 0);
+  } catch (...) {
+    fclose(fp);
+    throw;
+  }
+  fclose(fp);
+}
+
+} // namespace
+
 /*
  * Copyright 2002-2010 Guillaume Cottenceau.
  *
@@ -233,6 +505,11 @@ std::vector<uint8_t> readPNG(const char *fname, int &width, int &height) {
  */
 
 void writePNG(const char *fname, int width, int height, const void *data) {
+  if (pngOptions.threads > 1 && height >= 2 * ROWS_PER_STRIP) {
+    writePNGParallel(fname, width, height, data);
+    return;
+  }
+
   constexpr png_byte color_type = PNG_COLOR_TYPE_RGB;
   constexpr png_byte bit_depth = 8;
 
@@ -267,6 +544,7 @@ void writePNG(const char *fname, int width, int height, const void *data) {
   png_set_IHDR(png_ptr, info_ptr, width, height, bit_depth, color_type,
                PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE,
                PNG_FILTER_TYPE_BASE);
+  applyOptions(png_ptr);
 
   std::vector<png_bytep> row_pointers(height);
   for (int i = 0; i < height; i++)
@@ -292,3 +570,96 @@ void writePNG(const char *fname, int width, int height, const void *data) {
   fclose(fp);
   png_destroy_write_struct(&png_ptr, &info_ptr);
 }
+
+namespace {
+
+/*
+ * Writes a PNG one band at a time with png_write_row, so only the band being
+ * handed over has to be resident.
+ */
+class PNGStreamWriter : public ImageStreamWriter {
+public:
+  PNGStreamWriter(const char *fname, int width, int height)
+      : width(width), height(height) {
+    fp = fopen(fname, "wb");
+    if (!fp)
+      throw string("[png_stream] File could not be opened for writing: ") +
+          fname;
+
+    // A half-built writer is never destroyed, so anything acquired so far
+    // has to be let go of before throwing
+    png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png_ptr) {
+      release();
+      throw string("[png_stream] png_create_write_struct failed");
+    }
+
+    info_ptr = png_create_info_struct(png_ptr);
+    if (!info_ptr) {
+      release();
+      throw string("[png_stream] png_create_info_struct failed");
+    }
+
+    if (setjmp(png_jmpbuf(png_ptr))) {
+      release();
+      throw string("[png_stream] Error during writing header");
+    }
+
+    png_init_io(png_ptr, fp);
+    png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_RGB,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE,
+                 PNG_FILTER_TYPE_BASE);
+    applyOptions(png_ptr);
+    png_write_info(png_ptr, info_ptr);
+  }
+
+  ~PNGStreamWriter() { release(); }
+
+  void writeRows(const void *data, int count) override {
+    if (setjmp(png_jmpbuf(png_ptr)))
+      throw string("[png_stream] Error during writing bytes");
+
+    // Bands are stored bottom-up; PNG wants the top row first.
+    const unsigned char *rows = (const unsigned char *)data;
+    for (int j = count - 1; j >= 0; --j)
+      png_write_row(png_ptr, rows + j * width * 3);
+    written += count;
+  }
+
+  void finish() override {
+    if (written != height)
+      throw string("[png_stream] Image incomplete: wrote ") +
+          std::to_string(written) + " of " + std::to_string(height) + " rows";
+
+    if (setjmp(png_jmpbuf(png_ptr)))
+      throw string("[png_stream] Error during end of write");
+
+    png_write_end(png_ptr, NULL);
+    release();
+  }
+
+private:
+  void release() {
+    if (png_ptr)
+      png_destroy_write_struct(&png_ptr, &info_ptr);
+    png_ptr = NULL;
+    info_ptr = NULL;
+    if (fp)
+      fclose(fp);
+    fp = NULL;
+  }
+
+  FILE *fp = NULL;
+  png_structp png_ptr = NULL;
+  png_infop info_ptr = NULL;
+  int width;
+  int height;
+  int written = 0;
+};
+
+}; // Anonymous namespace
+
+std::unique_ptr<ImageStreamWriter> openPNGStream(const char *fname, int width,
+                                                 int height) {
+  return std::make_unique<PNGStreamWriter>(fname, width, height);
+}
@@ -1,12 +1,35 @@
 #ifndef FILEIO_PNGIMAGE_H
 #define FILEIO_PNGIMAGE_H
 
+#include "images.h"
+#include <memory>
 #include <stdint.h>
 #include <vector>
 
 void png_version_info(void);
 
+/*
+ * Encoder settings used by writePNG and the PNG stream writer.
+ *   compression: zlib level 0-9, or -1 for the zlib default (6)
+ *   filter:      PNG row filter 0-4 (none, sub, up, avg, paeth), or -1 to
+ *                pick the best filter per row (adaptive)
+ *   threads:     with more than one, writePNG filters and deflates
+ *                horizontal strips of the image in parallel
+ */
+struct PNGOptions {
+  int compression = -1;
+  int filter = -1;
+  int threads = 1;
+};
+
+void setPNGOptions(const PNGOptions &opts);
+// Returns the filter number for a name like "paeth" or "adaptive", or -2 if
+// the name is not recognized.
+int pngFilterFromName(const char *name);
+
 std::vector<uint8_t> readPNG(const char *fname, int &width, int &height);
 void writePNG(const char *iname, int width, int height, const void *data);
+std::unique_ptr<ImageStreamWriter> openPNGStream(const char *iname, int width,
+                                                 int height);
 
 #endif
@@ -0,0 +1,121 @@
+#include "timeline.h"
+
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <json.hpp>
+using Json = nlohmann::json;
+
+using std::string;
+
+namespace {
+typedef std::chrono::steady_clock Clock;
+
+struct Event {
+  const char *name;
+  const char *cat;
+  string detail;
+  int index;
+  double ts, dur; // microseconds
+};
+
+// Each thread appends to its own log, so recording never takes a lock
+// except the first time a thread records anything.
+struct ThreadLog {
+  int tid;
+  string name;
+  std::vector<Event> events;
+};
+
+std::atomic<bool> enabled(false);
+Clock::time_point origin;
+std::mutex logsMutex;
+std::vector<std::unique_ptr<ThreadLog>> logs;
+thread_local ThreadLog *threadLog = nullptr;
+
+ThreadLog &currentLog() {
+  if (!threadLog) {
+    std::lock_guard<std::mutex> lock(logsMutex);
+    logs.emplace_back(new ThreadLog());
+    threadLog = logs.back().get();
+    threadLog->tid = (int)logs.size();
+  }
+  return *threadLog;
+}
+
+double micros(Clock::time_point t) {
+  return std::chrono::duration<double, std::micro>(t - origin).count();
+}
+} // namespace
+
+void timelineEnable() {
+  origin = Clock::now();
+  enabled = true;
+}
+
+bool timelineEnabled() { return enabled.load(std::memory_order_relaxed); }
+
+void timelineNameThread(const string &name) {
+  if (timelineEnabled())
+    currentLog().name = name;
+}
+
+void timelineWrite(const char *fname) {
+  Json events = Json::array();
+  {
+    std::lock_guard<std::mutex> lock(logsMutex);
+    for (const auto &l : logs) {
+      if (!l->name.empty())
+        events.push_back({{"ph", "M"},
+                          {"name", "thread_name"},
+                          {"pid", 1},
+                          {"tid", l->tid},
+                          {"args", {{"name", l->name}}}});
+      for (const Event &e : l->events) {
+        Json ev = {{"ph", "X"},    {"name", e.name}, {"cat", e.cat},
+                   {"ts", e.ts},   {"dur", e.dur},   {"pid", 1},
+                   {"tid", l->tid}};
+        if (!e.detail.empty())
+          ev["args"]["detail"] = e.detail;
+        if (e.index >= 0)
+          ev["args"]["index"] = e.index;
+        events.push_back(std::move(ev));
+      }
+    }
+  }
+
+  std::ofstream out(fname);
+  out << Json{{"traceEvents", events}, {"displayTimeUnit", "ms"}}.dump()
+      << std::endl;
+  if (!out)
+    throw string("Error writing trace to ") + fname;
+}
+
+TimelineScope::TimelineScope(const char *name, const char *cat)
+    : name(name), cat(cat), active(timelineEnabled()) {
+  if (active)
+    start = Clock::now();
+}
+
+TimelineScope::TimelineScope(const char *name, const char *cat,
+                             const string &detail)
+    : TimelineScope(name, cat) {
+  if (active)
+    this->detail = detail;
+}
+
+TimelineScope::TimelineScope(const char *name, const char *cat, int index)
+    : TimelineScope(name, cat) {
+  this->index = index;
+}
+
+TimelineScope::~TimelineScope() {
+  if (!active)
+    return;
+  Clock::time_point end = Clock::now();
+  currentLog().events.push_back(
+      {name, cat, detail, index, micros(start), micros(end) - micros(start)});
+}
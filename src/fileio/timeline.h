@@ -0,0 +1,43 @@
+#ifndef FILEIO_TIMELINE_H
+#define FILEIO_TIMELINE_H
+
+#include <chrono>
+#include <string>
+
+/*
+ * A timeline of what each thread was doing, written as Chrome trace-event
+ * JSON for chrome://tracing or ui.perfetto.dev. Recording is off until
+ * timelineEnable() is called; until then a TimelineScope does nothing but
+ * check a flag.
+ */
+void timelineEnable();
+bool timelineEnabled();
+
+// Name the calling thread in the trace.
+void timelineNameThread(const std::string &name);
+
+// Write every event recorded so far. Throws a string on I/O errors.
+void timelineWrite(const char *fname);
+
+// Records one complete event covering its own lifetime. `name` and `cat`
+// must outlive the scope; `detail`, if any, is shown as an argument.
+class TimelineScope {
+public:
+  TimelineScope(const char *name, const char *cat = "render");
+  TimelineScope(const char *name, const char *cat, const std::string &detail);
+  TimelineScope(const char *name, const char *cat, int index);
+  ~TimelineScope();
+
+  TimelineScope(const TimelineScope &) = delete;
+  TimelineScope &operator=(const TimelineScope &) = delete;
+
+private:
+  const char *name;
+  const char *cat;
+  std::string detail;
+  int index = -1;
+  bool active;
+  std::chrono::steady_clock::time_point start;
+};
+
+#endif
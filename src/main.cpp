@@ -3,23 +3,49 @@
 #endif
 
 #include "RayTracer.h"
+#include "fileio/timeline.h"
 #include "ui/CommandLineUI.h"
+#include "ui/ServerUI.h"
+#include <iostream>
+#include <string.h>
 
 using namespace std;
 
 RayTracer *theRayTracer;
-TraceUI *traceUI;
-int TraceUI::m_threads = max(std::thread::hardware_concurrency(), (unsigned)1);
-int TraceUI::rayCount[MAX_THREADS];
+extern TraceUI *traceUI;
 
 // usage : ray [option] in.ray out.bmp
 // Simply keying in ray will invoke a graphics mode version.
 // Use "ray --help" to see the detailed usage.
+// "ray --server [option]" keeps scenes loaded and renders jobs read from
+// stdin or a UNIX socket; see ui/ServerUI.cpp for the protocol.
+// "--trace-out <FILE>" in any mode writes a Chrome trace-event timeline of
+// scene loading, rendering and image output to FILE.
 //
 // Graphics mode will be substantially slower than text mode because of
 // event handling overhead.
 int main(int argc, char **argv) {
-  if (argc != 1) {
+  // Take --trace-out out of argv before the UIs parse their own options
+  const char *traceOut = nullptr;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--trace-out"))
+      continue;
+    if (i + 1 >= argc) {
+      cerr << "--trace-out needs a file name." << endl;
+      return 1;
+    }
+    traceOut = argv[i + 1];
+    for (int k = i + 2; k <= argc; k++)
+      argv[k - 2] = argv[k];
+    argc -= 2;
+    timelineEnable();
+    timelineNameThread("main");
+    break;
+  }
+
+  if (argc > 1 && !strcmp(argv[1], "--server")) {
+    traceUI = new ServerUI(argc, argv);
+  } else if (argc != 1) {
     // text mode
     traceUI = new CommandLineUI(argc, argv);
   } else {
@@ -35,5 +61,15 @@ int main(int argc, char **argv) {
   theRayTracer = new RayTracer();
 
   traceUI->setRayTracer(theRayTracer);
-  return traceUI->run();
+  int status = traceUI->run();
+
+  if (traceOut) {
+    try {
+      timelineWrite(traceOut);
+    } catch (const string &msg) {
+      cerr << msg << endl;
+      status = 1;
+    }
+  }
+  return status;
 }
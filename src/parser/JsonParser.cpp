@@ -1,5 +1,8 @@
 #include "JsonParser.h"
+#include "ObjReader.h"
 #include "ParserException.h"
+#include "../fileio/timeline.h"
+#include "../ui/TraceUI.h"
 
 #define TINYOBJLOADER_IMPLEMENTATION
 #define TINYOBJLOADER_USE_DOUBLE
@@ -7,8 +10,9 @@
 #include <sstream>
 
 #include <glm/gtc/type_ptr.hpp>
+#include <algorithm>
 #include <iostream>
-#include <unordered_map>
+#include <memory>
 
 #include <json.hpp>
 using json = nlohmann::json;
@@ -112,7 +116,7 @@ Material parseMaterial(const json &j, ParseData &pd) {
 DirectionalLight *parseDirectionalLight(const json &j, ParseData &pd) {
   glm::dvec3 color = j.at("color").get<glm::dvec3>();
   glm::dvec3 direction = j.at("direction").get<glm::dvec3>();
-  return new DirectionalLight(pd.s, direction, color);
+  return pd.s->create<DirectionalLight>(pd.s, direction, color);
 }
 
 PointLight *parsePointLight(const json &j, ParseData &pd) {
@@ -124,8 +128,41 @@ PointLight *parsePointLight(const json &j, ParseData &pd) {
   IGNORE_MISSING(j.at("constant_attenuation_coeff").get_to(atten_pow_0));
   IGNORE_MISSING(j.at("linear_attenuation_coeff").get_to(atten_pow_1));
   IGNORE_MISSING(j.at("quadratic_attenuation_coeff").get_to(atten_pow_2));
-  return new PointLight(pd.s, position, color, atten_pow_0, atten_pow_1,
-                        atten_pow_2);
+  return pd.s->create<PointLight>(pd.s, position, color, atten_pow_0,
+                                  atten_pow_1, atten_pow_2);
+}
+
+// Area lights take the same attenuation coefficients as point lights
+RectLight *parseRectLight(const json &j, ParseData &pd) {
+  glm::dvec3 color = j.at("color").get<glm::dvec3>();
+  glm::dvec3 position = j.at("position").get<glm::dvec3>();
+  glm::dvec3 u = j.at("u").get<glm::dvec3>();
+  glm::dvec3 v = j.at("v").get<glm::dvec3>();
+  float atten_pow_0 = 0.0f;
+  float atten_pow_1 = 0.0f;
+  float atten_pow_2 = 1.0f;
+  IGNORE_MISSING(j.at("constant_attenuation_coeff").get_to(atten_pow_0));
+  IGNORE_MISSING(j.at("linear_attenuation_coeff").get_to(atten_pow_1));
+  IGNORE_MISSING(j.at("quadratic_attenuation_coeff").get_to(atten_pow_2));
+  return pd.s->create<RectLight>(pd.s, position, u, v, color, atten_pow_0,
+                                 atten_pow_1, atten_pow_2);
+}
+
+DiskLight *parseDiskLight(const json &j, ParseData &pd) {
+  glm::dvec3 color = j.at("color").get<glm::dvec3>();
+  glm::dvec3 position = j.at("position").get<glm::dvec3>();
+  glm::dvec3 normal = j.at("normal").get<glm::dvec3>();
+  double radius = j.at("radius").get<double>();
+  if (radius <= 0.0 || glm::length(normal) == 0.0)
+    throw ParserException("disk_light needs a positive radius and a normal");
+  float atten_pow_0 = 0.0f;
+  float atten_pow_1 = 0.0f;
+  float atten_pow_2 = 1.0f;
+  IGNORE_MISSING(j.at("constant_attenuation_coeff").get_to(atten_pow_0));
+  IGNORE_MISSING(j.at("linear_attenuation_coeff").get_to(atten_pow_1));
+  IGNORE_MISSING(j.at("quadratic_attenuation_coeff").get_to(atten_pow_2));
+  return pd.s->create<DiskLight>(pd.s, position, normal, radius, color,
+                                 atten_pow_0, atten_pow_1, atten_pow_2);
 }
 
 glm::dvec3 parseAmbientLight(const json &j) {
@@ -135,28 +172,28 @@ glm::dvec3 parseAmbientLight(const json &j) {
 
 Sphere *parseSphereBody(const json &j, ParseData &pd) {
   Material m = GET_MAT_W_CUR(j, pd);
-  auto s = new Sphere(pd.s, &m);
+  auto s = pd.s->create<Sphere>(pd.s, &m);
   s->setTransform(pd.getCurrentTransform());
   return s;
 }
 
 Box *parseBoxBody(const json &j, ParseData &pd) {
   Material m = GET_MAT_W_CUR(j, pd);
-  auto b = new Box(pd.s, &m);
+  auto b = pd.s->create<Box>(pd.s, &m);
   b->setTransform(pd.getCurrentTransform());
   return b;
 }
 
 Square *parseSquareBody(const json &j, ParseData &pd) {
   Material m = GET_MAT_W_CUR(j, pd);
-  auto s = new Square(pd.s, &m);
+  auto s = pd.s->create<Square>(pd.s, &m);
   s->setTransform(pd.getCurrentTransform());
   return s;
 }
 
 Cylinder *parseCylinderBody(const json &j, ParseData &pd) {
   Material m = GET_MAT_W_CUR(j, pd);
-  auto c = new Cylinder(pd.s, &m);
+  auto c = pd.s->create<Cylinder>(pd.s, &m);
   c->setTransform(pd.getCurrentTransform());
   IGNORE_MISSING(c->setCapped(j.at("capped").get<bool>()));
   return c;
@@ -175,14 +212,15 @@ Cone *parseConeBody(const json &j, ParseData &pd) {
   IGNORE_MISSING(j.at("height").get_to(height));
   IGNORE_MISSING(j.at("capped").get_to(capped));
 
-  auto c = new Cone(pd.s, &m, height, bottomRadius, topRadius, capped);
+  auto c = pd.s->create<Cone>(pd.s, &m, height, bottomRadius, topRadius,
+                              capped);
   c->setTransform(pd.getCurrentTransform());
   return c;
 }
 
 Trimesh *parseTrimeshBody(const json &j, ParseData &pd) {
   Material m = GET_MAT_W_CUR(j, pd);
-  auto t = new Trimesh(pd.s, &m, pd.getCurrentTransform());
+  auto t = pd.s->create<Trimesh>(pd.s, &m, pd.getCurrentTransform());
   bool genNormals = false;
 
   glm::dvec3 point;
@@ -341,8 +379,13 @@ std::vector<Geometry *> parseTransform(const json &j, ParseData &pd) {
 
 Scene *JsonParser::parseScene() {
   // Allow comments and exceptions while parsing
-  json j = json::parse(this->contents);
+  json j;
+  {
+    TimelineScope t("parse JSON", "load");
+    j = json::parse(this->contents);
+  }
 
+  TimelineScope t("build scene", "load");
   Scene *scene = new Scene();
   ParseData pd;
   pd.s = scene;
@@ -365,6 +408,10 @@ Scene *JsonParser::parseScene() {
       scene->add(parseDirectionalLight(val, pd));
     } else if (key == "point_light") {
       scene->add(parsePointLight(val, pd));
+    } else if (key == "rect_light") {
+      scene->add(parseRectLight(val, pd));
+    } else if (key == "disk_light") {
+      scene->add(parseDiskLight(val, pd));
     } else if (isTransformKey(key)) {
       auto geoms = parseTransform(object, pd);
       for (auto g : geoms) {
@@ -395,33 +442,16 @@ void MaterialFromTinyObj(Material *target, tinyobj::material_t mat) {
   target->setIndex(mat.ior);
 }
 
-// Cantor hash function. We need at least 64 bits in the computation, since the
-// 32-bit computation potentially overflows when a + b = 2**16 (way too small)
-size_t hash2(uint64_t a, uint64_t b) { return ((a + b) * (a + b + 1) / 2) + b; }
-size_t hash3(uint64_t a, uint64_t b, uint64_t c) {
-  return hash2(hash2(a, b), c);
-}
-struct TinyObjIndexHash {
-  std::size_t operator()(const tinyobj::index_t &i) const {
-    return hash3(i.vertex_index, i.normal_index, i.texcoord_index);
-  }
-};
-struct TinyObjIndexEq {
-  bool operator()(const tinyobj::index_t &a, const tinyobj::index_t &b) const {
-    return a.vertex_index == b.vertex_index &&
-           a.normal_index == b.normal_index &&
-           a.texcoord_index == b.texcoord_index;
-  }
-};
-
 /* The full OBJ file format is chaotic neutral. To try to tame some of this, we
 only support certain features. See jsonformat.md for the limitations.
 */
-Trimesh *loadObjToTrimesh(const tinyobj::ObjReader &rdr,
-                          const tinyobj::shape_t &s, Trimesh *t,
-                          ParseData &pd) {
-  auto &attrib = rdr.GetAttrib();
-  auto &materials = rdr.GetMaterials();
+Trimesh *loadObjToTrimesh(const ObjReader &rdr, const ObjReader::Shape &s,
+                          const std::vector<tinyobj::material_t> &materials,
+                          Trimesh *t, ParseData &pd) {
+  auto &positions = rdr.positions();
+  auto &normals = rdr.normals();
+  auto &texcoords = rdr.texcoords();
+  auto &colors = rdr.colors();
 
   /* Faces in OBJ files can use different indices for
      UV/normals/positions. For example, naively you can specify a face as
@@ -430,54 +460,40 @@ Trimesh *loadObjToTrimesh(const tinyobj::ObjReader &rdr,
      would use the same vertex positions, but use the first vertex's
      UV/normal on the third vertex.
 
-     Instead of dealing with this during rendering, we preprocess the OBJ
-     file so that every unique combination of v/vt/vn gets its own index
-     in the Trimesh. This increases memory usage slightly, but most renderers
-     (incl. OpenGL) need separate arrays of indices anyways.
+     Instead of dealing with this during rendering, every unique combination
+     of v/vt/vn gets its own index in the Trimesh. This increases memory
+     usage slightly, but most renderers (incl. OpenGL) need separate arrays
+     of indices anyways. ObjReader has already found the combinations, so
+     here they only need copying.
   */
+  if (s.vertexCount > MAX_RECOMMENDED_VERTS) {
+    std::cerr << "WARN: Detected many vertices in OBJ input. This may "
+                 "cause memory problems. Consider decimating the mesh."
+              << std::endl;
+  }
 
-  bool warned = false;
-  std::unordered_map<tinyobj::index_t, int, TinyObjIndexHash, TinyObjIndexEq>
-      indexMap;
-
-  // If this v/vt/vn combination has been seen before, return the linear
-  // index. Otherwise, create it by inserting the combination into the
-  // mesh.
-  auto getOrCreateLinearIndex = [&attrib, &indexMap, &warned,
-                                 t](tinyobj::index_t i) {
-    if (indexMap.find(i) == indexMap.end()) {
-      if (indexMap.size() > MAX_RECOMMENDED_VERTS && !warned) {
-        std::cerr << "WARN: Detected many vertices in OBJ input. This may "
-                     "cause memory problems. Consider decimating the mesh."
-                  << std::endl;
-        warned = true;
-      }
-
-      indexMap[i] = indexMap.size();
-      t->addVertex(glm::make_vec3(&attrib.vertices[3 * i.vertex_index]));
-      if (i.normal_index != -1) {
-        auto n = glm::make_vec3(&attrib.normals[3 * i.normal_index]);
-        // OBJ normals are not required to be normalized; ours are
-        t->addNormal(glm::normalize(n));
-      }
+  for (size_t k = 0; k < s.vertexCount; ++k) {
+    const ObjReader::Corner &c = rdr.vertices()[s.firstVertex + k];
+    t->addVertex(glm::make_vec3(&positions[3 * c.v]));
+    if (c.vn != -1) {
+      auto n = glm::make_vec3(&normals[3 * c.vn]);
+      // OBJ normals are not required to be normalized; ours are
+      t->addNormal(glm::normalize(n));
+    }
 
-      if (i.texcoord_index != -1) {
-        t->addUV(glm::make_vec2(&attrib.texcoords[2 * i.texcoord_index]));
-      }
-      if (attrib.colors.size() > 0) {
-        t->addColor(glm::make_vec3(&attrib.colors[3 * i.vertex_index]));
-      }
+    if (c.vt != -1) {
+      t->addUV(glm::make_vec2(&texcoords[2 * c.vt]));
     }
-    return indexMap[i];
-  };
+    if (colors.size() > 0) {
+      t->addColor(glm::make_vec3(&colors[3 * c.v]));
+    }
+  }
 
-  // TinyOBJ triangulates for us, so we don't have to check for larger
+  // ObjReader triangulates for us, so we don't have to check for larger
   // faces
-  for (long unsigned f = 0; f < s.mesh.indices.size(); f += 3) {
-    auto i0 = getOrCreateLinearIndex(s.mesh.indices[f]);
-    auto i1 = getOrCreateLinearIndex(s.mesh.indices[f + 1]);
-    auto i2 = getOrCreateLinearIndex(s.mesh.indices[f + 2]);
-    t->addFace(i0, i1, i2);
+  const uint32_t *idx = &rdr.indices()[3 * s.firstTriangle];
+  for (size_t f = 0; f < s.triangleCount; ++f, idx += 3) {
+    t->addFace(idx[0], idx[1], idx[2]);
   }
 
   /* Finished parsing geometry, now parse materials. The parser currently
@@ -490,45 +506,42 @@ Trimesh *loadObjToTrimesh(const tinyobj::ObjReader &rdr,
           array or vector
        2. Loop over the `materials` array here and place each material in
           the materials vector in the Trimesh
-       3. For each face with index f, access s.mesh.material_ids[f] to get
-          the index of the material for that face. Record this
+       3. Teach ObjReader to read `usemtl` lines and record, for each
+          triangle, the index of the material it uses. Record this
           information in the Trimesh somehow (perhaps modifying the
           addFace method)
        4. When rendering an intersection with a face, look up the
           corresponding material in the Trimesh, then use that as the
           material for the intersection phase (including barycentric
           interpolation of the material if it is called for).
-
-// Face f should render using materials[k]
-auto k = s.mesh.material_ids[f];
 */
 
   // Take the first material associated with the mesh and use it.
-  Material *m = new Material();
+  Material m;
   if (materials.size() > 0) {
     tinyobj::material_t mtl = materials[0];
-    m->setDiffuse(glm::make_vec3(mtl.diffuse));
-    m->setSpecular(glm::make_vec3(mtl.specular));
-    m->setAmbient(glm::make_vec3(mtl.ambient));
-    m->setTransmissive(glm::make_vec3(mtl.transmittance));
-    m->setEmissive(glm::make_vec3(mtl.emission));
-    m->setShininess(mtl.shininess);
-    m->setIndex(mtl.ior);
+    m.setDiffuse(glm::make_vec3(mtl.diffuse));
+    m.setSpecular(glm::make_vec3(mtl.specular));
+    m.setAmbient(glm::make_vec3(mtl.ambient));
+    m.setTransmissive(glm::make_vec3(mtl.transmittance));
+    m.setEmissive(glm::make_vec3(mtl.emission));
+    m.setShininess(mtl.shininess);
+    m.setIndex(mtl.ior);
 
     if (!mtl.diffuse_texname.empty()) {
       std::string texPath = (pd.scene_dir / mtl.diffuse_texname).string();
-      m->setDiffuse(MaterialParameter(pd.s->getTexture(texPath)));
+      m.setDiffuse(MaterialParameter(pd.s->getTexture(texPath)));
     }
 
     if (!mtl.specular_texname.empty()) {
       std::string texPath = (pd.scene_dir / mtl.specular_texname).string();
-      m->setSpecular(MaterialParameter(pd.s->getTexture(texPath)));
+      m.setSpecular(MaterialParameter(pd.s->getTexture(texPath)));
     }
   }
 
-  t->setMaterial(m);
+  t->setMaterial(&m);
 
-  if (attrib.normals.size() > 0) {
+  if (normals.size() > 0) {
     t->vertNorms = true;
   }
 
@@ -548,42 +561,44 @@ std::vector<Trimesh *> parseObjmeshBody(const json &j, ParseData &pd) {
 
   std::vector<Trimesh *> results;
 
-  tinyobj::ObjReaderConfig reader_config;
-  reader_config.mtl_search_path = pd.scene_dir.string();
-  reader_config.triangulate = true;
-  reader_config.vertex_color = false; // Populate vertex colors only if
-                                      // *all* vertices have associated colors
-  tinyobj::ObjReader reader;
-  bool success = reader.ParseFromFile(path, reader_config);
-
-  if (!success) {
-    if (!reader.Error().empty()) {
-      throw ParserException("Error while parsing OBJ file: " + reader.Error());
-    } else {
-      throw ParserException("Error while parsing OBJ file: unknown "
-                            "(tinyobj returned an error with no message)");
+  std::unique_ptr<ObjReader> reader;
+  std::vector<tinyobj::material_t> materials;
+  {
+    TimelineScope t("parse OBJ", "load", objFile);
+    reader.reset(new ObjReader(path, TraceUI::m_threads));
+
+    // Materials are few and small, so tinyobj still reads the MTL files
+    tinyobj::MaterialFileReader mtlReader(pd.scene_dir.string());
+    std::map<std::string, int> materialMap;
+    std::vector<std::string> loaded;
+    for (const std::string &lib : reader->materialLibraries()) {
+      if (std::find(loaded.begin(), loaded.end(), lib) != loaded.end())
+        continue;
+      loaded.push_back(lib);
+      std::string warn, err;
+      mtlReader(lib, &materials, &materialMap, &warn, &err);
+      if (!warn.empty() || !err.empty()) {
+        std::cerr << "TinyObj warnings: " << warn << err;
+      }
     }
   }
-  if (!reader.Warning().empty()) {
-    std::cerr << "TinyObj warnings: " << reader.Warning();
-  }
-
-  auto &attrib = reader.GetAttrib();
-  auto &shapes = reader.GetShapes();
 
-  if (attrib.vertices.size() / 3 > MAX_RECOMMENDED_VERTS) {
-    std::cerr << "Warning: OBJ file " << objFile << " has "
-              << attrib.vertices.size() / 3 << " vertices. "
+  size_t vertexCount = reader->positions().size() / 3;
+  if (vertexCount > MAX_RECOMMENDED_VERTS) {
+    std::cerr << "Warning: OBJ file " << objFile << " has " << vertexCount
+              << " vertices. "
               << "This may cause an out-of-memory condition. "
               << "Consider reducing the number of vertices in the "
                  "OBJ file."
               << std::endl;
   }
 
-  for (const tinyobj::shape_t &s : shapes) {
-    Trimesh *t = new Trimesh(pd.s, &pd.cur_mat, pd.getCurrentTransform());
+  TimelineScope build("build meshes", "load", objFile);
+  for (const ObjReader::Shape &s : reader->shapes()) {
+    Trimesh *t =
+        pd.s->create<Trimesh>(pd.s, &pd.cur_mat, pd.getCurrentTransform());
 
-    loadObjToTrimesh(reader, s, t, pd);
+    loadObjToTrimesh(*reader, s, materials, t, pd);
 
     if (genNormals) {
       t->generateNormals();
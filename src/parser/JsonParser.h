@@ -61,13 +61,15 @@ Camera parseCamera(const json &j);
 MaterialParameter parseMaterialParameter(const json &j, ParseData &pd);
 Material parseMaterial(const json &j, ParseData &pd);
 
-/* Because the Scene manages Lights and Geometry lifetimes (calling delete when
-the Scene is dropped), we allocate our lights as raw pointers with new and
+/* Because the Scene manages Lights and Geometry lifetimes (they live in its
+arena and go away with it), we allocate our lights with Scene::create() and
 pass those pointers into the Scene. AmbientLight is weird because it's not
 actually a light (see comments in scene.h for details) */
 
 DirectionalLight *parseDirectionalLight(const json &j);
 PointLight *parsePointLight(const json &j);
+RectLight *parseRectLight(const json &j, ParseData &pd);
+DiskLight *parseDiskLight(const json &j, ParseData &pd);
 glm::dvec3 parseAmbientLight(const json &j);
 
 Sphere *parseSphereBody(const json &j, ParseData &pd);
@@ -0,0 +1,547 @@
+#include "ObjReader.h"
+#include "ParserException.h"
+
+#include <algorithm>
+#include <charconv>
+#include <fstream>
+#include <limits>
+#include <string.h>
+#include <thread>
+#ifdef _WIN32
+#include <iterator>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+// Chunks are at least this big, so small files aren't split for nothing
+const size_t MIN_CHUNK_BYTES = 1 << 20;
+const size_t MIN_SORT_RUN = 1 << 14;
+
+// Run work(k) for every k in [0, n) on up to `threads` threads
+template <typename F> void parallelFor(int threads, size_t n, F &&work) {
+  int nthreads = (int)std::min<size_t>(std::max(threads, 1), n);
+  if (nthreads <= 1) {
+    for (size_t k = 0; k < n; k++)
+      work(k);
+    return;
+  }
+  std::vector<std::thread> pool;
+  for (int t = 0; t < nthreads; t++)
+    pool.emplace_back([&, t]() {
+      for (size_t k = t; k < n; k += nthreads)
+        work(k);
+    });
+  for (auto &th : pool)
+    th.join();
+}
+
+// Sort runs of the items on separate threads, then merge neighboring runs
+// pairwise, a round of merges at a time.
+template <typename T, typename Less>
+void parallelSort(std::vector<T> &items, int threads, Less less) {
+  size_t runs = std::min<size_t>(std::max(threads, 1),
+                                 items.size() / MIN_SORT_RUN + 1);
+  std::vector<size_t> bounds(runs + 1);
+  for (size_t k = 0; k <= runs; k++)
+    bounds[k] = items.size() * k / runs;
+  parallelFor(threads, runs, [&](size_t k) {
+    std::sort(items.begin() + bounds[k], items.begin() + bounds[k + 1], less);
+  });
+  if (runs == 1)
+    return;
+
+  std::vector<T> merged(items.size());
+  for (size_t width = 1; width < runs; width *= 2) {
+    size_t pairs = (runs + 2 * width - 1) / (2 * width);
+    parallelFor(threads, pairs, [&](size_t p) {
+      size_t lo = bounds[2 * width * p];
+      size_t mid = bounds[std::min(2 * width * p + width, runs)];
+      size_t hi = bounds[std::min(2 * width * (p + 1), runs)];
+      std::merge(items.begin() + lo, items.begin() + mid, items.begin() + mid,
+                 items.begin() + hi, merged.begin() + lo, less);
+    });
+    items.swap(merged);
+  }
+}
+
+// The file's bytes, mapped read-only where that's possible
+class MappedFile {
+public:
+  explicit MappedFile(const std::string &path) {
+#ifdef _WIN32
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+      throw ParserException("Couldn't open OBJ file " + path);
+    buffer.assign(std::istreambuf_iterator<char>(in),
+                  std::istreambuf_iterator<char>());
+    bytes = buffer.data();
+    length = buffer.size();
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw ParserException("Couldn't open OBJ file " + path);
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      length = (size_t)st.st_size;
+      mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (mapping == MAP_FAILED)
+      throw ParserException("Couldn't map OBJ file " + path);
+    bytes = (const char *)mapping;
+#endif
+  }
+  ~MappedFile() {
+#ifndef _WIN32
+    if (mapping && mapping != MAP_FAILED)
+      munmap(mapping, length);
+#endif
+  }
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const char *begin() const { return bytes; }
+  const char *end() const { return bytes + length; }
+  size_t size() const { return length; }
+
+private:
+  const char *bytes = nullptr;
+  size_t length = 0;
+#ifdef _WIN32
+  std::vector<char> buffer;
+#else
+  void *mapping = nullptr;
+#endif
+};
+
+bool isBlank(char c) { return c == ' ' || c == '\t'; }
+
+const char *skipBlanks(const char *s, const char *e) {
+  while (s < e && isBlank(*s))
+    ++s;
+  return s;
+}
+
+// The number at s, if there's one. Moves s past it and the blanks after it.
+bool parseNumber(const char *&s, const char *e, double &x) {
+  if (s < e && *s == '+')
+    ++s;
+  x = 0.0;
+  auto result = std::from_chars(s, e, x);
+  if (result.ec == std::errc::invalid_argument)
+    return false;
+  s = skipBlanks(result.ptr, e);
+  return true;
+}
+
+// Read up to `count` numbers into x, the rest left at 0. Returns how many
+// there were.
+int parseNumbers(const char *s, const char *e, double *x, int count) {
+  int n = 0;
+  for (; n < count; n++)
+    if (s == e || !parseNumber(s, e, x[n])) {
+      std::fill(x + n, x + count, 0.0);
+      break;
+    }
+  return n;
+}
+
+bool parseIndex(const char *&s, const char *e, int &index) {
+  auto result = std::from_chars(s, e, index);
+  if (result.ec != std::errc() || index == 0)
+    return false;
+  s = result.ptr;
+  return true;
+}
+
+std::string lineText(const char *s, const char *e) {
+  std::string text(s, std::min<size_t>(e - s, 60));
+  return e - s > 60 ? text + "..." : text;
+}
+} // namespace
+
+struct ObjReader::Chunk {
+  const char *begin, *end;
+
+  std::vector<double> v, vn, vt, vc;
+  bool allColors = true;
+  std::vector<Corner> corners; // of every face, face after face
+  std::vector<uint32_t> faceSizes;
+  std::vector<size_t> breaks; // faces before each `g` or `o` line
+  std::vector<std::string> mtllibs;
+
+  // Corners with negative, relative, indices. Those are stored relative
+  // to the start of the chunk until merge() knows where that is.
+  struct Relative {
+    size_t corner;
+    uint8_t fields; // bit 0 for v, 1 for vt, 2 for vn
+  };
+  std::vector<Relative> relative;
+
+  // Where the chunk's data goes in the whole file's
+  size_t vBase = 0, vnBase = 0, vtBase = 0, cornerBase = 0;
+  size_t triangleBase = 0, triangleCount = 0;
+
+  std::string error;
+
+  void parse();
+  void parseLine(const char *s, const char *e);
+  bool parseCorner(const char *&s, const char *e);
+};
+
+void ObjReader::Chunk::parse() {
+  const char *s = begin;
+  while (s < end && error.empty()) {
+    const char *eol = (const char *)memchr(s, '\n', end - s);
+    if (!eol)
+      eol = end;
+    parseLine(s, eol);
+    s = eol == end ? end : eol + 1;
+  }
+}
+
+void ObjReader::Chunk::parseLine(const char *s, const char *e) {
+  if (e > s && e[-1] == '\r')
+    --e;
+  const char *line = s = skipBlanks(s, e);
+  auto keyword = [&](const char *word) {
+    size_t n = strlen(word);
+    if ((size_t)(e - s) <= n || strncmp(s, word, n) != 0 || !isBlank(s[n]))
+      return false;
+    s = skipBlanks(s + n, e);
+    return true;
+  };
+
+  double x[6];
+  if (keyword("v")) {
+    int n = parseNumbers(s, e, x, 6);
+    if (n < 3) {
+      error = "Bad vertex in OBJ file: " + lineText(line, e);
+      return;
+    }
+    v.insert(v.end(), x, x + 3);
+    allColors = allColors && n == 6;
+    if (allColors)
+      vc.insert(vc.end(), x + 3, x + 6);
+  } else if (keyword("vn")) {
+    parseNumbers(s, e, x, 3);
+    vn.insert(vn.end(), x, x + 3);
+  } else if (keyword("vt")) {
+    parseNumbers(s, e, x, 2);
+    vt.insert(vt.end(), x, x + 2);
+  } else if (keyword("f")) {
+    uint32_t n = 0;
+    for (; s < e; n++)
+      if (!parseCorner(s, e)) {
+        error = "Bad face in OBJ file (e.g. a zero index): " +
+                lineText(line, e);
+        return;
+      }
+    faceSizes.push_back(n);
+  } else if (keyword("g") || keyword("o")) {
+    breaks.push_back(faceSizes.size());
+  } else if (keyword("mtllib")) {
+    while (s < e) {
+      const char *name = s;
+      while (s < e && !isBlank(*s))
+        ++s;
+      mtllibs.emplace_back(name, s);
+      s = skipBlanks(s, e);
+    }
+  }
+  // Anything else is ignored, like comments
+}
+
+// Parse v, v/vt, v//vn or v/vt/vn, and the blanks after it
+bool ObjReader::Chunk::parseCorner(const char *&s, const char *e) {
+  int index[3] = {0, 0, 0};
+  if (!parseIndex(s, e, index[0]))
+    return false;
+  if (s < e && *s == '/') {
+    ++s;
+    if (s < e && *s != '/' && !parseIndex(s, e, index[1]))
+      return false;
+    if (s < e && *s == '/') {
+      ++s;
+      if (!parseIndex(s, e, index[2]))
+        return false;
+    }
+  }
+  if (s < e && !isBlank(*s))
+    return false;
+  s = skipBlanks(s, e);
+
+  const size_t counts[3] = {v.size() / 3, vt.size() / 2, vn.size() / 3};
+  int resolved[3];
+  uint8_t fields = 0;
+  for (int k = 0; k < 3; k++) {
+    if (index[k] > 0) {
+      resolved[k] = index[k] - 1;
+    } else if (index[k] < 0) {
+      resolved[k] = (int)counts[k] + index[k];
+      fields |= 1 << k;
+    } else {
+      resolved[k] = -1;
+    }
+  }
+  if (fields)
+    relative.push_back({corners.size(), fields});
+  corners.push_back({resolved[0], resolved[1], resolved[2]});
+  return true;
+}
+
+ObjReader::ObjReader(const std::string &path, int threads)
+    : threads(std::max(threads, 1)) {
+  MappedFile file(path);
+
+  // Cut the file into a chunk per thread, each ending just after a newline
+  size_t nchunks = std::max<size_t>(
+      1, std::min<size_t>(this->threads, file.size() / MIN_CHUNK_BYTES));
+  std::vector<Chunk> chunks(nchunks);
+  const char *start = file.begin();
+  for (size_t k = 0; k < nchunks; k++) {
+    const char *stop = file.begin() + file.size() * (k + 1) / nchunks;
+    if (stop < start)
+      stop = start;
+    if (k + 1 < nchunks) {
+      const char *eol = (const char *)memchr(stop, '\n', file.end() - stop);
+      stop = eol ? eol + 1 : file.end();
+    }
+    chunks[k].begin = start;
+    chunks[k].end = stop;
+    start = stop;
+  }
+
+  parallelFor(this->threads, nchunks, [&](size_t k) { chunks[k].parse(); });
+  for (const Chunk &chunk : chunks)
+    if (!chunk.error.empty())
+      throw ParserException(chunk.error);
+
+  merge(chunks);
+  std::vector<Corner> corners;
+  triangulate(chunks, corners);
+  chunks.clear();
+  weld(corners);
+}
+
+// Gather the chunks' attributes, and rebase their relative indices
+void ObjReader::merge(std::vector<Chunk> &chunks) {
+  size_t nv = 0, nvn = 0, nvt = 0, ncorners = 0;
+  bool allColors = true;
+  for (Chunk &chunk : chunks) {
+    chunk.vBase = nv;
+    chunk.vnBase = nvn;
+    chunk.vtBase = nvt;
+    chunk.cornerBase = ncorners;
+    nv += chunk.v.size() / 3;
+    nvn += chunk.vn.size() / 3;
+    nvt += chunk.vt.size() / 2;
+    ncorners += chunk.corners.size();
+    allColors = allColors && chunk.allColors;
+    for (const std::string &lib : chunk.mtllibs)
+      mtllibs.push_back(lib);
+  }
+  if (ncorners > std::numeric_limits<uint32_t>::max() ||
+      nv > (size_t)std::numeric_limits<int>::max())
+    throw ParserException("OBJ file is too big");
+
+  v.resize(3 * nv);
+  vn.resize(3 * nvn);
+  vt.resize(2 * nvt);
+  if (allColors)
+    vc.resize(3 * nv);
+  parallelFor(threads, chunks.size(), [&](size_t k) {
+    Chunk &chunk = chunks[k];
+    std::copy(chunk.v.begin(), chunk.v.end(), v.begin() + 3 * chunk.vBase);
+    std::copy(chunk.vn.begin(), chunk.vn.end(), vn.begin() + 3 * chunk.vnBase);
+    std::copy(chunk.vt.begin(), chunk.vt.end(), vt.begin() + 2 * chunk.vtBase);
+    if (allColors)
+      std::copy(chunk.vc.begin(), chunk.vc.end(),
+                vc.begin() + 3 * chunk.vBase);
+    std::vector<double>().swap(chunk.v);
+    std::vector<double>().swap(chunk.vn);
+    std::vector<double>().swap(chunk.vt);
+    std::vector<double>().swap(chunk.vc);
+
+    const int bases[3] = {(int)chunk.vBase, (int)chunk.vtBase,
+                          (int)chunk.vnBase};
+    for (const Chunk::Relative &r : chunk.relative) {
+      Corner &c = chunk.corners[r.corner];
+      int *index[3] = {&c.v, &c.vt, &c.vn};
+      for (int f = 0; f < 3; f++)
+        if (r.fields & (1 << f))
+          *index[f] += bases[f];
+    }
+  });
+}
+
+// Split the faces into triangles, in file order, and find where the shapes
+// start
+void ObjReader::triangulate(std::vector<Chunk> &chunks,
+                            std::vector<Corner> &corners) {
+  size_t ntriangles = 0;
+  for (Chunk &chunk : chunks) {
+    chunk.triangleBase = ntriangles;
+    chunk.triangleCount = 0;
+    for (uint32_t n : chunk.faceSizes)
+      chunk.triangleCount += n >= 3 ? n - 2 : 0;
+    ntriangles += chunk.triangleCount;
+  }
+  corners.resize(3 * ntriangles);
+
+  const size_t counts[3] = {v.size() / 3, vt.size() / 2, vn.size() / 3};
+  std::vector<std::vector<size_t>> breaks(chunks.size());
+  parallelFor(threads, chunks.size(), [&](size_t k) {
+    Chunk &chunk = chunks[k];
+    for (const Corner &c : chunk.corners)
+      if (c.v < 0 || (size_t)c.v >= counts[0] || c.vt < -1 ||
+          (c.vt >= 0 && (size_t)c.vt >= counts[1]) || c.vn < -1 ||
+          (c.vn >= 0 && (size_t)c.vn >= counts[2])) {
+        chunk.error = "Index out of range in OBJ file";
+        return;
+      }
+
+    Corner *out = corners.data() + 3 * chunk.triangleBase;
+    auto emit = [&](const Corner &a, const Corner &b, const Corner &c) {
+      *out++ = a;
+      *out++ = b;
+      *out++ = c;
+    };
+    auto position = [&](const Corner &c) { return &v[3 * c.v]; };
+    auto distance2 = [](const double *a, const double *b) {
+      double d0 = a[0] - b[0], d1 = a[1] - b[1], d2 = a[2] - b[2];
+      return d0 * d0 + d1 * d1 + d2 * d2;
+    };
+
+    size_t first = 0, next = 0;
+    for (size_t f = 0;; f++) {
+      for (; next < chunk.breaks.size() && chunk.breaks[next] == f; next++)
+        breaks[k].push_back((out - corners.data()) / 3);
+      if (f == chunk.faceSizes.size())
+        break;
+      uint32_t n = chunk.faceSizes[f];
+      const Corner *c = chunk.corners.data() + first;
+      first += n;
+      if (n < 3) // tinyobj drops these too
+        continue;
+      if (n == 4) {
+        // Split along the shorter diagonal, like tinyobj
+        if (distance2(position(c[0]), position(c[2])) <
+            distance2(position(c[1]), position(c[3]))) {
+          emit(c[0], c[1], c[2]);
+          emit(c[0], c[2], c[3]);
+        } else {
+          emit(c[0], c[1], c[3]);
+          emit(c[1], c[2], c[3]);
+        }
+        continue;
+      }
+      for (uint32_t j = 1; j + 1 < n; j++)
+        emit(c[0], c[j], c[j + 1]);
+    }
+    std::vector<Corner>().swap(chunk.corners);
+  });
+  for (const Chunk &chunk : chunks)
+    if (!chunk.error.empty())
+      throw ParserException(chunk.error);
+
+  size_t start = 0;
+  auto addShape = [&](size_t stop) {
+    if (stop > start)
+      shapeList.push_back({start, stop - start, 0, 0});
+    start = stop;
+  };
+  for (const auto &chunkBreaks : breaks)
+    for (size_t b : chunkBreaks)
+      addShape(b);
+  addShape(ntriangles);
+}
+
+// Give every distinct corner of each shape its own vertex. Sorting brings
+// equal corners of a shape together; each run of them is one vertex.
+void ObjReader::weld(const std::vector<Corner> &corners) {
+  struct Key {
+    uint32_t shape;
+    int v, vt, vn;
+    uint32_t corner;
+  };
+  // Work is split into blocks of corners, or of sorted keys, rather than
+  // shapes, since one shape may hold most of the file
+  size_t nblocks = std::min<size_t>(threads, corners.size() / MIN_SORT_RUN + 1);
+  auto blockStart = [&](size_t b) { return corners.size() * b / nblocks; };
+  auto forCorners = [&](auto &&work) {
+    parallelFor(threads, nblocks, [&](size_t b) {
+      size_t c = blockStart(b), stop = blockStart(b + 1);
+      size_t s = std::upper_bound(shapeList.begin(), shapeList.end(), c / 3,
+                                  [](size_t t, const Shape &shape) {
+                                    return t < shape.firstTriangle;
+                                  }) -
+                 shapeList.begin();
+      for (; c < stop; c++) {
+        while (c / 3 >= shapeList[s - 1].firstTriangle +
+                            shapeList[s - 1].triangleCount)
+          s++;
+        work(c, s - 1);
+      }
+    });
+  };
+
+  std::vector<Key> keys(corners.size());
+  forCorners([&](size_t c, size_t s) {
+    keys[c] = {(uint32_t)s, corners[c].v, corners[c].vt, corners[c].vn,
+               (uint32_t)c};
+  });
+  auto less = [](const Key &a, const Key &b) {
+    if (a.shape != b.shape)
+      return a.shape < b.shape;
+    if (a.v != b.v)
+      return a.v < b.v;
+    if (a.vt != b.vt)
+      return a.vt < b.vt;
+    return a.vn < b.vn;
+  };
+  parallelSort(keys, threads, less);
+
+  // Number the runs: count the run starts in each block of keys, then
+  // number each block's from where the blocks before it left off
+  auto startsRun = [&](size_t k) {
+    return k == 0 || less(keys[k - 1], keys[k]);
+  };
+  std::vector<size_t> blockRuns(nblocks + 1, 0);
+  parallelFor(threads, nblocks, [&](size_t b) {
+    for (size_t k = blockStart(b); k < blockStart(b + 1); k++)
+      blockRuns[b + 1] += startsRun(k);
+  });
+  for (size_t b = 0; b < nblocks; b++)
+    blockRuns[b + 1] += blockRuns[b];
+
+  welded.resize(blockRuns[nblocks]);
+  triangles.resize(keys.size());
+  parallelFor(threads, nblocks, [&](size_t b) {
+    size_t vertex = blockRuns[b];
+    for (size_t k = blockStart(b); k < blockStart(b + 1); k++) {
+      const Key &key = keys[k];
+      if (startsRun(k)) {
+        welded[vertex] = {key.v, key.vt, key.vn};
+        if (k == 0 || keys[k - 1].shape != key.shape)
+          shapeList[key.shape].firstVertex = vertex;
+        vertex++;
+      }
+      triangles[key.corner] = (uint32_t)(vertex - 1);
+    }
+  });
+  for (size_t s = 0; s < shapeList.size(); s++)
+    shapeList[s].vertexCount =
+        (s + 1 < shapeList.size() ? shapeList[s + 1].firstVertex
+                                  : welded.size()) -
+        shapeList[s].firstVertex;
+
+  // Make the indices relative to their shape's vertices
+  forCorners([&](size_t c, size_t s) {
+    triangles[c] -= (uint32_t)shapeList[s].firstVertex;
+  });
+}
@@ -0,0 +1,72 @@
+//
+// ObjReader.h
+//
+// A multithreaded reader for the subset of Wavefront OBJ that obj_mesh
+// accepts (see jsonformat.md). The file is mapped into memory and cut into
+// chunks at line boundaries; the chunks are parsed side by side, then
+// stitched together with their indices rebased. Every distinct v/vt/vn
+// combination becomes one mesh vertex, which is found by sorting the
+// corners of all faces in parallel instead of hashing them one by one.
+//
+// Faces are triangulated the way tinyobj does it for triangles and quads,
+// and fanned out for anything bigger. Lines, points, smoothing groups and
+// `usemtl` are ignored; `g` and `o` start a new shape like in tinyobj.
+//
+
+#ifndef __OBJREADER_H__
+#define __OBJREADER_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+class ObjReader {
+public:
+  // A v/vt/vn triple, 0-based. vt and vn are -1 if the corner has none.
+  struct Corner {
+    int v, vt, vn;
+  };
+
+  // A run of triangles ending at a `g` or `o` line, or the end of the file,
+  // and the welded vertices they use
+  struct Shape {
+    size_t firstTriangle, triangleCount;
+    size_t firstVertex, vertexCount;
+  };
+
+  // Parse `path` using up to `threads` threads. Throws ParserException if
+  // the file can't be read or is malformed.
+  ObjReader(const std::string &path, int threads);
+
+  const std::vector<double> &positions() const { return v; }
+  const std::vector<double> &normals() const { return vn; }
+  const std::vector<double> &texcoords() const { return vt; }
+  // Per position, and only if every `v` line had a color
+  const std::vector<double> &colors() const { return vc; }
+
+  const std::vector<Shape> &shapes() const { return shapeList; }
+
+  // The distinct corners of the shapes, each shape's in one run
+  const std::vector<Corner> &vertices() const { return welded; }
+  // Three per triangle, indexing the vertices of the triangle's shape
+  const std::vector<uint32_t> &indices() const { return triangles; }
+
+  // Files named by `mtllib` lines, in order
+  const std::vector<std::string> &materialLibraries() const { return mtllibs; }
+
+private:
+  struct Chunk;
+
+  void merge(std::vector<Chunk> &chunks);
+  void triangulate(std::vector<Chunk> &chunks, std::vector<Corner> &corners);
+  void weld(const std::vector<Corner> &corners);
+
+  int threads;
+  std::vector<double> v, vn, vt, vc;
+  std::vector<Shape> shapeList;
+  std::vector<Corner> welded;
+  std::vector<uint32_t> triangles;
+  std::vector<std::string> mtllibs;
+};
+
+#endif // __OBJREADER_H__
@@ -342,7 +342,7 @@ void Parser::parseTransform(Scene *scene, TransformNode *transform,
 void Parser::parseSphere(Scene *scene, TransformNode *transform,
                          const Material &mat) {
   Sphere *sphere = 0;
-  Material *newMat = 0;
+  unique_ptr<Material> newMat;
 
   _tokenizer.Read(SPHERE);
   _tokenizer.Read(LBRACE);
@@ -352,15 +352,14 @@ void Parser::parseSphere(Scene *scene, TransformNode *transform,
 
     switch (t->kind()) {
     case MATERIAL:
-      delete newMat;
-      newMat = parseMaterialExpression(scene, mat);
+      newMat.reset(parseMaterialExpression(scene, mat));
       break;
     case NAME:
       parseIdentExpression();
       break;
     case RBRACE:
       _tokenizer.Read(RBRACE);
-      sphere = new Sphere(scene, newMat ? newMat : new Material(mat));
+      sphere = scene->create<Sphere>(scene, newMat ? newMat.get() : &mat);
       sphere->setTransform(transform->transform());
       scene->add(sphere);
       return;
@@ -377,21 +376,20 @@ void Parser::parseBox(Scene *scene, TransformNode *transform,
   _tokenizer.Read(BOX);
   _tokenizer.Read(LBRACE);
 
-  Material *newMat = 0;
+  unique_ptr<Material> newMat;
   for (;;) {
     const Token *t = _tokenizer.Peek();
 
     switch (t->kind()) {
     case MATERIAL:
-      delete newMat;
-      newMat = parseMaterialExpression(scene, mat);
+      newMat.reset(parseMaterialExpression(scene, mat));
       break;
     case NAME:
       parseIdentExpression();
       break;
     case RBRACE:
       _tokenizer.Read(RBRACE);
-      box = new Box(scene, newMat ? newMat : new Material(mat));
+      box = scene->create<Box>(scene, newMat ? newMat.get() : &mat);
       box->setTransform(transform->transform());
       scene->add(box);
       return;
@@ -404,7 +402,7 @@ void Parser::parseBox(Scene *scene, TransformNode *transform,
 void Parser::parseSquare(Scene *scene, TransformNode *transform,
                          const Material &mat) {
   Square *square = 0;
-  Material *newMat = 0;
+  unique_ptr<Material> newMat;
 
   _tokenizer.Read(SQUARE);
   _tokenizer.Read(LBRACE);
@@ -414,15 +412,14 @@ void Parser::parseSquare(Scene *scene, TransformNode *transform,
 
     switch (t->kind()) {
     case MATERIAL:
-      delete newMat;
-      newMat = parseMaterialExpression(scene, mat);
+      newMat.reset(parseMaterialExpression(scene, mat));
       break;
     case NAME:
       parseIdentExpression();
       break;
     case RBRACE:
       _tokenizer.Read(RBRACE);
-      square = new Square(scene, newMat ? newMat : new Material(mat));
+      square = scene->create<Square>(scene, newMat ? newMat.get() : &mat);
       square->setTransform(transform->transform());
       scene->add(square);
       return;
@@ -435,7 +432,7 @@ void Parser::parseSquare(Scene *scene, TransformNode *transform,
 void Parser::parseCylinder(Scene *scene, TransformNode *transform,
                            const Material &mat) {
   Cylinder *cylinder = 0;
-  Material *newMat = 0;
+  unique_ptr<Material> newMat;
 
   _tokenizer.Read(CYLINDER);
   _tokenizer.Read(LBRACE);
@@ -445,15 +442,14 @@ void Parser::parseCylinder(Scene *scene, TransformNode *transform,
 
     switch (t->kind()) {
     case MATERIAL:
-      delete newMat;
-      newMat = parseMaterialExpression(scene, mat);
+      newMat.reset(parseMaterialExpression(scene, mat));
       break;
     case NAME:
       parseIdentExpression();
       break;
     case RBRACE:
       _tokenizer.Read(RBRACE);
-      cylinder = new Cylinder(scene, newMat ? newMat : new Material(mat));
+      cylinder = scene->create<Cylinder>(scene, newMat ? newMat.get() : &mat);
       cylinder->setTransform(transform->transform());
       scene->add(cylinder);
       return;
@@ -469,7 +465,7 @@ void Parser::parseCone(Scene *scene, TransformNode *transform,
   _tokenizer.Read(LBRACE);
 
   Cone *cone;
-  Material *newMat = 0;
+  unique_ptr<Material> newMat;
 
   double bottomRadius = 1.0;
   double topRadius = 0.0;
@@ -481,8 +477,7 @@ void Parser::parseCone(Scene *scene, TransformNode *transform,
 
     switch (t->kind()) {
     case MATERIAL:
-      delete newMat;
-      newMat = parseMaterialExpression(scene, mat);
+      newMat.reset(parseMaterialExpression(scene, mat));
       break;
     case NAME:
       parseIdentExpression();
@@ -501,8 +496,8 @@ void Parser::parseCone(Scene *scene, TransformNode *transform,
       break;
     case RBRACE:
       _tokenizer.Read(RBRACE);
-      cone = new Cone(scene, newMat ? newMat : new Material(mat), height,
-                      bottomRadius, topRadius, capped);
+      cone = scene->create<Cone>(scene, newMat ? newMat.get() : &mat,
+                                 height, bottomRadius, topRadius, capped);
       cone->setTransform(transform->transform());
       scene->add(cone);
       return;
@@ -514,8 +509,7 @@ void Parser::parseCone(Scene *scene, TransformNode *transform,
 
 void Parser::parseTrimesh(Scene *scene, TransformNode *transform,
                           const Material &mat) {
-  Trimesh *tmesh =
-      new Trimesh(scene, new Material(mat), transform->transform());
+  Trimesh *tmesh = scene->create<Trimesh>(scene, &mat, transform->transform());
 
   _tokenizer.Read(TRIMESH);
   _tokenizer.Read(LBRACE);
@@ -534,9 +528,11 @@ void Parser::parseTrimesh(Scene *scene, TransformNode *transform,
       generateNormals = true;
       break;
 
-    case MATERIAL:
-      tmesh->setMaterial(parseMaterialExpression(scene, mat));
+    case MATERIAL: {
+      unique_ptr<Material> newMat(parseMaterialExpression(scene, mat));
+      tmesh->setMaterial(newMat.get());
       break;
+    }
 
     case NAME:
       parseIdentExpression();
@@ -717,7 +713,7 @@ PointLight *Parser::parsePointLight(Scene *scene) {
       if (!hasPosition)
         throw SyntaxErrorException("Expected: 'position'", _tokenizer);
       _tokenizer.Read(RBRACE);
-      return new PointLight(
+      return scene->create<PointLight>(
           scene, position, color, constantAttenuationCoefficient,
           linearAttenuationCoefficient, quadraticAttenuationCoefficient);
 
@@ -766,7 +762,7 @@ DirectionalLight *Parser::parseDirectionalLight(Scene *scene) {
       if (!hasDirection)
         throw SyntaxErrorException("Expected: 'position'", _tokenizer);
       _tokenizer.Read(RBRACE);
-      return new DirectionalLight(scene, direction, color);
+      return scene->create<DirectionalLight>(scene, direction, color);
 
     default:
       throw SyntaxErrorException("expecting 'position' or 'color' "
@@ -8,6 +8,7 @@
 #define __PARSER_H__
 
 #include <map>
+#include <memory_resource>
 #include <string>
 
 #include "ParserException.h"
@@ -35,23 +36,15 @@ protected:
   // information about this node's transformation
   glm::dmat4 xform;
 
-  // information about parent & children
+  // information about parent; children are never visited again, so
+  // they're only kept in the root's arena
   TransformNode *parent;
-  std::vector<TransformNode *> children;
+  std::pmr::memory_resource *arena;
 
 public:
-  typedef std::vector<TransformNode *>::iterator child_iter;
-  typedef std::vector<TransformNode *>::const_iterator child_citer;
-
-  ~TransformNode() {
-    for (auto c : children)
-      delete c;
-  }
-
   TransformNode *createChild(const glm::dmat4 &xform) {
-    TransformNode *child = new TransformNode(this, xform);
-    children.push_back(child);
-    return child;
+    void *mem = arena->allocate(sizeof(TransformNode), alignof(TransformNode));
+    return new (mem) TransformNode(this, xform);
   }
 
   const glm::dmat4 &transform() const { return xform; }
@@ -61,18 +54,28 @@ protected:
   // protected so that users can't directly construct one of these...
   // force them to use the createChild() method.  Note that they CAN
   // directly create a TransformRoot object.
-  TransformNode(TransformNode *parent, const glm::dmat4 &xform) : children() {
+  TransformNode(TransformNode *parent, const glm::dmat4 &xform) {
     this->parent = parent;
-    if (parent == NULL)
+    if (parent == NULL) {
       this->xform = xform;
-    else
+      this->arena = nullptr;
+    } else {
       this->xform = parent->xform * xform;
+      this->arena = parent->arena;
+    }
   }
 };
 
+// Owns every node of the tree. Nodes are trivially destructible, so the
+// whole tree is freed at once with the root.
 class TransformRoot : public TransformNode {
 public:
-  TransformRoot() : TransformNode(NULL, glm::dmat4(1.0)) {}
+  TransformRoot() : TransformNode(NULL, glm::dmat4(1.0)) { arena = &nodes; }
+  TransformRoot(const TransformRoot &) = delete;
+  TransformRoot &operator=(const TransformRoot &) = delete;
+
+private:
+  std::pmr::monotonic_buffer_resource nodes;
 };
 
 /*
@@ -0,0 +1,66 @@
+//
+// arena.h
+//
+// Allocation for objects that live exactly as long as their scene. Each
+// kind of object gets its own monotonic pool, so objects of a kind sit
+// next to each other in memory and loading a scene doesn't go through
+// malloc once per object. Nothing is freed until the arena is destroyed,
+// which gives all of the pools' blocks back at once; only objects with
+// nontrivial destructors are visited on the way out.
+//
+
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <type_traits>
+#include <typeindex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class Arena {
+public:
+  Arena() = default;
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  // Objects are destroyed newest first, like locals going out of scope
+  ~Arena() {
+    for (auto d = destructors.rbegin(); d != destructors.rend(); ++d)
+      d->destroy(d->object);
+  }
+
+  // Construct a T in the arena. It must not be deleted; it goes away with
+  // the arena.
+  template <typename T, typename... Args> T *create(Args &&...args) {
+    void *mem = pool(typeid(T)).allocate(sizeof(T), alignof(T));
+    T *obj = new (mem) T(std::forward<Args>(args)...);
+    if constexpr (!std::is_trivially_destructible<T>::value)
+      destructors.push_back(
+          {obj, [](void *p) { static_cast<T *>(p)->~T(); }});
+    return obj;
+  }
+
+private:
+  std::pmr::memory_resource &pool(std::type_index type) {
+    auto &p = pools[type];
+    if (!p)
+      p.reset(new std::pmr::monotonic_buffer_resource());
+    return *p;
+  }
+
+  struct Destructor {
+    void *object;
+    void (*destroy)(void *);
+  };
+
+  std::unordered_map<std::type_index,
+                     std::unique_ptr<std::pmr::monotonic_buffer_resource>>
+      pools;
+  std::vector<Destructor> destructors;
+};
+
+#endif // __ARENA_H__
@@ -0,0 +1,1037 @@
+#include "bvh.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "../SceneObjects/Box.h"
+#include "../SceneObjects/Cone.h"
+#include "../SceneObjects/Cylinder.h"
+#include "../SceneObjects/Sphere.h"
+#include "../SceneObjects/Square.h"
+#include "../SceneObjects/trimesh.h"
+#include "ray.h"
+#include "scene.h"
+
+using namespace std;
+
+namespace {
+const int SAH_BINS = 16;
+// Below this depth splits fall back to the median, which bounds the
+// traversal stack no matter how lopsided the SAH splits get.
+const int MAX_SAH_DEPTH = 48;
+const int STACK_SIZE = 128;
+// Leaves are split past this even if their prims can't be told apart, so
+// the counts fit a compressed node.
+const uint32_t MAX_LEAF = 0xffff;
+
+const double INF = numeric_limits<double>::infinity();
+
+struct Bounds {
+  glm::dvec3 bmin = glm::dvec3(INF);
+  glm::dvec3 bmax = glm::dvec3(-INF);
+
+  void grow(const glm::dvec3 &lo, const glm::dvec3 &hi) {
+    bmin = glm::min(bmin, lo);
+    bmax = glm::max(bmax, hi);
+  }
+  void grow(const Bounds &b) { grow(b.bmin, b.bmax); }
+
+  double area() const {
+    glm::dvec3 d = bmax - bmin;
+    if (d[0] < 0.0)
+      return 0.0;
+    return 2.0 * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+  }
+};
+
+// 2^e, for the exponents of a compressed node, built directly from the
+// bits instead of going through ldexp()
+double pow2(int e) {
+  uint64_t bits = (uint64_t)(e + 1023) << 52;
+  double d;
+  memcpy(&d, &bits, sizeof(d));
+  return d;
+}
+
+Bounds triangleBounds(const TrimeshFace *face, const Trimesh *mesh) {
+  const MatrixTransform &transform = mesh->getTransform();
+  glm::dvec3 a = transform.localToGlobalCoords(mesh->vertex((*face)[0]));
+  glm::dvec3 b = transform.localToGlobalCoords(mesh->vertex((*face)[1]));
+  glm::dvec3 c = transform.localToGlobalCoords(mesh->vertex((*face)[2]));
+  Bounds bounds;
+  bounds.grow(glm::min(glm::min(a, b), c), glm::max(glm::max(a, b), c));
+  return bounds;
+}
+
+// Move the ray into an object's space and run `local` on it, along with
+// the length a unit of the ray's direction has there, then move it back.
+template <typename Transform, typename F>
+bool inLocalSpace(const Transform &transform, ray &r, F local) {
+  glm::dvec3 Wpos = r.getPosition();
+  glm::dvec3 Wdir = r.getDirection();
+  glm::dvec3 pos = transform.globalToLocalCoords(Wpos);
+  glm::dvec3 dir = transform.globalToLocalCoords(Wpos + Wdir) - pos;
+  double length = glm::length(dir);
+  r.setPosition(pos);
+  r.setDirection(dir / length);
+  bool hit = local(r, length);
+  r.setPosition(Wpos);
+  r.setDirection(Wdir);
+  return hit;
+}
+
+// Intersect in an object's space and move the hit back out. This is
+// Geometry::intersect() minus the virtual calls.
+template <typename Transform, typename F>
+bool intersectLocalized(const Transform &transform, ray &r, isect &i,
+                        F local) {
+  return inLocalSpace(transform, r, [&](ray &lr, double length) {
+    if (!local(lr, i))
+      return false;
+    i.setN(transform.localToGlobalCoordsNormal(i.getN()));
+    i.setT(i.getT() / length);
+    return true;
+  });
+}
+
+// The same for a shape the BVH keeps a copy of, which fills in the
+// object and material its static test leaves out
+template <typename Instance, typename F>
+bool intersectInstance(const Instance &inst, ray &r, isect &i, F test) {
+  if (!intersectLocalized(inst.frame, r, i, test))
+    return false;
+  i.setObject(inst.object);
+  i.setMaterial(inst.material);
+  return true;
+}
+} // namespace
+
+glm::dvec3 BVH::Frame::globalToLocalCoords(const glm::dvec3 &v) const {
+  return toLocal * v;
+}
+
+glm::dvec3 BVH::Frame::localToGlobalCoordsNormal(const glm::dvec3 &v) const {
+  return glm::normalize(normalToGlobal * v);
+}
+
+// The ray in the form the slab tests want it
+struct BVH::Traversal {
+  glm::dvec3 origin;
+  glm::dvec3 invDir;
+  bool dirNeg[3];
+
+  explicit Traversal(const ray &r) : origin(r.getPosition()) {
+    glm::dvec3 d = r.getDirection();
+    for (int a = 0; a < 3; ++a) {
+      invDir[a] = 1.0 / d[a];
+      dirNeg[a] = d[a] < 0.0;
+    }
+  }
+
+  // Does the ray enter [bmin, bmax] before tFar? Axes the ray is parallel
+  // to produce NaNs, which the comparisons below ignore.
+  bool hits(const glm::dvec3 &bmin, const glm::dvec3 &bmax,
+            double tFar) const {
+    double t0 = -INF, t1 = tFar;
+    for (int a = 0; a < 3; ++a) {
+      double ta = (bmin[a] - origin[a]) * invDir[a];
+      double tb = (bmax[a] - origin[a]) * invDir[a];
+      if (ta > tb)
+        std::swap(ta, tb);
+      t0 = std::max(t0, ta);
+      t1 = std::min(t1, tb);
+    }
+    return t0 <= t1 && t1 >= RAY_EPSILON;
+  }
+};
+
+// Rays in structure-of-arrays form, so the box test below can run on
+// several of them at once. Two lanes fit in an SSE2 register.
+struct BVH::Packet {
+  alignas(16) double origin[3][PACKET_SIZE];
+  alignas(16) double invDir[3][PACKET_SIZE];
+  alignas(16) double tBest[PACKET_SIZE];
+  TriangleHit tri[PACKET_SIZE]; // see intersectLeaf()
+  bool dirNeg[3]; // of the first ray, which picks the child order
+  unsigned lanes;
+
+  Packet(const ray *rays, int count) : lanes((1u << count) - 1) {
+    for (int k = 0; k < PACKET_SIZE; ++k) {
+      // Unused lanes repeat the first ray and are masked off
+      const ray &r = rays[k < count ? k : 0];
+      glm::dvec3 o = r.getPosition();
+      glm::dvec3 d = r.getDirection();
+      for (int a = 0; a < 3; ++a) {
+        origin[a][k] = o[a];
+        invDir[a][k] = 1.0 / d[a];
+      }
+      tBest[k] = INF;
+    }
+    glm::dvec3 d = rays[0].getDirection();
+    for (int a = 0; a < 3; ++a)
+      dirNeg[a] = d[a] < 0.0;
+  }
+
+  // Mask of the lanes in `active` whose ray enters [bmin, bmax] before
+  // its closest hit so far; the same test as Traversal::hits().
+  unsigned hits(const glm::dvec3 &bmin, const glm::dvec3 &bmax,
+                unsigned active) const {
+    unsigned mask = 0;
+#ifdef __SSE2__
+    const __m128d eps = _mm_set1_pd(RAY_EPSILON);
+    for (int k = 0; k < PACKET_SIZE; k += 2) {
+      __m128d t0 = _mm_set1_pd(-INF);
+      __m128d t1 = _mm_load_pd(tBest + k);
+      for (int a = 0; a < 3; ++a) {
+        __m128d o = _mm_load_pd(origin[a] + k);
+        __m128d inv = _mm_load_pd(invDir[a] + k);
+        __m128d ta = _mm_mul_pd(_mm_sub_pd(_mm_set1_pd(bmin[a]), o), inv);
+        __m128d tb = _mm_mul_pd(_mm_sub_pd(_mm_set1_pd(bmax[a]), o), inv);
+        // min/max return their second operand for NaNs, which keeps
+        // t0 and t1 unchanged on axes the ray is parallel to
+        t0 = _mm_max_pd(_mm_min_pd(ta, tb), t0);
+        t1 = _mm_min_pd(_mm_max_pd(ta, tb), t1);
+      }
+      __m128d ok = _mm_and_pd(_mm_cmple_pd(t0, t1), _mm_cmpge_pd(t1, eps));
+      mask |= (unsigned)_mm_movemask_pd(ok) << k;
+    }
+#else
+    for (int k = 0; k < PACKET_SIZE; ++k) {
+      double t0 = -INF, t1 = tBest[k];
+      for (int a = 0; a < 3; ++a) {
+        double ta = (bmin[a] - origin[a][k]) * invDir[a][k];
+        double tb = (bmax[a] - origin[a][k]) * invDir[a][k];
+        if (ta > tb)
+          std::swap(ta, tb);
+        t0 = std::max(t0, ta);
+        t1 = std::min(t1, tb);
+      }
+      if (t0 <= t1 && t1 >= RAY_EPSILON)
+        mask |= 1u << k;
+    }
+#endif
+    return mask & active;
+  }
+};
+
+// The prims of the full tree, boxes and all
+struct BVH::FullLeaf {
+  const Prim *prims;
+
+  void box(uint32_t k, glm::dvec3 &bmin, glm::dvec3 &bmax) const {
+    bmin = prims[k].bmin;
+    bmax = prims[k].bmax;
+  }
+  PrimType type(uint32_t k) const { return prims[k].type; }
+  uint32_t index(uint32_t k) const { return prims[k].index; }
+};
+
+// The prims of one leaf of a compressed tree, whose boxes are on a grid of
+// 255 steps spanning the leaf's box. The step is rounded up so the last
+// one reaches the far side of the box.
+struct BVH::QuantizedLeaf {
+  const QPrim *prims;
+  glm::dvec3 origin, step;
+
+  QuantizedLeaf(const QPrim *prims, const glm::dvec3 &bmin,
+                const glm::dvec3 &bmax)
+      : prims(prims), origin(bmin), step((bmax - bmin) / 255.0) {
+    for (int a = 0; a < 3; ++a)
+      while (at(a, 255) < bmax[a])
+        step[a] = std::nextafter(step[a], INF);
+  }
+
+  double at(int a, int n) const { return origin[a] + n * step[a]; }
+  void box(uint32_t k, glm::dvec3 &bmin, glm::dvec3 &bmax) const {
+    for (int a = 0; a < 3; ++a) {
+      bmin[a] = at(a, prims[k].lo[a]);
+      bmax[a] = at(a, prims[k].hi[a]);
+    }
+  }
+  PrimType type(uint32_t k) const { return (PrimType)prims[k].type; }
+  uint32_t index(uint32_t k) const { return prims[k].index; }
+};
+
+void BVH::QNode::childBox(int c, glm::dvec3 &bmin, glm::dvec3 &bmax) const {
+  for (int a = 0; a < 3; ++a) {
+    double scale = pow2(exponent[a]);
+    bmin[a] = origin[a] + lo[c][a] * scale;
+    bmax[a] = origin[a] + hi[c][a] * scale;
+  }
+}
+
+BVH::BVH(const std::vector<Geometry *> &objects, int leafSize,
+         bool compressed)
+    : leafSize((uint32_t)std::clamp(leafSize, 1, (int)MAX_LEAF)),
+      compressed(compressed) {
+  for (const Geometry *obj : objects) {
+    if (!obj->hasBoundingBoxCapability()) {
+      unbounded.push_back(obj);
+      continue;
+    }
+
+    const BoundingBox &b = obj->getBoundingBox();
+    if (auto mesh = dynamic_cast<const Trimesh *>(obj)) {
+      for (const TrimeshFace *face : mesh->getFaces()) {
+        Bounds tb = triangleBounds(face, mesh);
+        addPrim(tb.bmin, tb.bmax, TRIANGLE, triangles.size());
+        triangles.push_back({face, mesh});
+      }
+    } else if (dynamic_cast<const Sphere *>(obj)) {
+      addPrim(b.getMin(), b.getMax(), SPHERE, spheres.size());
+      spheres.emplace_back();
+    } else if (dynamic_cast<const Box *>(obj)) {
+      addPrim(b.getMin(), b.getMax(), BOX, boxes.size());
+      boxes.emplace_back();
+    } else if (dynamic_cast<const Square *>(obj)) {
+      addPrim(b.getMin(), b.getMax(), SQUARE, squares.size());
+      squares.emplace_back();
+    } else if (dynamic_cast<const Cylinder *>(obj)) {
+      addPrim(b.getMin(), b.getMax(), CYLINDER, cylinders.size());
+      cylinders.emplace_back();
+    } else if (dynamic_cast<const Cone *>(obj)) {
+      addPrim(b.getMin(), b.getMax(), CONE, cones.size());
+      cones.emplace_back();
+    } else {
+      addPrim(b.getMin(), b.getMax(), OTHER, others.size());
+      others.push_back(obj);
+      continue;
+    }
+    copyInstance(prims.back(), obj);
+  }
+
+  if (!prims.empty()) {
+    nodes.reserve(2 * prims.size() / this->leafSize + 1);
+    build(0, (uint32_t)prims.size(), 0);
+    if (!compressed) {
+      link();
+      return;
+    }
+    rootMin = nodes[0].bmin;
+    rootMax = nodes[0].bmax;
+    qprims.resize(prims.size());
+    if (nodes[0].count)
+      quantizePrims(0, (uint32_t)prims.size(), rootMin, rootMax);
+    else
+      compress(0);
+    nodes.clear();
+    nodes.shrink_to_fit();
+    prims.clear();
+    prims.shrink_to_fit();
+  }
+}
+
+// Append the compressed form of inner node n, followed by those of the
+// inner nodes below it, depth first, and quantize the prims of the leaves
+// below it. Returns its index in qnodes.
+uint32_t BVH::compress(uint32_t n) {
+  const Node &node = nodes[n];
+  uint32_t index = (uint32_t)qnodes.size();
+  qnodes.emplace_back();
+
+  // The grid starts at or below the node's box and has 255 steps of a
+  // power of two that reach past it
+  QNode q;
+  q.axis = (uint8_t)node.axis;
+  double scale[3];
+  for (int a = 0; a < 3; ++a) {
+    float origin = (float)node.bmin[a];
+    if (origin > node.bmin[a])
+      origin = std::nextafter(origin, -numeric_limits<float>::infinity());
+    double extent = node.bmax[a] - origin;
+    int e = extent > 0.0 ? std::ilogb(extent / 255.0) : -128;
+    e = std::clamp(e, -128, 127);
+    if (e < 127 && 255.0 * pow2(e) < extent)
+      ++e;
+    q.origin[a] = origin;
+    q.exponent[a] = (int8_t)e;
+    scale[a] = pow2(e);
+  }
+
+  const uint32_t kids[2] = {n + 1, node.first};
+  for (int c = 0; c < 2; ++c) {
+    const Node &child = nodes[kids[c]];
+    for (int a = 0; a < 3; ++a) {
+      double lo = std::floor((child.bmin[a] - q.origin[a]) / scale[a]);
+      double hi = std::ceil((child.bmax[a] - q.origin[a]) / scale[a]);
+      int l = (int)std::clamp(lo, 0.0, 255.0);
+      int h = (int)std::clamp(hi, 0.0, 255.0);
+      // Rounding in the divisions mustn't leave part of the child out
+      while (l > 0 && q.origin[a] + l * scale[a] > child.bmin[a])
+        --l;
+      while (h < 255 && q.origin[a] + h * scale[a] < child.bmax[a])
+        ++h;
+      q.lo[c][a] = (uint8_t)l;
+      q.hi[c][a] = (uint8_t)h;
+    }
+    q.count[c] = (uint16_t)child.count;
+    q.child[c] = child.count ? child.first : 0;
+    if (child.count) {
+      glm::dvec3 bmin, bmax;
+      q.childBox(c, bmin, bmax);
+      quantizePrims(child.first, child.count, bmin, bmax);
+    }
+  }
+  for (int c = 0; c < 2; ++c)
+    if (!q.count[c])
+      q.child[c] = compress(kids[c]);
+  qnodes[index] = q;
+  return index;
+}
+
+// Store the boxes of prims [first, first + count) on the grid of the leaf
+// box [bmin, bmax] they're in.
+void BVH::quantizePrims(uint32_t first, uint32_t count,
+                        const glm::dvec3 &bmin, const glm::dvec3 &bmax) {
+  QuantizedLeaf grid(qprims.data(), bmin, bmax);
+  for (uint32_t k = first; k < first + count; ++k) {
+    const Prim &p = prims[k];
+    QPrim &q = qprims[k];
+    for (int a = 0; a < 3; ++a) {
+      int l = 0, h = 255;
+      if (grid.step[a] > 0.0) {
+        l = (int)std::clamp(std::floor((p.bmin[a] - bmin[a]) / grid.step[a]),
+                            0.0, 255.0);
+        h = (int)std::clamp(std::ceil((p.bmax[a] - bmin[a]) / grid.step[a]),
+                            0.0, 255.0);
+      }
+      // As in compress(), rounding mustn't leave part of the prim out
+      while (l > 0 && grid.at(a, l) > p.bmin[a])
+        --l;
+      while (h < 255 && grid.at(a, h) < p.bmax[a])
+        ++h;
+      q.lo[a] = (uint8_t)l;
+      q.hi[a] = (uint8_t)h;
+    }
+    q.type = (uint8_t)p.type;
+    q.index = p.index;
+  }
+}
+
+size_t BVH::nodeBytes() const {
+  return nodes.size() * sizeof(Node) + qnodes.size() * sizeof(QNode) +
+         prims.size() * sizeof(Prim) + qprims.size() * sizeof(QPrim) +
+         (parents.size() + primLeaf.size()) * sizeof(uint32_t);
+}
+
+// Record the parent of every node and the leaf of every prim, and group
+// the prims by the object they came from.
+void BVH::link() {
+  parents.assign(nodes.size(), 0);
+  primLeaf.assign(prims.size(), 0);
+  sahSum = 0.0;
+  for (uint32_t n = 0; n < nodes.size(); ++n) {
+    const Node &node = nodes[n];
+    sahSum += sahWeight(node);
+    if (node.count) {
+      for (uint32_t k = node.first; k < node.first + node.count; ++k)
+        primLeaf[k] = n;
+    } else {
+      parents[n + 1] = n;
+      parents[node.first] = n;
+    }
+  }
+  builtCost = sahCost();
+  for (uint32_t k = 0; k < prims.size(); ++k)
+    objectPrims[primObject(prims[k])].push_back(k);
+}
+
+const Geometry *BVH::primObject(const Prim &p) const {
+  switch (p.type) {
+  case SPHERE:
+    return spheres[p.index].object;
+  case BOX:
+    return boxes[p.index].object;
+  case SQUARE:
+    return squares[p.index].object;
+  case CYLINDER:
+    return cylinders[p.index].object;
+  case CONE:
+    return cones[p.index].object;
+  case TRIANGLE:
+    return triangles[p.index].mesh;
+  case OTHER:
+    return others[p.index];
+  }
+  return nullptr;
+}
+
+// Copy what the test for a shape prim needs out of its object, which is
+// of the type the prim's tag says. Triangles and other prims refer to their
+// objects and have nothing to copy.
+void BVH::copyInstance(const Prim &p, const Geometry *obj) {
+  auto so = static_cast<const SceneObject *>(obj);
+  auto copy = [so](auto &inst) {
+    const MatrixTransform &t = so->getTransform();
+    inst.frame = {t.inverseTransform(), t.normalTransform()};
+    inst.material = so->getMaterialIndex();
+    inst.object = so;
+  };
+  switch (p.type) {
+  case SPHERE:
+    copy(spheres[p.index]);
+    break;
+  case BOX:
+    copy(boxes[p.index]);
+    break;
+  case SQUARE:
+    copy(squares[p.index]);
+    break;
+  case CYLINDER:
+    copy(cylinders[p.index]);
+    cylinders[p.index].shape = static_cast<const Cylinder *>(so)->isCapped();
+    break;
+  case CONE:
+    copy(cones[p.index]);
+    cones[p.index].shape = static_cast<const Cone *>(so)->shape();
+    break;
+  default:
+    break;
+  }
+}
+
+// A node costs its area times the prims tested in a leaf, or one box test
+// for an inner node.
+double BVH::sahWeight(const Node &node) const {
+  return Bounds{node.bmin, node.bmax}.area() * (node.count ? node.count : 1);
+}
+
+double BVH::sahCost() const {
+  double rootArea = Bounds{nodes[0].bmin, nodes[0].bmax}.area();
+  return rootArea > 0.0 ? sahSum / rootArea : 1.0;
+}
+
+double BVH::degradation() const {
+  if (nodes.empty() || builtCost <= 0.0)
+    return 1.0;
+  return sahCost() / builtCost;
+}
+
+bool BVH::refit(const Geometry *obj) {
+  auto it = objectPrims.find(obj);
+  if (it == objectPrims.end())
+    return std::find(unbounded.begin(), unbounded.end(), obj) !=
+           unbounded.end();
+
+  std::vector<uint32_t> leaves;
+  for (uint32_t k : it->second) {
+    Prim &p = prims[k];
+    Bounds b;
+    if (p.type == TRIANGLE) {
+      b = triangleBounds(triangles[p.index].face, triangles[p.index].mesh);
+    } else {
+      const BoundingBox &box = obj->getBoundingBox();
+      b.grow(box.getMin(), box.getMax());
+      copyInstance(p, obj);
+    }
+    p.bmin = b.bmin;
+    p.bmax = b.bmax;
+    leaves.push_back(primLeaf[k]);
+  }
+  std::sort(leaves.begin(), leaves.end());
+  leaves.erase(std::unique(leaves.begin(), leaves.end()), leaves.end());
+
+  // Walk up from each leaf until a node's bounds come out unchanged
+  for (uint32_t n : leaves) {
+    for (;;) {
+      Node &node = nodes[n];
+      Bounds b;
+      if (node.count) {
+        for (uint32_t k = node.first; k < node.first + node.count; ++k)
+          b.grow(prims[k].bmin, prims[k].bmax);
+      } else {
+        b.grow(nodes[n + 1].bmin, nodes[n + 1].bmax);
+        b.grow(nodes[node.first].bmin, nodes[node.first].bmax);
+      }
+      if (b.bmin == node.bmin && b.bmax == node.bmax)
+        break;
+      sahSum -= sahWeight(node);
+      node.bmin = b.bmin;
+      node.bmax = b.bmax;
+      sahSum += sahWeight(node);
+      if (n == 0)
+        break;
+      n = parents[n];
+    }
+  }
+  return true;
+}
+
+void BVH::addPrim(const glm::dvec3 &bmin, const glm::dvec3 &bmax,
+                  PrimType type, size_t index) {
+  Prim p;
+  p.bmin = bmin;
+  p.bmax = bmax;
+  p.type = type;
+  p.index = (uint32_t)index;
+  prims.push_back(p);
+}
+
+// Build the subtree over prims [first, first + count) with binned SAH
+// splits along the widest centroid axis. Returns its root's index.
+uint32_t BVH::build(uint32_t first, uint32_t count, int depth) {
+  Bounds bounds, centroids;
+  for (uint32_t k = first; k < first + count; ++k) {
+    bounds.grow(prims[k].bmin, prims[k].bmax);
+    glm::dvec3 c = 0.5 * (prims[k].bmin + prims[k].bmax);
+    centroids.grow(c, c);
+  }
+
+  uint32_t index = (uint32_t)nodes.size();
+  Node node;
+  node.bmin = bounds.bmin;
+  node.bmax = bounds.bmax;
+  node.first = first;
+  node.count = count;
+  node.axis = 0;
+  nodes.push_back(node);
+
+  glm::dvec3 extent = centroids.bmax - centroids.bmin;
+  int axis = extent[0] > extent[1] ? (extent[0] > extent[2] ? 0 : 2)
+                                   : (extent[1] > extent[2] ? 1 : 2);
+  // Prims whose centroids all coincide can't be told apart by splitting,
+  // but they're still halved if there are too many for one leaf
+  if (count <= leafSize || (extent[axis] <= 0.0 && count <= MAX_LEAF))
+    return index;
+
+  auto centroid = [axis](const Prim &p) {
+    return 0.5 * (p.bmin[axis] + p.bmax[axis]);
+  };
+  auto begin = prims.begin() + first;
+  auto end = begin + count;
+  uint32_t mid = first;
+
+  if (depth < MAX_SAH_DEPTH && extent[axis] > 0.0) {
+    const double lo = centroids.bmin[axis];
+    const double scale = SAH_BINS / extent[axis];
+    auto binOf = [&](const Prim &p) {
+      return std::min(int((centroid(p) - lo) * scale), SAH_BINS - 1);
+    };
+
+    Bounds binBounds[SAH_BINS];
+    uint32_t binCount[SAH_BINS] = {0};
+    for (auto it = begin; it != end; ++it) {
+      int b = binOf(*it);
+      binBounds[b].grow(it->bmin, it->bmax);
+      binCount[b]++;
+    }
+
+    // Sweep from the right to get the cost of every right-hand side, then
+    // from the left to find the cheapest split.
+    double rightArea[SAH_BINS];
+    uint32_t rightCount[SAH_BINS];
+    Bounds acc;
+    uint32_t n = 0;
+    for (int b = SAH_BINS - 1; b > 0; --b) {
+      acc.grow(binBounds[b]);
+      n += binCount[b];
+      rightArea[b] = acc.area();
+      rightCount[b] = n;
+    }
+
+    acc = Bounds();
+    n = 0;
+    double bestCost = INF;
+    int bestSplit = -1;
+    for (int b = 1; b < SAH_BINS; ++b) {
+      acc.grow(binBounds[b - 1]);
+      n += binCount[b - 1];
+      if (n == 0 || rightCount[b] == 0)
+        continue;
+      double cost = acc.area() * n + rightArea[b] * rightCount[b];
+      if (cost < bestCost) {
+        bestCost = cost;
+        bestSplit = b;
+      }
+    }
+
+    if (bestSplit > 0)
+      mid = (uint32_t)(std::partition(begin, end,
+                                      [&](const Prim &p) {
+                                        return binOf(p) < bestSplit;
+                                      }) -
+                       prims.begin());
+  }
+
+  if (mid == first || mid == first + count) {
+    mid = first + count / 2;
+    std::nth_element(begin, prims.begin() + mid, end,
+                     [&](const Prim &a, const Prim &b) {
+                       return centroid(a) < centroid(b);
+                     });
+  }
+
+  build(first, mid - first, depth + 1);
+  uint32_t right = build(mid, first + count - mid, depth + 1);
+  nodes[index].first = right;
+  nodes[index].count = 0;
+  nodes[index].axis = axis;
+  return index;
+}
+
+// Primitive ids are indices into prims, followed by the unbounded objects.
+bool BVH::intersect(ray &r, isect &i, uint32_t *prim) const {
+  bool have_one = false;
+  double tBest = INF;
+  uint32_t best = 0;
+
+  for (size_t k = 0; k < unbounded.size(); ++k) {
+    isect cur;
+    if (unbounded[k]->intersect(r, cur) && cur.getT() < tBest) {
+      i = cur;
+      tBest = cur.getT();
+      best = (uint32_t)(primCount() + k);
+      have_one = true;
+    }
+  }
+
+  if (primCount() == 0) {
+    if (prim)
+      *prim = best;
+    return have_one;
+  }
+
+  Traversal tr(r);
+  TriangleHit tri;
+  if (compressed) {
+    if (intersectCompressed(tr, r, i, tBest, best, tri))
+      have_one = true;
+  } else {
+    uint32_t stack[STACK_SIZE];
+    int top = 0;
+    uint32_t n = 0;
+    for (;;) {
+      const Node &node = nodes[n];
+      if (ray_cost)
+        ray_cost->boxTests++;
+      if (tr.hits(node.bmin, node.bmax, tBest)) {
+        if (node.count) {
+          if (intersectLeaf(FullLeaf{prims.data()}, node.first, node.count,
+                            tr, r, i, tBest, best, tri))
+            have_one = true;
+        } else {
+          // Visit the near child first so far subtrees can be culled by
+          // tBest
+          if (tr.dirNeg[node.axis]) {
+            stack[top++] = n + 1;
+            n = node.first;
+          } else {
+            stack[top++] = node.first;
+            n = n + 1;
+          }
+          continue;
+        }
+      }
+      if (top == 0)
+        break;
+      n = stack[--top];
+    }
+  }
+  if (tri.triangle)
+    fillTriangle(tri, i);
+  if (prim)
+    *prim = best;
+  return have_one;
+}
+
+// The loop above for a compressed tree. Both children's boxes are tested
+// at once, the nearer first, and leaf children are searched right away.
+bool BVH::intersectCompressed(const Traversal &tr, ray &r, isect &i,
+                              double &tBest, uint32_t &best,
+                              TriangleHit &tri) const {
+  if (ray_cost)
+    ray_cost->boxTests++;
+  if (!tr.hits(rootMin, rootMax, tBest))
+    return false;
+  if (qnodes.empty())
+    return intersectLeaf(QuantizedLeaf(qprims.data(), rootMin, rootMax), 0,
+                         (uint32_t)qprims.size(), tr, r, i, tBest, best, tri);
+
+  bool have_one = false;
+  uint32_t stack[STACK_SIZE];
+  int top = 0;
+  uint32_t n = 0;
+  for (;;) {
+    const QNode &q = qnodes[n];
+    const int nearest = tr.dirNeg[q.axis] ? 1 : 0;
+    bool hit[2]; // nearer child first
+    for (int k = 0; k < 2; ++k) {
+      int c = nearest ^ k;
+      glm::dvec3 bmin, bmax;
+      q.childBox(c, bmin, bmax);
+      if (ray_cost)
+        ray_cost->boxTests++;
+      hit[k] = tr.hits(bmin, bmax, tBest);
+      if (hit[k] && q.count[c]) {
+        if (intersectLeaf(QuantizedLeaf(qprims.data(), bmin, bmax),
+                          q.child[c], q.count[c], tr, r, i, tBest, best, tri))
+          have_one = true;
+        hit[k] = false;
+      }
+    }
+    if (hit[0] || hit[1]) {
+      if (hit[0] && hit[1])
+        stack[top++] = q.child[nearest ^ 1];
+      n = q.child[hit[0] ? nearest : nearest ^ 1];
+      continue;
+    }
+    if (top == 0)
+      break;
+    n = stack[--top];
+  }
+  return have_one;
+}
+
+bool BVH::intersectPrimitive(uint32_t prim, ray &r, isect &i) const {
+  if (compressed && prim < qprims.size())
+    return intersectPrim((PrimType)qprims[prim].type, qprims[prim].index, r,
+                         i);
+  if (!compressed && prim < prims.size())
+    return intersectPrim(prims[prim].type, prims[prim].index, r, i);
+  prim -= (uint32_t)primCount();
+  return prim < unbounded.size() && unbounded[prim]->intersect(r, i);
+}
+
+// Triangles hit are only recorded in `tri`, which stands in for `i` until
+// the caller fills it in; any closer hit on another prim clears it.
+template <typename Leaf>
+bool BVH::intersectLeaf(const Leaf &leaf, uint32_t first, uint32_t count,
+                        const Traversal &tr, ray &r, isect &i, double &tBest,
+                        uint32_t &best, TriangleHit &tri) const {
+  bool have_one = false;
+  for (uint32_t k = first; k < first + count; ++k) {
+    glm::dvec3 bmin, bmax;
+    leaf.box(k, bmin, bmax);
+    if (ray_cost)
+      ray_cost->boxTests++;
+    if (!tr.hits(bmin, bmax, tBest))
+      continue;
+    if (ray_cost)
+      ray_cost->primTests++;
+
+    const PrimType type = leaf.type(k);
+    const uint32_t index = leaf.index(k);
+    if (type == TRIANGLE) {
+      TriangleHit cur;
+      if (hitTriangle(triangles[index], r, cur) && cur.t < tBest) {
+        tri = cur;
+        tBest = cur.t;
+        best = k;
+        have_one = true;
+      }
+      continue;
+    }
+    isect cur;
+    if (intersectPrim(type, index, r, cur) && cur.getT() < tBest) {
+      i = cur;
+      tri.triangle = nullptr;
+      tBest = cur.getT();
+      best = k;
+      have_one = true;
+    }
+  }
+  return have_one;
+}
+
+bool BVH::intersectPrim(PrimType type, uint32_t index, ray &r,
+                        isect &i) const {
+  switch (type) {
+  case SPHERE:
+    return intersectInstance(spheres[index], r, i, Sphere::intersectShape);
+  case BOX:
+    return intersectInstance(boxes[index], r, i, Box::intersectShape);
+  case SQUARE:
+    return intersectInstance(squares[index], r, i, Square::intersectShape);
+  case CYLINDER: {
+    const auto &c = cylinders[index];
+    return intersectInstance(c, r, i, [&c](ray &lr, isect &li) {
+      return Cylinder::intersectShape(c.shape, lr, li);
+    });
+  }
+  case CONE: {
+    const auto &c = cones[index];
+    return intersectInstance(c, r, i, [&c](ray &lr, isect &li) {
+      return Cone::intersectShape(c.shape, lr, li);
+    });
+  }
+  case TRIANGLE: {
+    const TrimeshFace *face = triangles[index].face;
+    return intersectLocalized(
+        triangles[index].mesh->getTransform(), r, i,
+        [face](ray &lr, isect &li) { return face->intersectLocal(lr, li); });
+  }
+  case OTHER:
+    return others[index]->intersect(r, i);
+  }
+  return false;
+}
+
+bool BVH::hitTriangle(const Triangle &tri, ray &r, TriangleHit &h) const {
+  return inLocalSpace(tri.mesh->getTransform(), r,
+                      [&](ray &lr, double length) {
+                        if (!tri.face->hitLocal(lr, h.tLocal, h.beta, h.gamma))
+                          return false;
+                        h.triangle = &tri;
+                        h.t = h.tLocal / length;
+                        return true;
+                      });
+}
+
+void BVH::fillTriangle(const TriangleHit &h, isect &i) const {
+  isect cur;
+  h.triangle->face->fillHit(cur, h.tLocal, h.beta, h.gamma);
+  cur.setN(h.triangle->mesh->getTransform().localToGlobalCoordsNormal(
+      cur.getN()));
+  cur.setT(h.t);
+  i = cur;
+}
+
+unsigned BVH::intersect(ray *rays, int count, isect *hits) const {
+  Packet packet(rays, count);
+  unsigned found = 0;
+
+  for (const Geometry *obj : unbounded)
+    for (int k = 0; k < count; ++k) {
+      isect cur;
+      if (obj->intersect(rays[k], cur) && cur.getT() < packet.tBest[k]) {
+        hits[k] = cur;
+        packet.tBest[k] = cur.getT();
+        found |= 1u << k;
+      }
+    }
+
+  if (primCount() == 0)
+    return found;
+  if (compressed) {
+    found |= intersectCompressed(packet, rays, hits);
+  } else {
+    uint32_t stack[STACK_SIZE];
+    int top = 0;
+    uint32_t n = 0;
+    for (;;) {
+      const Node &node = nodes[n];
+      unsigned active = packet.hits(node.bmin, node.bmax, packet.lanes);
+      if (active) {
+        if (node.count) {
+          found |= intersectLeaf(FullLeaf{prims.data()}, node.first,
+                                 node.count, active, packet, rays, hits);
+        } else {
+          if (packet.dirNeg[node.axis]) {
+            stack[top++] = n + 1;
+            n = node.first;
+          } else {
+            stack[top++] = node.first;
+            n = n + 1;
+          }
+          continue;
+        }
+      }
+      if (top == 0)
+        break;
+      n = stack[--top];
+    }
+  }
+  for (int k = 0; k < count; ++k)
+    if (packet.tri[k].triangle)
+      fillTriangle(packet.tri[k], hits[k]);
+  return found;
+}
+
+// Test the lanes in `active` against the prims of a leaf. Returns the
+// lanes that found a closer hit. As for a single ray, triangle hits are
+// left in packet.tri until the traversal is done.
+template <typename Leaf>
+unsigned BVH::intersectLeaf(const Leaf &leaf, uint32_t first, uint32_t count,
+                            unsigned active, Packet &packet, ray *rays,
+                            isect *hits) const {
+  unsigned found = 0;
+  for (uint32_t p = first; p < first + count; ++p) {
+    glm::dvec3 bmin, bmax;
+    leaf.box(p, bmin, bmax);
+    unsigned lanes = packet.hits(bmin, bmax, active);
+    if (!lanes)
+      continue;
+    const PrimType type = leaf.type(p);
+    const uint32_t index = leaf.index(p);
+    for (int k = 0; lanes; ++k, lanes >>= 1) {
+      if (!(lanes & 1))
+        continue;
+      if (type == TRIANGLE) {
+        TriangleHit cur;
+        if (hitTriangle(triangles[index], rays[k], cur) &&
+            cur.t < packet.tBest[k]) {
+          packet.tri[k] = cur;
+          packet.tBest[k] = cur.t;
+          found |= 1u << k;
+        }
+        continue;
+      }
+      isect cur;
+      if (intersectPrim(type, index, rays[k], cur) &&
+          cur.getT() < packet.tBest[k]) {
+        hits[k] = cur;
+        packet.tri[k].triangle = nullptr;
+        packet.tBest[k] = cur.getT();
+        found |= 1u << k;
+      }
+    }
+  }
+  return found;
+}
+
+// The packet loop for a compressed tree. Each lane carries on into a child
+// only if it entered the child's box, so the mask narrows on the way down.
+unsigned BVH::intersectCompressed(Packet &packet, ray *rays,
+                                  isect *hits) const {
+  unsigned active = packet.hits(rootMin, rootMax, packet.lanes);
+  if (!active)
+    return 0;
+  if (qnodes.empty())
+    return intersectLeaf(QuantizedLeaf(qprims.data(), rootMin, rootMax), 0,
+                         (uint32_t)qprims.size(), active, packet, rays, hits);
+
+  struct Entry {
+    uint32_t node;
+    unsigned lanes;
+  };
+  Entry stack[STACK_SIZE];
+  int top = 0;
+  uint32_t n = 0;
+  unsigned found = 0;
+  for (;;) {
+    const QNode &q = qnodes[n];
+    const int nearest = packet.dirNeg[q.axis] ? 1 : 0;
+    unsigned hit[2]; // nearer child first
+    for (int k = 0; k < 2; ++k) {
+      int c = nearest ^ k;
+      glm::dvec3 bmin, bmax;
+      q.childBox(c, bmin, bmax);
+      hit[k] = packet.hits(bmin, bmax, active);
+      if (hit[k] && q.count[c]) {
+        found |= intersectLeaf(QuantizedLeaf(qprims.data(), bmin, bmax),
+                               q.child[c], q.count[c], hit[k], packet, rays,
+                               hits);
+        hit[k] = 0;
+      }
+    }
+    if (hit[0] || hit[1]) {
+      if (hit[0] && hit[1])
+        stack[top++] = {q.child[nearest ^ 1], hit[1]};
+      int k = hit[0] ? 0 : 1;
+      n = q.child[nearest ^ k];
+      active = hit[k];
+      continue;
+    }
+    if (top == 0)
+      break;
+    --top;
+    n = stack[top].node;
+    active = stack[top].lanes;
+  }
+  return found;
+}
@@ -0,0 +1,231 @@
+//
+// bvh.h
+//
+// A bounding volume hierarchy over the scene's primitives. The BVH keeps
+// its own copy of the scene grouped by primitive type: one array each for
+// spheres, boxes, squares, cylinders and cones, holding by value what each
+// shape's test needs (its transform, shape parameters and material), and
+// one of mesh triangles, which point into their mesh's vertex arrays.
+// Leaves dispatch on a type tag and call the shape's static test directly,
+// so tracing neither goes through Geometry's virtual calls nor touches the
+// scene objects until it has a hit. The SceneObject classes stay the
+// authoring and parsing API; a BVH is built from them once the scene is
+// complete.
+//
+// For scenes too big for the hierarchy to stay in cache, a BVH can be
+// built compressed: each inner node then holds both of its children's
+// boxes quantized to 8 bits per side relative to its own box, leaves are
+// folded into their parents, and each primitive's box is quantized the
+// same way relative to its leaf's box. Nodes and primitive boxes together
+// take about a quarter of the memory (some 20 bytes a primitive instead of
+// 85 with the default leaf size), at the price of slightly looser boxes
+// and no refitting.
+//
+
+#ifndef __BVH_H__
+#define __BVH_H__
+
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+#include <glm/mat3x3.hpp>
+#include <glm/mat4x4.hpp>
+#include <glm/vec3.hpp>
+
+#include "../SceneObjects/Cone.h"
+
+class Geometry;
+class SceneObject;
+class Trimesh;
+class TrimeshFace;
+class isect;
+class ray;
+
+class BVH {
+public:
+  enum PrimType : uint32_t {
+    SPHERE,
+    BOX,
+    SQUARE,
+    CYLINDER,
+    CONE,
+    TRIANGLE,
+    OTHER // bounded objects of types the BVH doesn't know about
+  };
+
+  // Trimeshes are split into their faces. Objects without a bounding box
+  // are kept aside and tested against every ray. Leaves hold at most
+  // `leafSize` primitives, unless they can't be split any further.
+  BVH(const std::vector<Geometry *> &objects, int leafSize,
+      bool compressed = false);
+
+  // Closest hit along r, like Scene::intersect(). If `prim` is given it's
+  // set to the id of the primitive hit, which intersectPrimitive() takes.
+  bool intersect(ray &r, isect &i, uint32_t *prim = nullptr) const;
+  bool intersectPrimitive(uint32_t prim, ray &r, isect &i) const;
+
+  // Closest hits of up to PACKET_SIZE coherent rays, such as the camera
+  // rays of neighboring pixels. The rays walk the tree together and are
+  // tested against each box side by side; primitives are tested one ray at
+  // a time. Returns a mask with bit k set if rays[k] hit something.
+  static const int PACKET_SIZE = 4;
+  unsigned intersect(ray *rays, int count, isect *hits) const;
+
+  // Bring the tree up to date after obj has moved and its bounding box has
+  // been recomputed. Only the leaves holding obj's primitives and their
+  // ancestors are touched. Returns false if obj isn't in the tree, or if
+  // the tree is compressed and has to be rebuilt instead.
+  bool refit(const Geometry *obj);
+
+  // Surface area heuristic cost of the tree now relative to when it was
+  // built. Refits let it grow; past some point a rebuild pays for itself.
+  double degradation() const;
+
+  int getLeafSize() const { return (int)leafSize; }
+  size_t primCount() const {
+    return compressed ? qprims.size() : prims.size();
+  }
+  bool isCompressed() const { return compressed; }
+  size_t nodeCount() const {
+    return compressed ? qnodes.size() : nodes.size();
+  }
+  // Memory taken by the hierarchy and the primitives' boxes, but not by
+  // the copies of the shapes the primitives refer to
+  size_t nodeBytes() const;
+
+private:
+  struct Prim {
+    glm::dvec3 bmin, bmax;
+    PrimType type;
+    uint32_t index; // into the array for its type
+  };
+
+  // Nodes are stored depth first, so an inner node's left child directly
+  // follows it.
+  struct Node {
+    glm::dvec3 bmin, bmax;
+    uint32_t first; // first prim of a leaf, or an inner node's right child
+    uint32_t count; // prims in a leaf, 0 for inner nodes
+    uint32_t axis;  // split axis of an inner node
+  };
+
+  // An inner node of a compressed tree. Child c spans
+  // origin + [lo[c], hi[c]] * 2^exponent on each axis; that's never smaller
+  // than its real box. A child with a count is a leaf over prims
+  // [child, child + count), otherwise child is the index of its node.
+  struct QNode {
+    float origin[3];
+    int8_t exponent[3];
+    uint8_t axis; // split axis
+    uint8_t lo[2][3], hi[2][3];
+    uint16_t count[2];
+    uint32_t child[2];
+
+    void childBox(int c, glm::dvec3 &bmin, glm::dvec3 &bmax) const;
+  };
+
+  // A prim of a compressed tree. Its box is stored in 255 steps across
+  // the box of the leaf it's in, rounded outward.
+  struct QPrim {
+    uint8_t lo[3], hi[3];
+    uint8_t type; // PrimType
+    uint32_t index;
+  };
+
+  // How the leaf loops get at the prims of either kind of tree
+  struct FullLeaf;
+  struct QuantizedLeaf;
+
+  // A shape's transform, as much of it as the intersection test uses
+  struct Frame {
+    glm::dmat4x4 toLocal;
+    glm::dmat3x3 normalToGlobal;
+
+    glm::dvec3 globalToLocalCoords(const glm::dvec3 &v) const;
+    glm::dvec3 localToGlobalCoordsNormal(const glm::dvec3 &v) const;
+  };
+
+  // A copy of a sphere, box, square, cylinder or cone; Shape holds the
+  // parameters its test takes, if any. The object is only recorded in
+  // hits and used for refitting.
+  struct NoShape {};
+  template <typename Shape> struct Instance {
+    Frame frame;
+    Shape shape;
+    uint32_t material;
+    const SceneObject *object;
+  };
+
+  struct Triangle {
+    const TrimeshFace *face;
+    const Trimesh *mesh;
+  };
+
+  // The closest triangle hit in a traversal so far. Only where the ray hits
+  // is worked out while searching; the hit is filled in from the mesh's
+  // vertex data once, for the triangle that ends up closest.
+  struct TriangleHit {
+    const Triangle *triangle = nullptr;
+    double t;                   // along the ray as traced
+    double tLocal, beta, gamma; // in the mesh's space, for fillHit()
+  };
+
+  struct Traversal;
+  struct Packet;
+
+  void addPrim(const glm::dvec3 &bmin, const glm::dvec3 &bmax, PrimType type,
+               size_t index);
+  uint32_t build(uint32_t first, uint32_t count, int depth);
+  void link();
+  uint32_t compress(uint32_t n);
+  const Geometry *primObject(const Prim &p) const;
+  void copyInstance(const Prim &p, const Geometry *obj);
+  double sahWeight(const Node &node) const;
+  double sahCost() const;
+  void quantizePrims(uint32_t first, uint32_t count, const glm::dvec3 &bmin,
+                     const glm::dvec3 &bmax);
+  template <typename Leaf>
+  bool intersectLeaf(const Leaf &leaf, uint32_t first, uint32_t count,
+                     const Traversal &tr, ray &r, isect &i, double &tBest,
+                     uint32_t &best, TriangleHit &tri) const;
+  template <typename Leaf>
+  unsigned intersectLeaf(const Leaf &leaf, uint32_t first, uint32_t count,
+                         unsigned active, Packet &packet, ray *rays,
+                         isect *hits) const;
+  bool intersectCompressed(const Traversal &tr, ray &r, isect &i,
+                           double &tBest, uint32_t &best,
+                           TriangleHit &tri) const;
+  unsigned intersectCompressed(Packet &packet, ray *rays, isect *hits) const;
+  bool intersectPrim(PrimType type, uint32_t index, ray &r, isect &i) const;
+  bool hitTriangle(const Triangle &tri, ray &r, TriangleHit &h) const;
+  void fillTriangle(const TriangleHit &h, isect &i) const;
+
+  std::vector<Instance<NoShape>> spheres;
+  std::vector<Instance<NoShape>> boxes;
+  std::vector<Instance<NoShape>> squares;
+  std::vector<Instance<bool>> cylinders; // whether it's capped
+  std::vector<Instance<Cone::Shape>> cones;
+  std::vector<Triangle> triangles;
+  std::vector<const Geometry *> others;
+  std::vector<const Geometry *> unbounded;
+
+  std::vector<Prim> prims;
+  std::vector<Node> nodes;
+  uint32_t leafSize;
+
+  // A compressed tree keeps only these; the root's box stays exact
+  bool compressed;
+  std::vector<QNode> qnodes;
+  std::vector<QPrim> qprims; // in place of prims
+  glm::dvec3 rootMin, rootMax;
+
+  // For refitting
+  std::vector<uint32_t> parents;  // of each node; the root's is unused
+  std::vector<uint32_t> primLeaf; // leaf holding each prim
+  std::unordered_map<const Geometry *, std::vector<uint32_t>> objectPrims;
+  double sahSum = 0.0; // node areas weighted by cost, see sahWeight()
+  double builtCost = 1.0;
+};
+
+#endif // __BVH_H__
@@ -0,0 +1,113 @@
+#include "cameraPath.h"
+#include "../parser/ParserException.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <glm/glm.hpp>
+
+#include <json.hpp>
+using json = nlohmann::json;
+
+namespace {
+glm::dvec3 lerp(const glm::dvec3 &a, const glm::dvec3 &b, double t) {
+  return a + t * (b - a);
+}
+
+double lerp(double a, double b, double t) { return a + t * (b - a); }
+
+// Spherical interpolation between unit quaternions, taking the short way
+// round.
+glm::dvec4 lerp(const glm::dvec4 &a, glm::dvec4 b, double t) {
+  double cosTheta = glm::dot(a, b);
+  if (cosTheta < 0.0) {
+    b = -b;
+    cosTheta = -cosTheta;
+  }
+  if (cosTheta > 0.9995)
+    return glm::normalize(a + t * (b - a));
+  double theta = std::acos(cosTheta);
+  double sinTheta = std::sin(theta);
+  return (std::sin((1.0 - t) * theta) / sinTheta) * a +
+         (std::sin(t * theta) / sinTheta) * b;
+}
+
+// Evaluate a track at `frame`; keys are sorted by frame.
+template <typename Key>
+auto sample(const std::vector<Key> &keys, double frame) {
+  if (frame <= keys.front().frame)
+    return keys.front().value;
+  if (frame >= keys.back().frame)
+    return keys.back().value;
+  auto hi = std::upper_bound(
+      keys.begin(), keys.end(), frame,
+      [](double f, const Key &k) { return f < k.frame; });
+  auto lo = hi - 1;
+  double t = (frame - lo->frame) / (hi->frame - lo->frame);
+  return lerp(lo->value, hi->value, t);
+}
+
+glm::dvec3 toVec3(const json &j) {
+  return glm::dvec3(j.at(0).get<double>(), j.at(1).get<double>(),
+                    j.at(2).get<double>());
+}
+} // namespace
+
+CameraPath CameraPath::load(const std::string &filename) {
+  std::ifstream ifs(filename);
+  if (!ifs)
+    throw ParserException("couldn't read camera path " + filename);
+
+  CameraPath path;
+  try {
+    json j = json::parse(ifs);
+    double lo = 0.0, hi = 0.0;
+    bool any = false;
+    for (const json &k : j.at("keyframes")) {
+      double f = k.at("frame").get<double>();
+      lo = any ? std::min(lo, f) : f;
+      hi = any ? std::max(hi, f) : f;
+      any = true;
+      if (k.contains("position"))
+        path.positions.push_back({f, toVec3(k.at("position"))});
+      if (k.contains("look")) {
+        const json &q = k.at("look");
+        glm::dvec4 look(q.at(0).get<double>(), q.at(1).get<double>(),
+                        q.at(2).get<double>(), q.at(3).get<double>());
+        path.looks.push_back({f, glm::normalize(look)});
+      }
+      if (k.contains("fov"))
+        path.fovs.push_back({f, k.at("fov").get<double>()});
+    }
+    if (!any)
+      throw ParserException("camera path " + filename + " has no keyframes");
+
+    path.first = (int)std::floor(lo);
+    path.last = (int)std::ceil(hi);
+    if (j.contains("range")) {
+      path.first = j.at("range").at(0).get<int>();
+      path.last = j.at("range").at(1).get<int>();
+    }
+  } catch (const json::exception &e) {
+    throw ParserException("invalid camera path " + filename + ": " + e.what());
+  }
+
+  auto byFrame = [](const auto &a, const auto &b) { return a.frame < b.frame; };
+  std::stable_sort(path.positions.begin(), path.positions.end(), byFrame);
+  std::stable_sort(path.looks.begin(), path.looks.end(), byFrame);
+  std::stable_sort(path.fovs.begin(), path.fovs.end(), byFrame);
+  return path;
+}
+
+Camera CameraPath::at(double frame, const Camera &base) const {
+  Camera c = base;
+  if (!positions.empty())
+    c.setEye(sample(positions, frame));
+  if (!looks.empty()) {
+    glm::dvec4 q = sample(looks, frame);
+    c.setLook(q[0], q[1], q[2], q[3]);
+  }
+  if (!fovs.empty())
+    c.setFOV(sample(fovs, frame));
+  return c;
+}
@@ -0,0 +1,47 @@
+#ifndef CAMERA_PATH_H
+#define CAMERA_PATH_H
+
+#include "camera.h"
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+#include <string>
+#include <vector>
+
+/* A keyframed camera animation, read from JSON:
+
+     {"range": [0, 119],
+      "keyframes": [
+        {"frame": 0,   "position": [0, 0, 5], "look": [0, 0, 0, 1], "fov": 45},
+        {"frame": 119, "position": [5, 0, 0], "look": [0, 0.7071, 0, 0.7071]}
+      ]}
+
+   "look" is a quaternion in the same order Camera::setLook takes it.
+   Position, look and fov are separate tracks: each is interpolated between
+   the keyframes that set it (linearly, or by slerp for look) and held
+   constant past its first and last key. Tracks with no keys leave the scene
+   camera alone. "range" defaults to the span of the keyframes. */
+class CameraPath {
+public:
+  // Throws ParserException on malformed input
+  static CameraPath load(const std::string &filename);
+
+  int firstFrame() const { return first; }
+  int lastFrame() const { return last; }
+
+  // Returns `base` moved to where the path puts it at `frame`.
+  Camera at(double frame, const Camera &base) const;
+
+private:
+  template <typename T> struct Key {
+    double frame;
+    T value;
+  };
+
+  std::vector<Key<glm::dvec3>> positions;
+  std::vector<Key<glm::dvec4>> looks;
+  std::vector<Key<double>> fovs;
+  int first = 0;
+  int last = 0;
+};
+
+#endif
@@ -0,0 +1,97 @@
+#include "denoiser.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+namespace {
+// Taps of the B3-spline kernel, from the center out
+const float KERNEL[3] = {3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f};
+
+// How fast the weight of a tap falls off with the difference from the
+// center. Color differences are allowed less and less each pass, as the
+// noise they came from is smoothed away.
+const float COLOR_SIGMA2 = 0.05f;
+const float NORMAL_SIGMA2 = 0.1f;
+const float ALBEDO_SIGMA2 = 0.02f;
+const float DEPTH_SIGMA = 0.02f; // relative to the center's depth, per step
+
+float distance2(const float *a, const float *b) {
+  float d0 = a[0] - b[0], d1 = a[1] - b[1], d2 = a[2] - b[2];
+  return d0 * d0 + d1 * d1 + d2 * d2;
+}
+
+float distance2(const glm::vec3 &a, const glm::vec3 &b) {
+  float d0 = a[0] - b[0], d1 = a[1] - b[1], d2 = a[2] - b[2];
+  return d0 * d0 + d1 * d1 + d2 * d2;
+}
+
+// How much a tap at q may contribute to p, going by the surfaces their
+// camera rays hit. Pixels that saw the background only mix with each other.
+float guideWeight(const float *p, const float *q, int step) {
+  bool hitP = p[AUX_DEPTH] > 0.0f, hitQ = q[AUX_DEPTH] > 0.0f;
+  if (hitP != hitQ)
+    return 0.0f;
+  if (!hitP)
+    return 1.0f;
+  float dz = std::fabs(p[AUX_DEPTH] - q[AUX_DEPTH]) /
+             (DEPTH_SIGMA * p[AUX_DEPTH] * step);
+  return std::exp(-distance2(p + AUX_NX, q + AUX_NX) / NORMAL_SIGMA2 - dz -
+                  distance2(p + AUX_R, q + AUX_R) / ALBEDO_SIGMA2);
+}
+} // namespace
+
+Denoiser::Denoiser(unsigned char *rgb, const float *aux, int width, int x0,
+                   int y0, int x1, int y1, int passes)
+    : rgb(rgb), aux(aux), width(width), x0(x0), y0(y0), x1(x1), y1(y1),
+      nPasses(passes) {
+  ping.resize((size_t)(x1 - x0) * (y1 - y0));
+  pong.resize(ping.size());
+  for (int y = y0; y < y1; ++y)
+    for (int x = x0; x < x1; ++x) {
+      const unsigned char *pixel = rgb + (x + y * width) * 3;
+      at(ping, x, y) =
+          glm::vec3(pixel[0] / 255.0f, pixel[1] / 255.0f, pixel[2] / 255.0f);
+    }
+}
+
+void Denoiser::filterRow(int pass, int y) {
+  std::vector<glm::vec3> &src = pass % 2 ? pong : ping;
+  std::vector<glm::vec3> &dst = pass % 2 ? ping : pong;
+  const int step = 1 << pass;
+  const float colorScale = float(1 << (2 * pass)) / COLOR_SIGMA2;
+
+  for (int x = x0; x < x1; ++x) {
+    const glm::vec3 &cp = at(src, x, y);
+    const float *ap = aux + (x + y * width) * AUX_CHANNELS;
+    glm::vec3 sum(0.0f);
+    float weights = 0.0f;
+    for (int dy = -2; dy <= 2; ++dy) {
+      int qy = y + dy * step;
+      if (qy < y0 || qy >= y1)
+        continue;
+      for (int dx = -2; dx <= 2; ++dx) {
+        int qx = x + dx * step;
+        if (qx < x0 || qx >= x1)
+          continue;
+        const glm::vec3 &cq = at(src, qx, qy);
+        const float *aq = aux + (qx + qy * width) * AUX_CHANNELS;
+        float w = KERNEL[std::abs(dx)] * KERNEL[std::abs(dy)] *
+                  guideWeight(ap, aq, step) *
+                  std::exp(-distance2(cp, cq) * colorScale);
+        sum += cq * w;
+        weights += w;
+      }
+    }
+    // The center tap always has weight, so weights > 0
+    glm::vec3 c = sum / weights;
+    at(dst, x, y) = c;
+
+    if (pass == nPasses - 1) {
+      unsigned char *pixel = rgb + (x + y * width) * 3;
+      for (int k = 0; k < 3; ++k)
+        pixel[k] =
+            (unsigned char)(255.0f * std::clamp(c[k], 0.0f, 1.0f) + 0.5f);
+    }
+  }
+}
@@ -0,0 +1,65 @@
+//
+// denoiser.h
+//
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010) for cleaning
+// up images rendered with few samples. Each pass blurs with a 5x5 B3-spline
+// kernel whose taps are spread twice as far apart as the last pass's, so a
+// handful of passes cover a wide footprint cheaply. Taps are weighted down
+// where the color, or the normal, depth or albedo of the surface seen by
+// the pixel, differs from the center, so the blur stays inside surfaces
+// and doesn't cross geometric or texture edges.
+//
+
+#ifndef __DENOISER_H__
+#define __DENOISER_H__
+
+#include <vector>
+
+#include <glm/vec3.hpp>
+
+/*
+ * What the camera ray of a pixel hit, as recorded by RayTracer while
+ * denoising is on. An aux buffer holds AUX_CHANNELS floats per pixel, rows
+ * bottom-up like the image buffer. Pixels whose camera ray missed
+ * everything have a depth of 0.
+ */
+enum AuxChannel {
+  AUX_NX, AUX_NY, AUX_NZ, // unit surface normal
+  AUX_DEPTH,              // distance along the camera ray
+  AUX_R, AUX_G, AUX_B,    // diffuse color
+  AUX_CHANNELS
+};
+
+class Denoiser {
+public:
+  // Filter columns [x0, x1) of rows [y0, y1) of an rgb image `width`
+  // pixels wide, in place, guided by its aux buffer.
+  Denoiser(unsigned char *rgb, const float *aux, int width, int x0, int y0,
+           int x1, int y1, int passes);
+
+  int passes() const { return nPasses; }
+
+  // How far outside a pixel `passes` passes read, in rows or columns.
+  // Pixels at least this far inside the filtered region come out the same
+  // as if the whole image had been filtered.
+  static int reach(int passes) { return 2 * ((1 << passes) - 1); }
+
+  // Filter row y for pass `pass`. The rows of a pass can be filtered in
+  // parallel, but every row of a pass must be done before the next pass
+  // starts. The last pass writes the result back to the image.
+  void filterRow(int pass, int y);
+
+private:
+  glm::vec3 &at(std::vector<glm::vec3> &c, int x, int y) {
+    return c[(x - x0) + (y - y0) * (x1 - x0)];
+  }
+
+  unsigned char *rgb;
+  const float *aux;
+  int width;
+  int x0, y0, x1, y1;
+  int nPasses;
+  std::vector<glm::vec3> ping, pong; // passes alternate between these
+};
+
+#endif // __DENOISER_H__
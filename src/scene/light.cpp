@@ -1,12 +1,55 @@
 #include <cmath>
 #include <iostream>
+#include <limits>
+#include <stdint.h>
 
 #include "light.h"
+#include "sampler.h"
 #include <glm/glm.hpp>
 #include <glm/gtx/extended_min_max.hpp>
 #include <glm/gtx/io.hpp>
 
 using namespace std;
+extern TraceUI *traceUI;
+
+namespace {
+// Direct mapped by light; a collision just costs a cache miss.
+struct OccluderSlot {
+  const Light *light = nullptr;
+  uint32_t prim = 0;
+};
+const size_t OCCLUDER_SLOTS = 64;
+thread_local OccluderSlot occluders[OCCLUDER_SLOTS];
+
+OccluderSlot &occluderSlot(const Light *light) {
+  return occluders[((uintptr_t)light / sizeof(void *)) % OCCLUDER_SLOTS];
+}
+
+// Area light samples that differ by less than this count as agreeing
+const double PENUMBRA_EPSILON = 1e-3;
+} // namespace
+
+bool Light::occluderCached(ray &r, double maxT) const {
+  if (!traceUI->occluderCacheSwitch())
+    return false;
+  const OccluderSlot &slot = occluderSlot(this);
+  bool hit = false;
+  if (slot.light == this) {
+    isect i;
+    hit = scene->intersectPrimitive(slot.prim, r, i) &&
+          i.getT() < maxT && !i.getMaterial().Trans();
+  }
+  TraceUI::addOccluderLookup(ray_thread_id, hit);
+  return hit;
+}
+
+void Light::cacheOccluder(uint32_t prim) const {
+  if (!traceUI->occluderCacheSwitch())
+    return;
+  OccluderSlot &slot = occluderSlot(this);
+  slot.light = this;
+  slot.prim = prim;
+}
 
 double DirectionalLight::distanceAttenuation(const glm::dvec3 &) const {
   // distance to light is infinite, so f(di) goes to 0.  Return 1.
@@ -19,13 +62,18 @@ glm::dvec3 DirectionalLight::shadowAttenuation(const ray &r,
   // You should implement shadow-handling code here.
   isect i;
   ray r_new(r);
-  if (!scene->intersect(r_new, i)) {
+  if (occluderCached(r_new, std::numeric_limits<double>::infinity()))
+    return glm::dvec3(0);
+
+  uint32_t prim;
+  if (!scene->intersect(r_new, i, prim)) {
     return {1, 1, 1};
   }
 
   const Material &m = i.getMaterial();
 
   if (!m.Trans()) {
+    cacheOccluder(prim);
     return glm::dvec3(0);
   }
 
@@ -89,12 +137,16 @@ glm::dvec3 PointLight::shadowAttenuation(const ray &r,
 
   isect i;
   ray r_new(r);
-  if (!scene->intersect(r_new, i)) {
+  double lightDist = glm::distance(p, position);
+  if (occluderCached(r_new, lightDist))
+    return glm::dvec3(0);
+
+  uint32_t prim;
+  if (!scene->intersect(r_new, i, prim)) {
     return glm::dvec3(1, 1, 1);
   }
 
   // object is behind light
-  double lightDist = glm::distance(p, position);
   if (i.getT() >= lightDist) {
     return glm::dvec3(1);
   }
@@ -102,6 +154,7 @@ glm::dvec3 PointLight::shadowAttenuation(const ray &r,
   const Material &m = i.getMaterial();
 
   if (!m.Trans()) {
+    cacheOccluder(prim);
     return glm::dvec3(0);
   }
 
@@ -128,3 +181,134 @@ glm::dvec3 PointLight::shadowAttenuation(const ray &r,
 
 #define VERBOSE 0
 
+double AreaLight::distanceAttenuation(const glm::dvec3 &P) const {
+  const auto dist = glm::distance(position, P);
+  const auto denom = constantTerm + linearTerm * dist + quadraticTerm * dist * dist;
+  return glm::min(1.0, 1/denom);
+}
+
+glm::dvec3 AreaLight::getColor() const { return color; }
+
+glm::dvec3 AreaLight::getDirection(const glm::dvec3 &P) const {
+  return glm::normalize(position - P);
+}
+
+// The light is split into n x n cells, in four quadrants. A few probes go
+// in a random cell of different quadrants first, opposite corners of the
+// light to begin with, so a point that is fully lit or fully shadowed
+// costs little more than one ray. Only if the probes disagree, so p is in
+// the penumbra, is every other cell sampled as well.
+glm::dvec3 AreaLight::shadowAttenuation(const ray &,
+                                        const glm::dvec3 &p) const {
+  static const int QUADRANTS[4] = {0, 3, 1, 2}; // in the order probed
+  int n = std::max(2, (int)std::sqrt((double)traceUI->getAreaLightSamples()));
+  n += n % 2;
+  const int half = n / 2;
+  const int probes = std::clamp(traceUI->getAreaLightProbes(), 2, 4);
+
+  auto sampleCell = [&](int cx, int cy) {
+    glm::dvec2 u = sample2D();
+    return visibility(p, samplePoint((cx + u[0]) / n, (cy + u[1]) / n));
+  };
+
+  int first[4];
+  glm::dvec3 sum(0.0), v0(0.0);
+  bool agree = true;
+  for (int k = 0; k < probes; ++k) {
+    int q = QUADRANTS[k];
+    glm::dvec2 u = sample2D();
+    int cx = (q & 1) * half + std::min((int)(u[0] * half), half - 1);
+    int cy = (q >> 1) * half + std::min((int)(u[1] * half), half - 1);
+    first[k] = cy * n + cx;
+    glm::dvec3 v = sampleCell(cx, cy);
+    if (k == 0)
+      v0 = v;
+    else if (glm::length(v - v0) > PENUMBRA_EPSILON)
+      agree = false;
+    sum += v;
+  }
+  if (agree)
+    return sum / double(probes);
+
+  for (int cell = 0; cell < n * n; ++cell) {
+    if (std::find(first, first + probes, cell) != first + probes)
+      continue;
+    sum += sampleCell(cell % n, cell / n);
+  }
+  return sum / double(n * n);
+}
+
+// Follows the same rules as PointLight::shadowAttenuation(): opaque
+// objects block the light, transparent ones let kt through per unit of
+// distance inside them.
+glm::dvec3 AreaLight::visibility(const glm::dvec3 &p,
+                                 const glm::dvec3 &target) const {
+  glm::dvec3 atten(1.0);
+  glm::dvec3 origin = p;
+  for (;;) {
+    glm::dvec3 d = target - origin;
+    double dist = glm::length(d);
+    if (dist <= RAY_EPSILON)
+      return atten;
+    d /= dist;
+
+    ray r(origin + RAY_EPSILON * d, d, glm::dvec3(1.0), ray::SHADOW);
+    if (occluderCached(r, dist))
+      return glm::dvec3(0);
+    isect i;
+    uint32_t prim;
+    if (!scene->intersect(r, i, prim) || i.getT() >= dist)
+      return atten;
+
+    const Material &m = i.getMaterial();
+    if (!m.Trans()) {
+      cacheOccluder(prim);
+      return glm::dvec3(0);
+    }
+
+    auto kt = m.kt(i);
+    r.setPosition(r.at(i) + RAY_EPSILON * d);
+    if (!scene->intersect(r, i))
+      return atten;
+    atten *= glm::pow(kt, glm::dvec3(i.getT()));
+    if (atten.x < 1e-6 && atten.y < 1e-6 && atten.z < 1e-6)
+      return glm::dvec3(0.0);
+    origin = r.at(i) + RAY_EPSILON * d;
+  }
+}
+
+glm::dvec3 RectLight::samplePoint(double s, double t) const {
+  return position + (s - 0.5) * u + (t - 0.5) * v;
+}
+
+DiskLight::DiskLight(Scene *scene, const glm::dvec3 &center,
+                     const glm::dvec3 &n, double radius,
+                     const glm::dvec3 &color, float constantAttenuationTerm,
+                     float linearAttenuationTerm,
+                     float quadraticAttenuationTerm)
+    : AreaLight(scene, center, color, constantAttenuationTerm,
+                linearAttenuationTerm, quadraticAttenuationTerm),
+      normal(glm::normalize(n)), radius(radius) {
+  glm::dvec3 helper = std::abs(normal[0]) < 0.9 ? glm::dvec3(1.0, 0.0, 0.0)
+                                                : glm::dvec3(0.0, 1.0, 0.0);
+  tangent = glm::normalize(glm::cross(normal, helper));
+  bitangent = glm::cross(normal, tangent);
+}
+
+// Shirley and Chiu's concentric map from the square to the disk, which
+// keeps strata compact.
+glm::dvec3 DiskLight::samplePoint(double s, double t) const {
+  double a = 2.0 * s - 1.0, b = 2.0 * t - 1.0;
+  if (a == 0.0 && b == 0.0)
+    return position;
+  double r, phi;
+  if (std::abs(a) > std::abs(b)) {
+    r = a;
+    phi = (M_PI / 4.0) * (b / a);
+  } else {
+    r = b;
+    phi = M_PI / 2.0 - (M_PI / 4.0) * (a / b);
+  }
+  return position +
+         radius * r * (std::cos(phi) * tangent + std::sin(phi) * bitangent);
+}
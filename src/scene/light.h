@@ -9,7 +9,6 @@ using std::min;
 
 #include "../ui/TraceUI.h"
 #include "scene.h"
-#include <FL/gl.h>
 
 class Light : public SceneElement {
 public:
@@ -24,11 +23,13 @@ protected:
   Light(Scene *scene, const glm::dvec3 &col)
       : SceneElement(scene), color(col) {}
 
-  glm::dvec3 color;
+  // Each render thread remembers the opaque primitive that last blocked
+  // each light. Neighboring shading points are usually blocked by the same
+  // one, so it's tested before tracing the shadow ray through the scene.
+  bool occluderCached(ray &r, double maxT) const;
+  void cacheOccluder(uint32_t prim) const;
 
-public:
-  virtual void glDrawLight([[maybe_unused]] GLenum lightID) const {}
-  virtual void glDrawLight() const {}
+  glm::dvec3 color;
 };
 
 class DirectionalLight : public Light {
@@ -42,12 +43,10 @@ public:
   virtual glm::dvec3 getColor() const;
   virtual glm::dvec3 getDirection(const glm::dvec3 &P) const;
 
+  const glm::dvec3 &getOrientation() const { return orientation; }
+
 protected:
   glm::dvec3 orientation;
-
-public:
-  void glDrawLight(GLenum lightID) const;
-  void glDrawLight() const;
 };
 
 class PointLight : public Light {
@@ -71,6 +70,13 @@ public:
     linearTerm = b;
     quadraticTerm = c;
   }
+  void getAttenuationConstants(float &a, float &b, float &c) const {
+    a = constantTerm;
+    b = linearTerm;
+    c = quadraticTerm;
+  }
+
+  const glm::dvec3 &getPosition() const { return position; }
 
 protected:
   glm::dvec3 position;
@@ -81,12 +87,89 @@ protected:
   float constantTerm;  // a
   float linearTerm;    // b
   float quadraticTerm; // c
+};
+
+// A light with an area, which casts soft shadows. For direction and
+// falloff it's treated as a point at its center; the area only comes in
+// through shadowAttenuation(), which averages shadow rays to stratified
+// points on the light, starting from a couple of probes and adding more
+// only in the penumbra.
+class AreaLight : public Light {
+public:
+  virtual glm::dvec3 shadowAttenuation(const ray &r,
+                                       const glm::dvec3 &pos) const;
+  virtual double distanceAttenuation(const glm::dvec3 &P) const;
+  virtual glm::dvec3 getColor() const;
+  virtual glm::dvec3 getDirection(const glm::dvec3 &P) const;
+
+  // The point of the light for (s, t) in the unit square. Equal areas of
+  // the square map to equal areas of the light, so strata carry over.
+  virtual glm::dvec3 samplePoint(double s, double t) const = 0;
+
+  void getAttenuationConstants(float &a, float &b, float &c) const {
+    a = constantTerm;
+    b = linearTerm;
+    c = quadraticTerm;
+  }
 
+  const glm::dvec3 &getPosition() const { return position; }
+
+protected:
+  AreaLight(Scene *scene, const glm::dvec3 &center, const glm::dvec3 &color,
+            float constantAttenuationTerm, float linearAttenuationTerm,
+            float quadraticAttenuationTerm)
+      : Light(scene, color), position(center),
+        constantTerm(constantAttenuationTerm),
+        linearTerm(linearAttenuationTerm),
+        quadraticTerm(quadraticAttenuationTerm) {}
+
+  // Light from `target` that makes it to p through whatever is in between
+  glm::dvec3 visibility(const glm::dvec3 &p, const glm::dvec3 &target) const;
+
+  glm::dvec3 position; // center
+
+  // The same falloff terms as PointLight
+  float constantTerm;
+  float linearTerm;
+  float quadraticTerm;
+};
+
+// A parallelogram centered on the position, spanned by two edge vectors.
+class RectLight : public AreaLight {
 public:
-  void glDrawLight(GLenum lightID) const;
-  void glDrawLight() const;
+  RectLight(Scene *scene, const glm::dvec3 &center, const glm::dvec3 &u,
+            const glm::dvec3 &v, const glm::dvec3 &color,
+            float constantAttenuationTerm, float linearAttenuationTerm,
+            float quadraticAttenuationTerm)
+      : AreaLight(scene, center, color, constantAttenuationTerm,
+                  linearAttenuationTerm, quadraticAttenuationTerm),
+        u(u), v(v) {}
+
+  virtual glm::dvec3 samplePoint(double s, double t) const;
+
+  const glm::dvec3 &getU() const { return u; }
+  const glm::dvec3 &getV() const { return v; }
+
+protected:
+  glm::dvec3 u, v; // full edges
+};
+
+class DiskLight : public AreaLight {
+public:
+  DiskLight(Scene *scene, const glm::dvec3 &center, const glm::dvec3 &normal,
+            double radius, const glm::dvec3 &color,
+            float constantAttenuationTerm, float linearAttenuationTerm,
+            float quadraticAttenuationTerm);
+
+  virtual glm::dvec3 samplePoint(double s, double t) const;
+
+  const glm::dvec3 &getNormal() const { return normal; }
+  double getRadius() const { return radius; }
 
 protected:
+  glm::dvec3 normal;
+  glm::dvec3 tangent, bitangent; // span the disk
+  double radius;
 };
 
 #endif // __LIGHT_H__
@@ -0,0 +1,117 @@
+#include "lightTree.h"
+
+#include <algorithm>
+#include <limits>
+
+#include "light.h"
+
+namespace {
+const double INF = std::numeric_limits<double>::infinity();
+
+// Upper bound on PointLight::distanceAttenuation() for a light at least
+// `dist` away with terms no smaller than a, b and c.
+double falloffBound(double a, double b, double c, double dist) {
+  double denom = a + b * dist + c * dist * dist;
+  return denom <= 1.0 ? 1.0 : 1.0 / denom;
+}
+} // namespace
+
+LightTree::LightTree(const std::vector<Light *> &all) {
+  for (const Light *light : all) {
+    if (const PointLight *pl = dynamic_cast<const PointLight *>(light))
+      lights.push_back(pl);
+    else
+      unsampled.push_back(light);
+  }
+  if (!lights.empty()) {
+    nodes.reserve(2 * lights.size() - 1);
+    build(0, (uint32_t)lights.size());
+  }
+}
+
+uint32_t LightTree::build(uint32_t first, uint32_t count) {
+  uint32_t index = (uint32_t)nodes.size();
+  nodes.emplace_back();
+
+  Node node;
+  node.bmin = glm::dvec3(INF);
+  node.bmax = glm::dvec3(-INF);
+  node.power = node.maxColor = 0.0;
+  node.a = node.b = node.c = INF;
+  for (uint32_t k = first; k < first + count; ++k) {
+    const PointLight *light = lights[k];
+    node.bmin = glm::min(node.bmin, light->getPosition());
+    node.bmax = glm::max(node.bmax, light->getPosition());
+    glm::dvec3 col = light->getColor();
+    node.power += col[0] + col[1] + col[2];
+    node.maxColor =
+        std::max(node.maxColor, std::max(col[0], std::max(col[1], col[2])));
+    float a, b, c;
+    light->getAttenuationConstants(a, b, c);
+    node.a = std::min(node.a, (double)a);
+    node.b = std::min(node.b, (double)b);
+    node.c = std::min(node.c, (double)c);
+  }
+  node.right = 0;
+  node.light = first;
+
+  if (count > 1) {
+    // Split at the median of the widest axis
+    glm::dvec3 extent = node.bmax - node.bmin;
+    int axis = 0;
+    if (extent[1] > extent[axis])
+      axis = 1;
+    if (extent[2] > extent[axis])
+      axis = 2;
+    uint32_t half = count / 2;
+    std::nth_element(lights.begin() + first, lights.begin() + first + half,
+                     lights.begin() + first + count,
+                     [axis](const PointLight *l, const PointLight *r) {
+                       return l->getPosition()[axis] < r->getPosition()[axis];
+                     });
+    build(first, half);
+    node.right = build(first + half, count - half);
+  }
+
+  nodes[index] = node;
+  return index;
+}
+
+double LightTree::importance(const Node &node, const glm::dvec3 &p,
+                             double cutoff) const {
+  glm::dvec3 nearest = glm::clamp(p, node.bmin, node.bmax);
+  double falloff =
+      falloffBound(node.a, node.b, node.c, glm::distance(p, nearest));
+  if (node.maxColor * falloff < cutoff)
+    return 0.0;
+  return node.power * falloff;
+}
+
+const Light *LightTree::sample(const glm::dvec3 &p, double u, double cutoff,
+                               double &pdf) const {
+  pdf = 1.0;
+  if (nodes.empty() || importance(nodes[0], p, cutoff) <= 0.0)
+    return nullptr;
+
+  uint32_t n = 0;
+  while (nodes[n].right) {
+    double wl = importance(nodes[n + 1], p, cutoff);
+    double wr = importance(nodes[nodes[n].right], p, cutoff);
+    if (wl + wr <= 0.0)
+      return nullptr;
+
+    // Reuse what's left of u below the chosen branch
+    double pl = wl / (wl + wr);
+    if (u < pl) {
+      u /= pl;
+      pdf *= pl;
+      n = n + 1;
+    } else {
+      u = (u - pl) / (1.0 - pl);
+      pdf *= 1.0 - pl;
+      n = nodes[n].right;
+    }
+    u = std::min(u, 1.0 - std::numeric_limits<double>::epsilon());
+  }
+  return lights[nodes[n].light];
+}
@@ -0,0 +1,63 @@
+//
+// lightTree.h
+//
+// A hierarchy over the scene's point lights for scenes with too many of
+// them to shadow test one by one. Each node knows the bounds of its lights,
+// their total power and the weakest falloff among them, which bounds how
+// much light the whole subtree can send to a point. Shading walks down
+// from the root picking a child in proportion to that bound, so a light is
+// chosen with a known probability and its contribution can be weighted to
+// keep the estimate unbiased.
+//
+
+#ifndef __LIGHTTREE_H__
+#define __LIGHTTREE_H__
+
+#include <stdint.h>
+#include <vector>
+
+#include <glm/vec3.hpp>
+
+class Light;
+class PointLight;
+
+class LightTree {
+public:
+  // Point lights go in the tree; everything else (directional lights) is
+  // kept aside to be evaluated at every shading point.
+  explicit LightTree(const std::vector<Light *> &lights);
+
+  const std::vector<const Light *> &getUnsampledLights() const {
+    return unsampled;
+  }
+  size_t lightCount() const { return lights.size(); }
+
+  // Pick a light to shade p with, using u in [0, 1). pdf is the
+  // probability of the pick. Subtrees that can't light p brighter than
+  // `cutoff` in any channel are never picked; returns nullptr if that
+  // leaves nothing.
+  const Light *sample(const glm::dvec3 &p, double u, double cutoff,
+                      double &pdf) const;
+
+private:
+  // Stored depth first like the BVH: an inner node's left child follows
+  // it and `right` is the index of the other one. Leaves hold one light.
+  struct Node {
+    glm::dvec3 bmin, bmax;
+    double power;    // sum of the lights' color channels
+    double maxColor; // brightest channel of any light
+    double a, b, c;  // smallest attenuation terms among the lights
+    uint32_t right;  // 0 for leaves
+    uint32_t light;  // index into lights, for leaves
+  };
+
+  uint32_t build(uint32_t first, uint32_t count);
+  double importance(const Node &node, const glm::dvec3 &p,
+                    double cutoff) const;
+
+  std::vector<const PointLight *> lights;
+  std::vector<const Light *> unsampled;
+  std::vector<Node> nodes;
+};
+
+#endif // __LIGHTTREE_H__
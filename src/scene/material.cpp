@@ -1,7 +1,10 @@
 #include "material.h"
+#include "../fileio/timeline.h"
 #include "../ui/TraceUI.h"
 #include "light.h"
+#include "lightTree.h"
 #include "ray.h"
+#include "sampler.h"
 extern TraceUI *traceUI;
 
 #include "../fileio/images.h"
@@ -13,6 +16,49 @@ extern bool debugMode;
 
 Material::~Material() {}
 
+namespace {
+void hashCombine(size_t &seed, size_t v) {
+  seed ^= v + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2);
+}
+} // namespace
+
+size_t MaterialParameter::hash() const {
+  size_t h = std::hash<const void *>()(_textureMap);
+  for (int k = 0; k < 3; ++k)
+    hashCombine(h, std::hash<double>()(_value[k]));
+  return h;
+}
+
+bool Material::operator==(const Material &rhs) const {
+  return _ke == rhs._ke && _ka == rhs._ka && _ks == rhs._ks &&
+         _kd == rhs._kd && _kr == rhs._kr && _kt == rhs._kt &&
+         _shininess == rhs._shininess && _index == rhs._index;
+}
+
+size_t Material::hash() const {
+  size_t h = _ke.hash();
+  for (const MaterialParameter *p :
+       {&_ka, &_ks, &_kd, &_kr, &_kt, &_shininess, &_index})
+    hashCombine(h, p->hash());
+  return h;
+}
+
+glm::dvec3 Material::kd(const isect &i) const {
+  return i.hasVertexColor() ? i.getVertexColor() : _kd.value(i);
+}
+
+uint32_t MaterialTable::add(const Material &m) {
+  size_t h = m.hash();
+  auto range = byHash.equal_range(h);
+  for (auto it = range.first; it != range.second; ++it)
+    if (materials[it->second] == m)
+      return it->second;
+  uint32_t index = (uint32_t)materials.size();
+  materials.push_back(m);
+  byHash.emplace(h, index);
+  return index;
+}
+
 // Apply the phong model to this point on the surface of the object, returning
 // the color of that point.
 glm::dvec3 Material::shade(Scene *scene, const ray &r, const isect &i) const {
@@ -50,27 +96,48 @@ glm::dvec3 Material::shade(Scene *scene, const ray &r, const isect &i) const {
   glm::dvec3 n = glm::normalize(i.getN());
   if (glm::dot(n, glm::normalize(r.getDirection())) > 0.0) n = -n;
 
-  for ( const auto& pLight : scene->getAllLights() )
-  {
-    auto L = pLight->getDirection(p); // to light
-    auto distAtten = pLight->distanceAttenuation(p);
+  auto illuminate = [&](const Light &light) {
+    auto L = light.getDirection(p); // to light
+    auto distAtten = light.distanceAttenuation(p);
     ray toLight(p + RAY_EPSILON * L, L, r.getAtten(), ray::SHADOW);
-    auto shadowAtten = pLight->shadowAttenuation(toLight, p);
-    auto I = pLight->getColor() * distAtten * shadowAtten;
+    auto shadowAtten = light.shadowAttenuation(toLight, p);
+    auto I = light.getColor() * distAtten * shadowAtten;
 
     // Diffuse
-    color += kd(i) * std::max(0.0, glm::dot(n, L)) * I;
+    glm::dvec3 c = kd(i) * std::max(0.0, glm::dot(n, L)) * I;
 
     // Spectral
     glm::dvec3 v_vec = glm::normalize(-r.getDirection());
     glm::dvec3 r_vec = glm::normalize(2 * glm::dot(n, L) * n - L);
-    color += ks(i) * std::pow(std::max(0.0, glm::dot(v_vec, r_vec)), i.getMaterial().shininess(i)) * I;
+    c += ks(i) * std::pow(std::max(0.0, glm::dot(v_vec, r_vec)), i.getMaterial().shininess(i)) * I;
+    return c;
+  };
+
+  const LightTree *tree = scene->getLightTree();
+  if (!tree) {
+    for ( const auto& pLight : scene->getAllLights() )
+      color += illuminate(*pLight);
+    return color;
+  }
+
+  // Many-light mode: a few point lights picked by the light tree, each
+  // divided by the chance of picking it so the sum stays unbiased.
+  for (const Light *light : tree->getUnsampledLights())
+    color += illuminate(*light);
+  int samples = traceUI->getLightSamples();
+  double cutoff = traceUI->getLightCutoff();
+  for (int s = 0; s < samples; ++s) {
+    double pdf;
+    const Light *light = tree->sample(p, sample1D(), cutoff, pdf);
+    if (light)
+      color += illuminate(*light) / (pdf * samples);
   }
 
   return color;
 }
 
 TextureMap::TextureMap(string filename) {
+  TimelineScope t("decode texture", "load", filename);
   data = readImage(filename.c_str(), width, height);
   if (data.empty()) {
     width = 0;
@@ -12,6 +12,7 @@
 #include <glm/vec3.hpp>
 #include <stdint.h>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 class Scene;
@@ -133,6 +134,11 @@ public:
   // mapped; use this to determine if we need to somehow renormalize.
   bool mapped() const { return _textureMap != 0; }
 
+  bool operator==(const MaterialParameter &rhs) const {
+    return _value == rhs._value && _textureMap == rhs._textureMap;
+  }
+  size_t hash() const;
+
 private:
   glm::dvec3 _value;
   TextureMap *_textureMap;
@@ -171,7 +177,12 @@ public:
     return *this;
   }
 
-  friend Material operator*(double d, Material m);
+  friend Material operator*(double d, const Material &m);
+
+  // Materials are equal if all their parameters are; the table below uses
+  // this to store each distinct material once.
+  bool operator==(const Material &rhs) const;
+  size_t hash() const;
 
   // Accessor functions; we pass in an isect& for cases where the parameter is
   // dependent on, for example, world-space coordinates (i.e., solid textures)
@@ -179,7 +190,7 @@ public:
   glm::dvec3 ke(const isect &i) const { return _ke.value(i); }
   glm::dvec3 ka(const isect &i) const { return _ka.value(i); }
   glm::dvec3 ks(const isect &i) const { return _ks.value(i); }
-  glm::dvec3 kd(const isect &i) const { return _kd.value(i); }
+  glm::dvec3 kd(const isect &i) const; // honors per-vertex colors
   glm::dvec3 kr(const isect &i) const { return _kr.value(i); }
   glm::dvec3 kt(const isect &i) const { return _kt.value(i); }
   double shininess(const isect &i) const {
@@ -262,7 +273,8 @@ private:
 };
 
 // This doesn't necessarily make sense for mapped materials
-inline Material operator*(double d, Material m) {
+inline Material operator*(double d, const Material &mat) {
+  Material m = mat;
   m._ke *= d;
   m._ka *= d;
   m._ks *= d;
@@ -274,4 +286,23 @@ inline Material operator*(double d, Material m) {
   return m;
 }
 
+/*
+The materials of a scene. Objects and intersections refer to their material
+by a 32-bit index into this table, and identical materials are stored only
+once, so a scene with many objects sharing a few materials keeps only a few
+Materials around. References into the table stay valid until the next add().
+*/
+class MaterialTable {
+public:
+  // Index of a material equal to m, adding it if there's none yet
+  uint32_t add(const Material &m);
+
+  const Material &operator[](uint32_t index) const { return materials[index]; }
+  size_t size() const { return materials.size(); }
+
+private:
+  std::vector<Material> materials;
+  std::unordered_multimap<size_t, uint32_t> byHash;
+};
+
 #endif // __MATERIAL_H__
@@ -5,17 +5,21 @@
 
 
 const Material &isect::getMaterial() const {
-  return material ? *material : obj->getMaterial();
+  return obj->getScene()->getMaterial(material);
 }
 
 ray::ray(const glm::dvec3 &pp, const glm::dvec3 &dd, const glm::dvec3 &w,
          RayType tt, double c_ior)
     : p(pp), d(dd), atten(w), t(tt), curr_ior((c_ior)) {
   TraceUI::addRay(ray_thread_id);
+  if (ray_cost)
+    ray_cost->rays++;
 }
 
 ray::ray(const ray &other) : p(other.p), d(other.d), atten(other.atten) {
   TraceUI::addRay(ray_thread_id);
+  if (ray_cost)
+    ray_cost->rays++;
 }
 
 ray::~ray() {}
@@ -30,4 +34,5 @@ ray &ray::operator=(const ray &other) {
 
 glm::dvec3 ray::at(const isect &i) const { return at(i.getT()); }
 
-thread_local unsigned int ray_thread_id = 0;
+thread_local unsigned int ray_thread_id = RAY_THREAD_NONE;
+thread_local RayCost *ray_cost = nullptr;
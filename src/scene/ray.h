@@ -19,10 +19,26 @@ class SceneObject;
 class isect;
 
 /*
- * ray_thread_id: a thread local variable for statistical purpose.
+ * ray_thread_id: a thread local variable for statistical purpose. Render
+ * workers set it to their pool slot; every other thread (such as the UI
+ * thread tracing a debug ray) keeps RAY_THREAD_NONE, which the ray counters
+ * skip and the ray log gives a ring of its own.
  */
+const unsigned int RAY_THREAD_NONE = ~0u;
 extern thread_local unsigned int ray_thread_id;
 
+/*
+ * ray_cost: work done so far for the pixel this thread is tracing. It is
+ * only set while a cost map is recorded (see RayTracer::setCostMap()), so
+ * otherwise counting costs one null check.
+ */
+struct RayCost {
+  unsigned long long rays = 0;      // rays constructed
+  unsigned long long primTests = 0; // intersectLocal() calls and triangles
+  unsigned long long boxTests = 0;  // bounding box tests
+};
+extern thread_local RayCost *ray_cost;
+
 // A ray has a position where the ray starts, and a direction (which should
 // always be normalized!)
 
@@ -62,16 +78,7 @@ private:
 
 class isect {
 public:
-  isect()
-      : obj(NULL), t(0.0), N(), uvCoordinates(), bary(), material(nullptr) {}
-  isect(const isect &other) { copyFromOther(other); }
-
-  ~isect() {}
-
-  isect &operator=(const isect &other) {
-    copyFromOther(other);
-    return *this;
-  }
+  isect() : obj(NULL), t(0.0), N(), uvCoordinates(), bary() {}
 
   void setObject(const SceneObject *o) { obj = o; }
 
@@ -82,12 +89,9 @@ public:
   void setN(const glm::dvec3 &n) { N = n; }
   glm::dvec3 getN() const { return N; }
 
-  void setMaterial(const Material &m) {
-    if (material)
-      *material = m;
-    else
-      material.reset(new Material(m));
-  }
+  // Index of the hit's material in the scene's MaterialTable
+  void setMaterial(uint32_t index) { material = index; }
+  uint32_t getMaterialIndex() const { return material; }
   void setUVCoordinates(const glm::dvec2 &coords) { uvCoordinates = coords; }
   glm::dvec2 getUVCoordinates() const { return uvCoordinates; }
   void setBary(const glm::dvec3 &weights) { bary = weights; }
@@ -96,31 +100,25 @@ public:
   }
   const Material &getMaterial() const;
 
-private:
-  void copyFromOther(const isect &other) {
-    if (this == &other)
-      return;
-    obj = other.obj;
-    t = other.t;
-    N = other.N;
-    bary = other.bary;
-    uvCoordinates = other.uvCoordinates;
-    if (other.material) {
-      setMaterial(*other.material);
-    } else {
-      material.reset();
-    }
+  // Interpolated per-vertex color, which takes the place of the material's
+  // diffuse color (see Material::kd()).
+  void setVertexColor(const glm::dvec3 &color) {
+    vertexColor = color;
+    vertexColored = true;
   }
+  bool hasVertexColor() const { return vertexColored; }
+  glm::dvec3 getVertexColor() const { return vertexColor; }
 
+private:
   const SceneObject *obj;
   double t;
   glm::dvec3 N;
   glm::dvec2 uvCoordinates;
   glm::dvec3 bary;
 
-  // if this intersection has its own material (as opposed to one in its
-  // associated object) as in the case where the material was interpolated
-  std::unique_ptr<Material> material;
+  uint32_t material = 0;
+  bool vertexColored = false;
+  glm::dvec3 vertexColor;
 };
 
 const double RAY_EPSILON = 0.00000001;
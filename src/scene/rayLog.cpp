@@ -0,0 +1,86 @@
+#include "rayLog.h"
+
+#include <algorithm>
+
+#include "../ui/TraceUI.h"
+
+thread_local glm::ivec2 ray_pixel(-1, -1);
+
+namespace {
+// One ring per pool slot, plus a last one for threads outside the pool.
+// Only the UI thread traces outside the pool, so every ring keeps a single
+// writer.
+const int RINGS = MAX_THREADS + 1;
+
+unsigned int ringOf(unsigned int thread) {
+  return std::min(thread, (unsigned int)MAX_THREADS);
+}
+} // namespace
+
+RayLog::RayLog() : rings(new Ring[RINGS]) {}
+
+RayLog::~RayLog() {}
+
+void RayLog::start(const RayLogFilter &f, size_t cap) {
+  filter = f;
+  filter.stride = std::max(filter.stride, 1);
+  if (cap != capacity) {
+    capacity = std::max(cap, (size_t)1);
+    for (int k = 0; k < RINGS; ++k)
+      rings[k].records.reset();
+  }
+  for (int k = 0; k < RINGS; ++k)
+    rings[k].written = 0;
+  on.store(true, std::memory_order_relaxed);
+}
+
+void RayLog::record(const ray &r, const isect &i, bool hit) {
+  if (!filter.accepts(ray_pixel))
+    return;
+  unsigned int k = ringOf(ray_thread_id);
+  Ring &ring = rings[k];
+  if (!ring.records)
+    ring.records.reset(new RayRecord[capacity]);
+
+  // Only this thread writes the ring; publishing the count after the
+  // record is filled lets snapshot() tell which records are complete.
+  uint64_t n = ring.written.load(std::memory_order_relaxed);
+  RayRecord &rec = ring.records[n % capacity];
+  rec.position = r.getPosition();
+  rec.direction = r.getDirection();
+  rec.normal = i.getN();
+  rec.t = i.getT();
+  rec.pixelX = ray_pixel[0];
+  rec.pixelY = ray_pixel[1];
+  rec.type = (uint8_t)r.type();
+  rec.hit = hit;
+  rec.thread = (uint16_t)k;
+  ring.written.store(n + 1, std::memory_order_release);
+}
+
+void RayLog::clearThread() {
+  rings[ringOf(ray_thread_id)].written.store(0, std::memory_order_release);
+}
+
+std::vector<RayRecord> RayLog::snapshot() const {
+  std::vector<RayRecord> out;
+  for (int k = 0; k < RINGS; ++k) {
+    const Ring &ring = rings[k];
+    uint64_t end = ring.written.load(std::memory_order_acquire);
+    if (end == 0 || !ring.records)
+      continue;
+    uint64_t begin = end > capacity ? end - capacity : 0;
+    size_t first = out.size();
+    for (uint64_t n = begin; n < end; ++n)
+      out.push_back(ring.records[n % capacity]);
+
+    // The writer may have lapped the oldest records while they were
+    // copied; its next write goes over record `now - capacity`.
+    uint64_t now = ring.written.load(std::memory_order_acquire);
+    if (now + 1 > begin + capacity) {
+      uint64_t stale = std::min(now + 1 - capacity - begin, end - begin);
+      out.erase(out.begin() + first, out.begin() + first + stale);
+    }
+  }
+  return out;
+}
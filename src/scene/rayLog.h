@@ -0,0 +1,90 @@
+//
+// rayLog.h
+//
+// A record of recent intersection queries, for the debugging view and for
+// diagnostics on production renders. Each thread writes its own fixed-size
+// ring of plain records, so logging takes no locks and never allocates
+// after a thread's first record, and only the newest records are kept.
+// A filter picks which pixels are logged, so sparse sampling can stay on
+// for big renders.
+//
+
+#ifndef __RAYLOG_H__
+#define __RAYLOG_H__
+
+#include <atomic>
+#include <climits>
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+
+#include "ray.h"
+
+// The pixel the current thread is tracing, or (-1, -1) outside of one
+extern thread_local glm::ivec2 ray_pixel;
+
+// One intersection query. If it missed, t and normal are meaningless.
+struct RayRecord {
+  glm::dvec3 position;
+  glm::dvec3 direction;
+  glm::dvec3 normal;
+  double t;
+  int32_t pixelX, pixelY;
+  uint8_t type; // ray::RayType
+  uint8_t hit;
+  uint16_t thread;
+};
+
+// Which pixels to log: those in [x0, x1) x [y0, y1) whose coordinates are
+// both multiples of `stride`.
+struct RayLogFilter {
+  int x0 = 0, y0 = 0;
+  int x1 = INT_MAX, y1 = INT_MAX;
+  int stride = 1;
+
+  bool accepts(const glm::ivec2 &p) const {
+    return p[0] >= x0 && p[0] < x1 && p[1] >= y0 && p[1] < y1 &&
+           p[0] % stride == 0 && p[1] % stride == 0;
+  }
+};
+
+class RayLog {
+public:
+  static const size_t DEFAULT_CAPACITY = 4096;
+
+  RayLog();
+  ~RayLog();
+
+  // Log the pixels `filter` accepts, keeping the newest `capacity` records
+  // per thread. Not to be called while tracing.
+  void start(const RayLogFilter &filter, size_t capacity = DEFAULT_CAPACITY);
+  void stop() { on.store(false, std::memory_order_relaxed); }
+  // Read on every intersection query, from any thread
+  bool isOn() const { return on.load(std::memory_order_relaxed); }
+
+  // Log a query made by the current thread, if its pixel passes the filter
+  void record(const ray &r, const isect &i, bool hit);
+
+  // Forget what the current thread has logged
+  void clearThread();
+
+  // Everything logged, oldest first within each thread. Safe to call while
+  // tracing; records being overwritten as it runs are left out.
+  std::vector<RayRecord> snapshot() const;
+
+private:
+  struct alignas(64) Ring {
+    std::unique_ptr<RayRecord[]> records; // allocated by its own thread
+    std::atomic<uint64_t> written{0};
+  };
+
+  std::unique_ptr<Ring[]> rings; // one per thread slot, one for the rest
+  size_t capacity = DEFAULT_CAPACITY;
+  RayLogFilter filter;
+  std::atomic<bool> on{false};
+};
+
+#endif // __RAYLOG_H__
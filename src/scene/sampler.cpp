@@ -0,0 +1,105 @@
+#include "sampler.h"
+
+#include <random>
+
+#include "ray.h"
+
+thread_local Sampler *ray_sampler = nullptr;
+
+namespace {
+const double INV_2_32 = 1.0 / 4294967296.0;
+
+uint32_t reverseBits(uint32_t x) {
+  x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+  x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+  x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+  x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+  return (x >> 16) | (x << 16);
+}
+
+uint32_t hash(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7feb352du;
+  x ^= x >> 15;
+  x *= 0x846ca68bu;
+  x ^= x >> 16;
+  return x;
+}
+
+uint32_t hashCombine(uint32_t seed, uint32_t v) {
+  return hash(seed ^ (v + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+}
+
+// Owen scrambling of a bit-reversed 32 bit fraction, after Burley,
+// "Practical Hash-based Owen Scrambling" (JCGT 2020).
+uint32_t laineKarras(uint32_t x, uint32_t seed) {
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return x;
+}
+
+uint32_t owenScramble(uint32_t x, uint32_t seed) {
+  return reverseBits(laineKarras(reverseBits(x), seed));
+}
+
+// The first two dimensions of the Sobol sequence
+uint32_t sobol0(uint32_t index) { return reverseBits(index); }
+
+uint32_t sobol1(uint32_t index) {
+  uint32_t v = 1u << 31, result = 0;
+  for (; index; index >>= 1, v ^= v >> 1)
+    if (index & 1)
+      result ^= v;
+  return result;
+}
+
+std::mt19937 &threadRng() {
+  thread_local std::mt19937 rng(ray_thread_id + 1);
+  return rng;
+}
+} // namespace
+
+Sampler::Sampler(uint32_t seed, int x, int y)
+    : seed(hashCombine(hashCombine(hash(seed), (uint32_t)x), (uint32_t)y)) {}
+
+void Sampler::startSample(uint32_t i) {
+  index = i;
+  dimension = 0;
+}
+
+// Every dimension is the first or both of the first two Sobol dimensions
+// with its own scramble, and its own shuffle of the sample order so that
+// dimensions don't correlate with each other.
+glm::dvec2 Sampler::next2D() {
+  uint32_t dimSeed = hashCombine(seed, dimension++);
+  uint32_t i = owenScramble(index, hashCombine(dimSeed, 0));
+  uint32_t x = owenScramble(sobol0(i), hashCombine(dimSeed, 1));
+  uint32_t y = owenScramble(sobol1(i), hashCombine(dimSeed, 2));
+  return glm::dvec2(x * INV_2_32, y * INV_2_32);
+}
+
+double Sampler::next1D() { return next2D()[0]; }
+
+Sampler Sampler::fork(uint32_t branch) const {
+  Sampler s(*this);
+  s.seed = hashCombine(seed, 0x80000000u | branch);
+  s.dimension = 0;
+  return s;
+}
+
+double sample1D() {
+  if (ray_sampler)
+    return ray_sampler->next1D();
+  return std::uniform_real_distribution<double>(0.0, 1.0)(threadRng());
+}
+
+glm::dvec2 sample2D() {
+  if (ray_sampler)
+    return ray_sampler->next2D();
+  std::uniform_real_distribution<double> u(0.0, 1.0);
+  double x = u(threadRng());
+  return glm::dvec2(x, u(threadRng()));
+}
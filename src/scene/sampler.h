@@ -0,0 +1,60 @@
+//
+// sampler.h
+//
+// Random numbers for tracing that come out the same no matter how many
+// threads there are or which of them traces a pixel. Each pixel gets its
+// own Owen-scrambled Sobol sequence, seeded from the pixel's coordinates
+// and a global seed. Every consumer (antialiasing, light selection, area
+// light shadows) draws the next dimension of the current sample in turn,
+// so as long as a pixel is traced in the same order its numbers are
+// identical from run to run.
+//
+
+#ifndef __SAMPLER_H__
+#define __SAMPLER_H__
+
+#include <stdint.h>
+
+#include <glm/vec2.hpp>
+
+class Sampler {
+public:
+  Sampler() : Sampler(0, 0, 0) {}
+  Sampler(uint32_t seed, int x, int y);
+
+  // Start over at sample `index` of the pixel, from its first dimension
+  void startSample(uint32_t index);
+
+  // The next dimension, or the next two, of the current sample; in [0, 1)
+  double next1D();
+  glm::dvec2 next2D();
+
+  // An independent sequence for a ray that branches off this one, such as
+  // a reflection or refraction ray.
+  Sampler fork(uint32_t branch) const;
+
+private:
+  uint32_t seed;
+  uint32_t index = 0;
+  uint32_t dimension = 0;
+};
+
+// The sampler of the pixel the current thread is tracing, if any
+extern thread_local Sampler *ray_sampler;
+
+// Makes `s` the current thread's sampler while in scope.
+class SamplerScope {
+public:
+  explicit SamplerScope(Sampler &s) : prev(ray_sampler) { ray_sampler = &s; }
+  ~SamplerScope() { ray_sampler = prev; }
+
+private:
+  Sampler *prev;
+};
+
+// Uniform numbers in [0, 1) from the current sampler, or from a per-thread
+// generator outside of any pixel.
+double sample1D();
+glm::dvec2 sample2D();
+
+#endif // __SAMPLER_H__
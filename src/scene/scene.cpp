@@ -1,6 +1,10 @@
 #include <cmath>
 
+#include "../SceneObjects/trimesh.h"
+#include "../fileio/timeline.h"
 #include "../ui/TraceUI.h"
+#include "bvh.h"
+#include "lightTree.h"
 #include "kdTree.h"
 #include "light.h"
 #include "scene.h"
@@ -10,10 +14,22 @@
 
 using namespace std;
 
+namespace {
+// How much worse than a fresh build, by the surface area heuristic,
+// refits may leave the BVH before Scene::setTransform() rebuilds it.
+const double BVH_REBUILD_DEGRADATION = 1.5;
+} // namespace
+
 bool Geometry::intersect(ray &r, isect &i) const {
   double tmin, tmax;
-  if (hasBoundingBoxCapability() && !(bounds.intersect(r, tmin, tmax)))
-    return false;
+  if (hasBoundingBoxCapability()) {
+    if (ray_cost)
+      ray_cost->boxTests++;
+    if (!bounds.intersect(r, tmin, tmax))
+      return false;
+  }
+  if (ray_cost)
+    ray_cost->primTests++;
   // Transform the ray into the object's local coordinate space
   glm::dvec3 pos = transform.globalToLocalCoords(r.getPosition());
   glm::dvec3 dir =
@@ -93,46 +109,118 @@ void Geometry::ComputeBoundingBox() {
 
 Scene::Scene() { ambientIntensity = glm::dvec3(0, 0, 0); }
 
-Scene::~Scene() {
-  for (auto &obj : objects)
-    delete obj;
-  for (auto &light : lights)
-    delete light;
-}
+Scene::~Scene() {}
 
 void Scene::add(Geometry *obj) {
   obj->ComputeBoundingBox();
   sceneBounds.merge(obj->getBoundingBox());
   objects.emplace_back(obj);
+  bvh.reset();
 }
 
-void Scene::add(Light *light) { lights.emplace_back(light); }
+void Scene::add(Light *light) {
+  lights.emplace_back(light);
+  lightTree.reset();
+}
 
 
 // Get any intersection with an object.  Return information about the
 // intersection through the reference parameter.
 bool Scene::intersect(ray &r, isect &i) const {
-  double tmin = 0.0;
-  double tmax = 0.0;
+  uint32_t prim;
+  return intersect(r, i, prim);
+}
+
+bool Scene::intersect(ray &r, isect &i, uint32_t &prim) const {
   bool have_one = false;
-  for (const auto &obj : objects) {
-    isect cur;
-    if (obj->intersect(r, cur)) {
-      if (!have_one || (cur.getT() < i.getT())) {
-        i = cur;
-        have_one = true;
+  if (bvh) {
+    have_one = bvh->intersect(r, i, &prim);
+  } else {
+    for (size_t k = 0; k < objects.size(); ++k) {
+      isect cur;
+      if (objects[k]->intersect(r, cur)) {
+        if (!have_one || (cur.getT() < i.getT())) {
+          i = cur;
+          prim = (uint32_t)k;
+          have_one = true;
+        }
       }
     }
   }
   if (!have_one)
     i.setT(1000.0);
-  // if debugging,
-  if (TraceUI::m_debug) {
-    addToIntersectCache(std::make_pair(new ray(r), new isect(i)));
-  }
+  if (TraceUI::m_debug || rayLog.isOn())
+    rayLog.record(r, i, have_one);
   return have_one;
 }
 
+bool Scene::intersectPrimitive(uint32_t prim, ray &r, isect &i) const {
+  if (bvh)
+    return bvh->intersectPrimitive(prim, r, i);
+  return prim < objects.size() && objects[prim]->intersect(r, i);
+}
+
+unsigned Scene::intersect(ray *rays, int count, isect *hits) const {
+  if (!bvh) {
+    unsigned found = 0;
+    for (int k = 0; k < count; ++k)
+      if (intersect(rays[k], hits[k]))
+        found |= 1u << k;
+    return found;
+  }
+  unsigned found = bvh->intersect(rays, count, hits);
+  for (int k = 0; k < count; ++k) {
+    if (!(found & (1u << k)))
+      hits[k].setT(1000.0);
+    if (TraceUI::m_debug || rayLog.isOn())
+      rayLog.record(rays[k], hits[k], found & (1u << k));
+  }
+  return found;
+}
+
+void Scene::buildBVH(int leafSize, bool compressed) {
+  if (bvh && bvh->getLeafSize() == std::max(leafSize, 1) &&
+      bvh->isCompressed() == compressed)
+    return;
+  TimelineScope t("build BVH", "load");
+  bvh.reset(new BVH(objects, leafSize, compressed));
+}
+
+void Scene::clearBVH() { bvh.reset(); }
+
+void Scene::compressMeshes() {
+  TimelineScope t("compress meshes", "load");
+  for (Geometry *obj : objects) {
+    auto mesh = dynamic_cast<Trimesh *>(obj);
+    if (mesh && mesh->compress()) {
+      obj->ComputeBoundingBox();
+      sceneBounds.merge(obj->getBoundingBox());
+      bvh.reset();
+    }
+  }
+}
+
+void Scene::setTransform(Geometry *obj, const MatrixTransform &transform) {
+  obj->setTransform(transform);
+  obj->ComputeBoundingBox();
+  sceneBounds.merge(obj->getBoundingBox());
+  if (!bvh)
+    return;
+  if (!bvh->refit(obj) || bvh->degradation() > BVH_REBUILD_DEGRADATION) {
+    TimelineScope t("build BVH", "load");
+    bvh.reset(new BVH(objects, bvh->getLeafSize(), bvh->isCompressed()));
+  }
+}
+
+void Scene::buildLightTree() {
+  if (lightTree)
+    return;
+  TimelineScope t("build light tree", "load");
+  lightTree.reset(new LightTree(lights));
+}
+
+void Scene::clearLightTree() { lightTree.reset(); }
+
 TextureMap *Scene::getTexture(string name) {
   auto itr = textureCache.find(name);
   if (itr == textureCache.end()) {
@@ -12,14 +12,15 @@
 #include <algorithm>
 #include <map>
 #include <memory>
-#include <mutex>
 #include <string>
 #include <vector>
 
+#include "arena.h"
 #include "bbox.h"
 #include "camera.h"
 #include "material.h"
 #include "ray.h"
+#include "rayLog.h"
 
 #include <glm/geometric.hpp>
 #include <glm/mat3x3.hpp>
@@ -30,11 +31,11 @@
 
 using std::unique_ptr;
 
+class BVH;
+class LightTree;
 class Light;
 class Scene;
 
-template <typename Obj> class KdTree;
-
 // A SceneElement is anything that lives within a scene. The behavior is
 // intentionally very barebones, since all actual entities are descended
 // through a subclass that provides more functionality.
@@ -44,11 +45,6 @@ public:
 
   Scene *getScene() const { return scene; }
 
-  // For debugging purposes, draws using OpenGL
-  virtual void glDraw([[maybe_unused]] int quality,
-                      [[maybe_unused]] bool actualMaterials,
-                      [[maybe_unused]] bool actualTextures) const {}
-
 protected:
   SceneElement(Scene *s) : scene(s) {}
 
@@ -93,6 +89,8 @@ public:
   }
 
   const glm::dmat4x4 &transform() const { return xform; }
+  const glm::dmat4x4 &inverseTransform() const { return inverse; }
+  const glm::dmat3x3 &normalTransform() const { return normi; }
 };
 
 // A Geometry object is anything that has extent in three dimensions.
@@ -121,19 +119,10 @@ public:
   void setTransform(const MatrixTransform &transform) {
     this->transform = transform;
   };
+  const MatrixTransform &getTransform() const { return transform; }
 
   Geometry(Scene *scene) : SceneElement(scene) {}
 
-  // For debugging purposes, draws using OpenGL
-  void glDraw(int quality, bool actualMaterials, bool actualTextures) const;
-
-  // The default does nothing; this is here because it is not required
-  // that you implement this function if you create your own scene
-  // objects.
-  virtual void glDrawLocal([[maybe_unused]] int quality,
-                           [[maybe_unused]] bool actualMaterials,
-                           [[maybe_unused]] bool actualTextures) const {}
-
 protected:
   BoundingBox bounds;
   MatrixTransform transform;
@@ -144,14 +133,14 @@ protected:
 // (its material binding).
 class SceneObject : public Geometry {
 public:
-  const Material &getMaterial() const { return this->material; };
-  void setMaterial(Material *m) { this->material = *m; };
-
-  void glDraw(int quality, bool actualMaterials, bool actualTextures) const;
+  const Material &getMaterial() const;
+  uint32_t getMaterialIndex() const { return materialIndex; }
+  void setMaterial(const Material *m);
 
 protected:
-  SceneObject(Scene *scene, Material *mat) : Geometry(scene), material{*mat} {}
-  Material material;
+  SceneObject(Scene *scene, const Material *mat);
+  // into the scene's material table
+  uint32_t materialIndex;
 };
 
 class Scene {
@@ -164,15 +153,55 @@ public:
   Scene(Scene &&other) = delete;
   Scene &operator=(Scene &&other) = delete;
 
-  // There is a special assumption for add(): we assume that the object
-  // referred to by the pointer was created with new and will be managed
-  // by this Scene (i.e. nothing else will call delete on the pointer).
-  // Violation of this assumption may lead to double free or corruption
+  // Construct an object that lives as long as the scene in the scene's
+  // arena (see arena.h). Geometry and lights must be made this way before
+  // they're add()ed, and never deleted.
+  template <typename T, typename... Args> T *create(Args &&...args) {
+    return arena.create<T>(std::forward<Args>(args)...);
+  }
+
   void add(Geometry *obj);
   void add(Light *light);
 
   bool intersect(ray &r, isect &i) const;
 
+  // Like intersect(), also setting `prim` to an id for the primitive that
+  // was hit: a BVH primitive if there's a BVH, an object otherwise. Testing
+  // it again alone with intersectPrimitive() is cheap. Ids go stale when
+  // the BVH changes, but never refer to anything outside the scene.
+  bool intersect(ray &r, isect &i, uint32_t &prim) const;
+  bool intersectPrimitive(uint32_t prim, ray &r, isect &i) const;
+
+  // Intersect `count` rays at once (at most BVH::PACKET_SIZE). Returns a
+  // mask with bit k set if rays[k] hit something.
+  unsigned intersect(ray *rays, int count, isect *hits) const;
+
+  // Build the BVH over the objects added so far, with at most `leafSize`
+  // primitives per leaf, compressed if asked to; a no-op if it's current.
+  // Until it's built, after more objects are added, or after clearBVH(),
+  // intersect() tests every object in turn. Neither may be called while
+  // the scene is being traced.
+  void buildBVH(int leafSize, bool compressed = false);
+  void clearBVH();
+
+  // Switch every mesh to its compact vertex storage (see
+  // Trimesh::compress()). There's no going back; the BVH is dropped if
+  // anything changed.
+  void compressMeshes();
+
+  // Move an object that's already in the scene, for animation. The BVH is
+  // refit around it instead of rebuilt, unless refits have left it much
+  // worse than a fresh build or it's compressed. Not to be called while
+  // tracing either.
+  void setTransform(Geometry *obj, const MatrixTransform &transform);
+
+  // The light tree used to sample point lights when shading, if it has
+  // been built. Like the BVH it's dropped when lights are added.
+  void buildLightTree();
+  void clearLightTree();
+  const LightTree *getLightTree() const { return lightTree.get(); }
+  const BVH *getBVH() const { return bvh.get(); }
+
   auto beginLights() const { return lights.begin(); }
   auto endLights() const { return lights.end(); }
   const auto &getAllLights() const { return lights; }
@@ -195,7 +224,11 @@ public:
   glm::dvec3 ambient() const { return ambientIntensity; }
   void addAmbient(const glm::dvec3 &ambient) { ambientIntensity += ambient; }
 
-  void glDraw(int quality, bool actualMaterials, bool actualTextures) const;
+  // The scene's material table. addMaterial() returns the index of an
+  // existing equal material if there is one.
+  uint32_t addMaterial(const Material &m) { return materials.add(m); }
+  const Material &getMaterial(uint32_t index) const { return materials[index]; }
+  const MaterialTable &getMaterials() const { return materials; }
 
   const BoundingBox &bounds() const { return sceneBounds; }
 
@@ -211,6 +244,8 @@ private:
       If you need to search for something within objects or lights, use
       functions in <algorithms> like find() or count()
   */
+  // Owns the objects and lights; first so it's destroyed last
+  Arena arena;
   std::vector<Geometry *> objects;
   std::vector<Light *> lights;
   Camera camera;
@@ -219,6 +254,8 @@ private:
   // (used as the I_a in the Phong shading model)
   glm::dvec3 ambientIntensity;
 
+  MaterialTable materials;
+
   typedef std::map<std::string, std::unique_ptr<TextureMap>> tmap;
   tmap textureCache;
 
@@ -227,25 +264,26 @@ private:
   // hasBoundingBoxCapability() are exempt from this requirement.
   BoundingBox sceneBounds;
 
-  KdTree<Geometry> *kdtree;
+  std::unique_ptr<BVH> bvh;
+  std::unique_ptr<LightTree> lightTree;
 
-  mutable std::mutex intersectionCacheMutex;
+  mutable RayLog rayLog;
 
 public:
-  // This is used for debugging purposes only.
-  void addToIntersectCache(std::pair<ray *, isect *> isect) const {
-    intersectionCacheMutex.lock();
-    intersectCache.push_back(isect);
-    intersectionCacheMutex.unlock();
-  }
+  // Intersection queries are logged here while the debugging view is up
+  // or the log has been started.
+  RayLog &getRayLog() const { return rayLog; }
+};
 
-  void clearIntersectCache() const {
-    intersectionCacheMutex.lock();
-    intersectCache.clear();
-    intersectionCacheMutex.unlock();
-  }
+inline SceneObject::SceneObject(Scene *scene, const Material *mat)
+    : Geometry(scene), materialIndex(scene->addMaterial(*mat)) {}
 
-  mutable std::vector<std::pair<ray *, isect *>> intersectCache;
-};
+inline const Material &SceneObject::getMaterial() const {
+  return scene->getMaterial(materialIndex);
+}
+
+inline void SceneObject::setMaterial(const Material *m) {
+  materialIndex = scene->addMaterial(*m);
+}
 
 #endif // __SCENE_H__
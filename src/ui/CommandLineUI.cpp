@@ -1,6 +1,14 @@
+#include <algorithm>
+#include <chrono>
+#include <ctype.h>
+#include <fstream>
 #include <iostream>
+#include <memory>
 #include <stdarg.h>
+#include <stdio.h>
+#include <thread>
 #include <time.h>
+#include <vector>
 #ifndef _MSC_VER
 #include <unistd.h>
 #else
@@ -11,21 +19,96 @@ extern int getopt(int argc, char **argv, const char *optstring);
 
 #include <assert.h>
 
+#include "../fileio/costmap.h"
 #include "../fileio/images.h"
+#include "../fileio/timeline.h"
+#include "../parser/ParserException.h"
+#include "../scene/cameraPath.h"
+#include "../scene/scene.h"
 #include "CommandLineUI.h"
+#include "TileCoordinator.h"
 
 #include "../RayTracer.h"
 
+#include "json.hpp"
+using Json = nlohmann::json;
+
 using namespace std;
 
+namespace {
+typedef std::chrono::steady_clock Clock;
+
+double msSince(Clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(Clock::now() - start)
+      .count();
+}
+
+// Frames smaller than this are rendered several at a time, one thread each,
+// since a small frame has too few scanlines to keep every thread busy.
+constexpr int SMALL_FRAME_PIXELS = 256 * 256;
+
+// Output name for one frame of an animation: a pattern such as
+// "out%04d.png" gets the frame number in place of its one %d, %Nd or %0Nd
+// (and "%%" becomes "%"), otherwise "out.png" becomes "out_0001.png".
+// Throws if the pattern has any other conversion, since it comes from the
+// user.
+string frameFileName(const string &pattern, int frame) {
+  char buf[32];
+  if (pattern.find('%') != string::npos) {
+    string name;
+    bool numbered = false;
+    for (size_t k = 0; k < pattern.size(); ++k) {
+      if (pattern[k] != '%') {
+        name += pattern[k];
+        continue;
+      }
+      if (k + 1 < pattern.size() && pattern[k + 1] == '%') {
+        name += '%';
+        ++k;
+        continue;
+      }
+      size_t end = k + 1;
+      bool zeros = end < pattern.size() && pattern[end] == '0';
+      end += zeros;
+      int width = 0;
+      while (end < pattern.size() && isdigit((unsigned char)pattern[end]) &&
+             width < 100)
+        width = width * 10 + (pattern[end++] - '0');
+      if (numbered || end >= pattern.size() || pattern[end] != 'd' ||
+          width >= 100)
+        throw string("Output name '") + pattern +
+            "' must have exactly one %d or %0Nd, and no other % "
+            "conversions (use %% for a literal %)";
+      snprintf(buf, sizeof(buf), zeros ? "%0*d" : "%*d", width, frame);
+      name += buf;
+      numbered = true;
+      k = end;
+    }
+    if (!numbered)
+      throw string("Output name '") + pattern + "' has no %d for the frame";
+    return name;
+  }
+  size_t dot = pattern.find_last_of('.');
+  size_t slash = pattern.find_last_of("\\/");
+  if (dot == string::npos || (slash != string::npos && dot < slash))
+    dot = pattern.size();
+  snprintf(buf, sizeof(buf), "_%04d", frame);
+  return pattern.substr(0, dot) + buf + pattern.substr(dot);
+}
+} // namespace
+
 // The command line UI simply parses out all the arguments off
 // the command line and stores them locally.
 CommandLineUI::CommandLineUI(int argc, char **argv) : TraceUI() {
   int i;
   progName = argv[0];
   const char *jsonfile = nullptr;
+  const char *png_level = nullptr;
+  const char *png_filter = nullptr;
+  const char *workers = nullptr;
+  const char *tile_size = nullptr;
   string cubemap_file;
-  while ((i = getopt(argc, argv, "tr:w:hj:c:")) != EOF) {
+  while ((i = getopt(argc, argv, "tr:w:hj:c:b:z:f:p:n:s:m:o:l:")) != EOF) {
     switch (i) {
     case 'r':
       m_nDepth = atoi(optarg);
@@ -39,6 +122,33 @@ CommandLineUI::CommandLineUI(int argc, char **argv) : TraceUI() {
     case 'c':
       cubemap_file = optarg;
       break;
+    case 'b':
+      m_nBandRows = atoi(optarg);
+      break;
+    case 'z':
+      png_level = optarg;
+      break;
+    case 'f':
+      png_filter = optarg;
+      break;
+    case 'p':
+      pathName = optarg;
+      break;
+    case 'n':
+      workers = optarg;
+      break;
+    case 's':
+      tile_size = optarg;
+      break;
+    case 'm':
+      costName = optarg;
+      break;
+    case 'o':
+      statsName = optarg;
+      break;
+    case 'l':
+      logName = optarg;
+      break;
     case 'h':
       usage();
       exit(1);
@@ -55,6 +165,22 @@ CommandLineUI::CommandLineUI(int argc, char **argv) : TraceUI() {
   if (!cubemap_file.empty()) {
     smartLoadCubemap(cubemap_file);
   }
+  // Command line flags win over the JSON settings
+  if (logName && m_nRayLogStride <= 0)
+    m_nRayLogStride = 1;
+  if (png_level)
+    m_nPngCompression = atoi(png_level);
+  if (png_filter)
+    m_pngFilter = png_filter;
+  if (workers)
+    m_nWorkers = atoi(workers);
+  if (tile_size)
+    m_nTileSize = atoi(tile_size);
+  if (!configurePngOutput()) {
+    std::cerr << "Unknown png filter '" << m_pngFilter << "'." << std::endl;
+    usage();
+    exit(1);
+  }
 
   if (optind >= argc - 1) {
     std::cerr << "no input and/or output name." << std::endl;
@@ -67,43 +193,304 @@ CommandLineUI::CommandLineUI(int argc, char **argv) : TraceUI() {
 
 int CommandLineUI::run() {
   assert(raytracer != 0);
+  auto loadStart = Clock::now();
   raytracer->loadScene(rayName);
+  loadMs = msSince(loadStart);
 
   if (raytracer->sceneLoaded()) {
     int width = m_nSize;
     int height = (int)(width / raytracer->aspectRatio() + 0.5);
 
-    raytracer->traceSetup(width, height);
+    if (costName && (pathName || m_nBandRows > 0 || m_nWorkers > 0))
+      std::cerr << "Cost maps are only recorded for single-process, "
+                   "whole-frame renders."
+                << std::endl;
+    if (pathName)
+      return runCameraPath(width, height);
+    if (m_nBandRows > 0)
+      return runBanded(width, height);
+    if (m_nWorkers > 0)
+      return runTiled(width, height);
 
-    clock_t start, end;
-    start = clock();
+    return renderWhole(width, height);
+  } else {
+    std::cerr << "Unable to load ray file '" << rayName << "'" << std::endl;
+    return (1);
+  }
+}
+
+// Render the whole frame into the framebuffer, then write it out along
+// with whatever stats, ray log and cost map were asked for.
+int CommandLineUI::renderWhole(int width, int height) {
+  raytracer->setCostMap(costName != nullptr);
+  raytracer->traceSetup(width, height);
 
+  int occluderLookups, occluderHits;
+  TraceUI::resetCount();
+  TraceUI::resetOccluderStats(occluderLookups, occluderHits);
+  auto renderStart = Clock::now();
+  {
+    TimelineScope t("trace image");
     raytracer->traceImage(width, height);
     raytracer->waitRender();
-    if (aaSwitch()) {
-      raytracer->aaImage();
-      raytracer->waitRender();
+  }
+  double renderMs = msSince(renderStart);
+  double aaMs = 0.0;
+  if (aaSwitch()) {
+    TimelineScope t("antialias image");
+    auto aaStart = Clock::now();
+    raytracer->aaImage();
+    raytracer->waitRender();
+    aaMs = msSince(aaStart);
+  }
+  double denoiseMs = 0.0;
+  if (denoiseSwitch()) {
+    auto denoiseStart = Clock::now();
+    raytracer->denoiseImage();
+    denoiseMs = msSince(denoiseStart);
+  }
+  int rays = TraceUI::resetCount();
+  TraceUI::resetOccluderStats(occluderLookups, occluderHits);
+
+  // save image
+  unsigned char *buf;
+
+  raytracer->getBuffer(buf, width, height);
+
+  auto writeStart = Clock::now();
+  if (buf)
+    writeImage(imgName, width, height, buf);
+  double writeMs = msSince(writeStart);
+
+  if (statsName) {
+    // Same fields as the render server's job replies
+    Json stats = {{"load_ms", loadMs},   {"render_ms", renderMs},
+                  {"aa_ms", aaMs},       {"denoise_ms", denoiseMs},
+                  {"write_ms", writeMs}, {"rays", rays},
+                  {"width", width},      {"height", height},
+                  {"threads", m_threads},
+                  {"occluder_lookups", occluderLookups},
+                  {"occluder_hits", occluderHits}};
+    std::ofstream out(statsName);
+    out << stats.dump() << std::endl;
+    if (!out)
+      std::cerr << "Couldn't write stats to " << statsName << std::endl;
+  }
+  if (logName && writeRayLog())
+    return 1;
+  if (costName)
+    return writeCostMap(width, height);
+  return 0;
+}
+
+// Render and write the image one band of scanlines at a time, so the full
+// framebuffer never has to be resident.
+int CommandLineUI::runBanded(int width, int height) {
+  std::unique_ptr<ImageStreamWriter> out;
+  try {
+    out = openImageStream(imgName, width, height);
+  } catch (const string &msg) {
+    std::cerr << msg << std::endl;
+    return 1;
+  }
+  if (!out) {
+    std::cerr << "No streaming writer for '" << imgName
+              << "', rendering the whole image at once." << std::endl;
+    return renderWhole(width, height);
+  }
+
+  try {
+    raytracer->traceBands(width, height, m_nBandRows,
+                          [&out](const unsigned char *rows, int, int count) {
+                            out->writeRows(rows, count);
+                          });
+    out->finish();
+  } catch (const string &msg) {
+    std::cerr << msg << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+// Write the recorded cost map as a false-color image of the time spent per
+// pixel, and all cost channels raw next to it as <name>.costs.
+int CommandLineUI::writeCostMap(int width, int height) {
+  const float *costs = raytracer->getCostBuffer();
+  if (!costs)
+    return 1;
+
+  string dumpName = costName;
+  size_t dot = dumpName.find_last_of('.');
+  size_t slash = dumpName.find_last_of("\\/");
+  if (dot != string::npos && (slash == string::npos || dot > slash))
+    dumpName.erase(dot);
+  dumpName += ".costs";
+
+  try {
+    writeCostHeatmap(costName, width, height, costs, COST_NS);
+    writeCostDump(dumpName.c_str(), width, height, costs);
+  } catch (const string &msg) {
+    std::cerr << msg << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+// Write the rays logged during the render as a JSON array of records
+int CommandLineUI::writeRayLog() {
+  static const char *const TYPES[] = {"visibility", "reflection",
+                                      "refraction", "shadow"};
+  Json records = Json::array();
+  for (const RayRecord &rec : raytracer->getScene().getRayLog().snapshot()) {
+    Json r = {{"thread", rec.thread},
+              {"pixel", {rec.pixelX, rec.pixelY}},
+              {"type", TYPES[rec.type]},
+              {"position", {rec.position[0], rec.position[1], rec.position[2]}},
+              {"direction",
+               {rec.direction[0], rec.direction[1], rec.direction[2]}},
+              {"hit", rec.hit != 0}};
+    if (rec.hit) {
+      r["t"] = rec.t;
+      r["normal"] = {rec.normal[0], rec.normal[1], rec.normal[2]};
     }
+    records.push_back(r);
+  }
+  std::ofstream out(logName);
+  out << records.dump() << std::endl;
+  if (!out) {
+    std::cerr << "Couldn't write the ray log to " << logName << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+// Render the image with worker processes, each pinned to a NUMA node, that
+// trace tiles handed out by this process.
+int CommandLineUI::runTiled(int width, int height) {
+  TileCoordinator coordinator(raytracer, m_nWorkers, m_nTileSize);
+  string error;
+  auto start = std::chrono::steady_clock::now();
+  if (!coordinator.render(width, height, error)) {
+    std::cerr << error << std::endl;
+    return 1;
+  }
+  double t = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                           start)
+                 .count();
+  std::cerr << m_nWorkers << " workers: " << t << " s";
+  if (coordinator.workersLost() || coordinator.tilesReissued())
+    std::cerr << ", " << coordinator.workersLost() << " lost, "
+              << coordinator.tilesReissued() << " tiles reissued";
+  std::cerr << std::endl;
+
+  unsigned char *buf;
+  raytracer->getBuffer(buf, width, height);
+  try {
+    writeImage(imgName, width, height, buf);
+  } catch (const string &msg) {
+    std::cerr << msg << std::endl;
+    return 1;
+  }
+  return 0;
+}
 
-    end = clock();
+// Render every frame of a camera path from the one loaded scene, writing
+// numbered images. Each tracer slot renders one frame at a time; there is one
+// slot using every thread for big frames, or one single-threaded slot per
+// thread for small ones.
+int CommandLineUI::runCameraPath(int width, int height) {
+  CameraPath path;
+  try {
+    path = CameraPath::load(pathName);
+  } catch (const ParserException &pe) {
+    std::cerr << pe.message() << std::endl;
+    return 1;
+  }
+  // Reject a bad output pattern before spending any time rendering
+  try {
+    frameFileName(imgName, path.firstFrame());
+  } catch (const string &msg) {
+    std::cerr << msg << std::endl;
+    return 1;
+  }
 
-    // save image
-    unsigned char *buf;
+  const Camera base = raytracer->getCamera();
+  int frames = path.lastFrame() - path.firstFrame() + 1;
+  int slots = width * height < SMALL_FRAME_PIXELS
+                  ? std::clamp(std::min(m_threads, frames), 1, MAX_THREADS)
+                  : 1;
 
-    raytracer->getBuffer(buf, width, height);
+  std::vector<std::unique_ptr<RayTracer>> extra;
+  std::vector<RayTracer *> tracers{raytracer};
+  if (slots > 1) {
+    auto scene = raytracer->releaseScene();
+    raytracer->setScene(scene);
+    raytracer->setThreadSlots(0, 1);
+    for (int k = 1; k < slots; k++) {
+      extra.emplace_back(new RayTracer());
+      extra.back()->setScene(scene);
+      extra.back()->setThreadSlots(k, 1);
+      tracers.push_back(extra.back().get());
+    }
+  }
 
-    if (buf)
-      writeImage(imgName, width, height, buf);
+  enum { IDLE, TRACING, ANTIALIASING };
+  std::vector<int> state(slots, IDLE), frameOf(slots, 0);
+  int next = path.firstFrame();
+  int status = 0;
+  auto start = std::chrono::steady_clock::now();
 
-    [[maybe_unused]] double t = (double)(end - start) / CLOCKS_PER_SEC;
-    //		int totalRays = TraceUI::resetCount();
-    //		std::cout << "total time = " << t << " seconds,
-    // rays traced = " << totalRays << std::endl;
-    return 0;
-  } else {
-    std::cerr << "Unable to load ray file '" << rayName << "'" << std::endl;
-    return (1);
+  for (bool busy = true; busy;) {
+    busy = false;
+    for (int k = 0; k < slots; k++) {
+      RayTracer *rt = tracers[k];
+      if (state[k] != IDLE && !rt->checkRender()) {
+        busy = true;
+        continue;
+      }
+      if (state[k] == TRACING && aaSwitch()) {
+        rt->aaImage();
+        state[k] = ANTIALIASING;
+        busy = true;
+        continue;
+      }
+      if (state[k] != IDLE) {
+        rt->waitRender();
+        rt->denoiseImage();
+        state[k] = IDLE;
+        unsigned char *buf;
+        int w, h;
+        rt->getBuffer(buf, w, h);
+        try {
+          string name = frameFileName(imgName, frameOf[k]);
+          writeImage(name.c_str(), w, h, buf);
+        } catch (const string &msg) {
+          std::cerr << msg << std::endl;
+          status = 1;
+          next = path.lastFrame() + 1;
+        }
+      }
+      if (next <= path.lastFrame()) {
+        rt->getCamera() = path.at(next, base);
+        rt->traceImage(width, height);
+        frameOf[k] = next++;
+        state[k] = TRACING;
+        busy = true;
+      }
+    }
+    if (busy)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
   }
+
+  raytracer->setThreadSlots(0, 0);
+  raytracer->getCamera() = base;
+
+  double t = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                           start)
+                 .count();
+  std::cerr << frames << " frames in " << t << " s (" << slots
+            << " at a time)" << std::endl;
+  return status;
 }
 
 void CommandLineUI::alert(const string &msg) { std::cerr << msg << std::endl; }
@@ -118,5 +505,29 @@ void CommandLineUI::usage() {
        << "  -j <FILE>   set parameters from JSON file" << endl
        << "  -c <FILE>   one Cubemap file, the remainings will be "
           "detected automatically"
+       << endl
+       << "  -b <#>      render and write the image in bands of # scanlines "
+          "(png only)"
+       << endl
+       << "  -z <#>      png compression level 0-9 (default: zlib's)" << endl
+       << "  -f <NAME>   png row filter: none, sub, up, avg, paeth or "
+          "adaptive (default)"
+       << endl
+       << "  -p <FILE>   render every frame of a JSON camera path; output "
+          "names get a frame number"
+       << endl
+       << "  -n <#>      render tiles in # worker processes pinned per NUMA "
+          "node"
+       << endl
+       << "  -s <#>      tile size for worker processes (default "
+       << m_nTileSize << ")" << endl
+       << "  -m <FILE>   also write a per-pixel cost heatmap to FILE, and raw "
+          "costs next to it"
+       << endl
+       << "  -o <FILE>   write load/render/write times and the ray count as "
+          "JSON to FILE"
+       << endl
+       << "  -l <FILE>   log intersection queries (see the ray_log_* "
+          "settings) as JSON to FILE"
        << endl;
 }
@@ -18,10 +18,21 @@ public:
 
 private:
   void usage();
+  int renderWhole(int width, int height);
+  int runBanded(int width, int height);
+  int runTiled(int width, int height);
+  int writeCostMap(int width, int height);
+  int writeRayLog();
+  int runCameraPath(int width, int height);
 
   char *rayName;
   char *imgName;
   char *progName;
+  const char *pathName = nullptr;
+  const char *costName = nullptr;
+  const char *statsName = nullptr;
+  const char *logName = nullptr;
+  double loadMs = 0.0; // time spent loading the scene, for --stats
 };
 
 #endif
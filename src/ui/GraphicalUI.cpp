@@ -13,6 +13,7 @@
 #ifndef COMMAND_LINE_ONLY
 
 #include "debuggingView.h"
+#include "glObjects.h"
 #include <FL/fl_ask.H>
 
 #include "../RayTracer.h"
@@ -29,7 +30,6 @@
 bool GraphicalUI::stopTrace = false;
 GraphicalUI *GraphicalUI::pUI = NULL;
 const char *GraphicalUI::traceWindowLabel = "Raytraced Image";
-bool TraceUI::m_debug = false;
 
 //------------------------------------- Help Functions
 //--------------------------------------------
@@ -58,6 +58,7 @@ void GraphicalUI::cb_load_scene(Fl_Menu_ *o, void *) {
       print(buf, "Ray <Not Loaded>");
 
     pUI->m_mainWindow->label(buf);
+    glSceneChanged();
     pUI->m_debuggingWindow->m_debuggingView->setDirty();
 
     if (lastFile != 0 && strcmp(newfile, lastFile) != 0)
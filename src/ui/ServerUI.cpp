@@ -0,0 +1,376 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string.h>
+#ifndef _MSC_VER
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#else
+extern char *optarg;
+extern int optind, opterr, optopt;
+extern int getopt(int argc, char **argv, const char *optstring);
+#endif
+
+#include <assert.h>
+
+#include "../RayTracer.h"
+#include "../fileio/images.h"
+#include "../fileio/timeline.h"
+#include "../scene/scene.h"
+#include "ServerUI.h"
+
+#include "json.hpp"
+using Json = nlohmann::json;
+
+using namespace std;
+
+/*
+ * Job protocol: every request is a single line of JSON,
+ *
+ *   {"scene": "scenes/foo.json", "output": "foo.png", "width": 512,
+ *    "depth": 3, "anti_alias": true, "supersamples": 3,
+ *    "camera": {"position": [0, 0, 5], "look": [r, i, j, k], "fov": 45}}
+ *
+ * Only "scene" and "output" are required; everything else falls back to the
+ * server's startup settings. The camera may also be given as "viewdir" and
+ * "updir" like in the scene format. {"quit": true} shuts the server down and
+ * {"flush": true} drops every cached scene.
+ *
+ * At most -c scenes (4 by default) stay cached; loading one more evicts the
+ * one that has gone longest without a job.
+ *
+ * Every request gets a single line reply with "status" ("ok" or "error") and
+ * either timing stats or an error "message". Jobs asking for an image
+ * wider or taller than MAX_IMAGE_SIZE, a negative depth or fewer than one
+ * supersample are turned away.
+ */
+
+namespace {
+typedef std::chrono::steady_clock Clock;
+
+// Largest width or height a job may ask for, so a typo can't take the
+// server down with an allocation it can't make
+const int MAX_IMAGE_SIZE = 16384;
+
+double msSince(Clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(Clock::now() - start)
+      .count();
+}
+
+glm::dvec3 toVec3(const Json &j) {
+  return glm::dvec3(j.at(0).get<double>(), j.at(1).get<double>(),
+                    j.at(2).get<double>());
+}
+
+void applyCamera(const Json &j, Camera &c) {
+  if (j.contains("position"))
+    c.setEye(toVec3(j.at("position")));
+  if (j.contains("look")) {
+    const Json &q = j.at("look");
+    c.setLook(q.at(0).get<double>(), q.at(1).get<double>(),
+              q.at(2).get<double>(), q.at(3).get<double>());
+  }
+  if (j.contains("viewdir") || j.contains("updir"))
+    c.setLook(toVec3(j.at("viewdir")), toVec3(j.at("updir")));
+  if (j.contains("fov"))
+    c.setFOV(j.at("fov").get<double>());
+}
+
+// Hands a cached scene to the tracer for the duration of one job and puts it
+// back afterwards, even if the job fails halfway.
+struct SceneLease {
+  SceneLease(RayTracer *rt, std::shared_ptr<Scene> &slot)
+      : rt(rt), slot(slot) {
+    rt->setScene(std::move(slot));
+  }
+  ~SceneLease() { slot = rt->releaseScene(); }
+
+  RayTracer *rt;
+  std::shared_ptr<Scene> &slot;
+};
+
+bool quitRequested = false;
+} // namespace
+
+ServerUI::ServerUI(int argc, char **argv) : TraceUI() {
+  int i;
+  progName = argv[0];
+  const char *jsonfile = nullptr;
+  optind = 2; // skip over --server
+  while ((i = getopt(argc, argv, "hj:S:c:")) != EOF) {
+    switch (i) {
+    case 'c':
+      maxCachedScenes = std::max(atoi(optarg), 1);
+      break;
+    case 'j':
+      jsonfile = optarg;
+      break;
+    case 'S':
+      socketPath = optarg;
+      break;
+    case 'h':
+      usage();
+      exit(1);
+    default:
+      std::cerr << "Invalid argument: '" << i << "'." << std::endl;
+      usage();
+      exit(1);
+    }
+  }
+  if (jsonfile) {
+    loadFromJson(jsonfile);
+  }
+  if (!configurePngOutput()) {
+    std::cerr << "Unknown png filter '" << m_pngFilter << "'." << std::endl;
+    exit(1);
+  }
+}
+
+int ServerUI::run() {
+  assert(raytracer != 0);
+  return socketPath ? serveSocket() : serveStream();
+}
+
+string ServerUI::handleJob(const string &request) {
+  auto jobStart = Clock::now();
+  Json reply;
+
+  // Jobs may override a few settings; restore the startup values afterwards
+  const int size = m_nSize, depth = m_nDepth, superSamples = m_nSuperSamples;
+  const bool antiAlias = m_antiAlias;
+
+  try {
+    Json job = Json::parse(request);
+    if (job.value("quit", false)) {
+      quitRequested = true;
+      reply["status"] = "ok";
+      return reply.dump();
+    }
+    if (job.value("flush", false)) {
+      sceneCache.clear();
+      reply["status"] = "ok";
+      return reply.dump();
+    }
+
+    string scenePath = job.at("scene").get<string>();
+    string output = job.at("output").get<string>();
+    TimelineScope t("job", "server", output);
+    m_nSize = job.value("width", m_nSize);
+    m_nDepth = job.value("depth", m_nDepth);
+    m_antiAlias = job.value("anti_alias", m_antiAlias);
+    m_nSuperSamples = job.value("supersamples", m_nSuperSamples);
+    if (m_nSize < 1 || m_nSize > MAX_IMAGE_SIZE)
+      throw string("width must be between 1 and " +
+                   std::to_string(MAX_IMAGE_SIZE));
+    if (m_nDepth < 0)
+      throw string("depth must not be negative");
+    if (m_nSuperSamples < 1)
+      throw string("supersamples must be at least 1");
+
+    // Scenes are cached by path and reparsed only when the file changes
+    std::error_code ec;
+    auto mtime = std::filesystem::last_write_time(scenePath, ec);
+    if (ec)
+      throw string("couldn't read scene file " + scenePath);
+    string key = std::filesystem::weakly_canonical(scenePath, ec).string();
+    if (ec)
+      key = scenePath;
+
+    auto loadStart = Clock::now();
+    auto it = sceneCache.find(key);
+    bool cached = it != sceneCache.end() && it->second.mtime == mtime;
+    if (!cached) {
+      lastAlert.clear();
+      if (!raytracer->loadScene(scenePath.c_str()))
+        throw lastAlert.empty() ? string("unable to load " + scenePath)
+                                : lastAlert;
+      CachedScene &entry = sceneCache[key];
+      entry.mtime = mtime;
+      entry.scene = raytracer->releaseScene();
+      evictScenes(key);
+    }
+    double loadMs = msSince(loadStart);
+
+    CachedScene &entry = sceneCache[key];
+    entry.lastUsed = ++jobCount;
+
+    double renderMs, aaMs = 0.0, denoiseMs = 0.0, writeMs;
+    int rays, occluderLookups, occluderHits;
+    {
+      // The tracer takes a fresh copy of the scene camera when the scene is
+      // set, so overrides only ever touch that copy.
+      // If the tracer can't take the scene it's left holding what it got,
+      // so the entry would be empty; drop it instead.
+      std::unique_ptr<SceneLease> lease;
+      try {
+        lease.reset(new SceneLease(raytracer, entry.scene));
+      } catch (...) {
+        raytracer->releaseScene();
+        sceneCache.erase(key);
+        throw;
+      }
+      if (job.contains("camera"))
+        applyCamera(job.at("camera"), raytracer->getCamera());
+      int width = m_nSize;
+      int height = (int)(width / raytracer->aspectRatio() + 0.5);
+      if (height < 1 || height > MAX_IMAGE_SIZE)
+        throw string("height must be between 1 and " +
+                     std::to_string(MAX_IMAGE_SIZE) + ", not " +
+                     std::to_string(height));
+      TraceUI::resetCount();
+      TraceUI::resetOccluderStats(occluderLookups, occluderHits);
+
+      auto renderStart = Clock::now();
+      {
+        TimelineScope t("trace image");
+        raytracer->traceImage(width, height);
+        raytracer->waitRender();
+      }
+      renderMs = msSince(renderStart);
+      if (aaSwitch()) {
+        TimelineScope t("antialias image");
+        auto aaStart = Clock::now();
+        raytracer->aaImage();
+        raytracer->waitRender();
+        aaMs = msSince(aaStart);
+      }
+      if (denoiseSwitch()) {
+        auto denoiseStart = Clock::now();
+        raytracer->denoiseImage();
+        denoiseMs = msSince(denoiseStart);
+      }
+      rays = TraceUI::resetCount();
+      TraceUI::resetOccluderStats(occluderLookups, occluderHits);
+
+      auto writeStart = Clock::now();
+      unsigned char *buf;
+      raytracer->getBuffer(buf, width, height);
+      writeImage(output.c_str(), width, height, buf);
+      writeMs = msSince(writeStart);
+    }
+
+    reply["status"] = "ok";
+    reply["output"] = output;
+    reply["cached"] = cached;
+    reply["load_ms"] = loadMs;
+    reply["render_ms"] = renderMs;
+    reply["aa_ms"] = aaMs;
+    reply["denoise_ms"] = denoiseMs;
+    reply["write_ms"] = writeMs;
+    reply["total_ms"] = msSince(jobStart);
+    reply["rays"] = rays;
+    reply["occluder_lookups"] = occluderLookups;
+    reply["occluder_hits"] = occluderHits;
+  } catch (const Json::exception &e) {
+    reply = Json{{"status", "error"}, {"message", e.what()}};
+  } catch (const string &msg) {
+    reply = Json{{"status", "error"}, {"message", msg}};
+  } catch (const std::exception &e) {
+    // Anything else the job ran into, such as running out of memory; the
+    // server and its cache carry on.
+    reply = Json{{"status", "error"}, {"message", e.what()}};
+  }
+
+  m_nSize = size;
+  m_nDepth = depth;
+  m_nSuperSamples = superSamples;
+  m_antiAlias = antiAlias;
+  return reply.dump();
+}
+
+// Drop the least recently used scenes until the cache fits, keeping `keep`
+void ServerUI::evictScenes(const string &keep) {
+  while (sceneCache.size() > (size_t)maxCachedScenes) {
+    auto oldest = sceneCache.end();
+    for (auto it = sceneCache.begin(); it != sceneCache.end(); ++it)
+      if (it->first != keep && (oldest == sceneCache.end() ||
+                                it->second.lastUsed < oldest->second.lastUsed))
+        oldest = it;
+    if (oldest == sceneCache.end())
+      return;
+    sceneCache.erase(oldest);
+  }
+}
+
+int ServerUI::serveStream() {
+  string line;
+  while (!quitRequested && std::getline(std::cin, line)) {
+    if (line.empty())
+      continue;
+    std::cout << handleJob(line) << std::endl;
+  }
+  return 0;
+}
+
+int ServerUI::serveSocket() {
+#ifdef _MSC_VER
+  std::cerr << "UNIX sockets are not supported on this platform" << std::endl;
+  return 1;
+#else
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0) {
+    perror("socket");
+    return 1;
+  }
+
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+    std::cerr << "Socket path too long: " << socketPath << std::endl;
+    close(listener);
+    return 1;
+  }
+  strcpy(addr.sun_path, socketPath);
+  unlink(socketPath);
+  if (bind(listener, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(listener, 4) < 0) {
+    perror("bind");
+    close(listener);
+    return 1;
+  }
+
+  // Clients are served one at a time; each may send any number of jobs.
+  while (!quitRequested) {
+    int conn = accept(listener, nullptr, nullptr);
+    if (conn < 0)
+      break;
+
+    string pending;
+    char chunk[4096];
+    ssize_t n;
+    while (!quitRequested && (n = read(conn, chunk, sizeof(chunk))) > 0) {
+      pending.append(chunk, n);
+      size_t eol;
+      while (!quitRequested && (eol = pending.find('\n')) != string::npos) {
+        string line = pending.substr(0, eol);
+        pending.erase(0, eol + 1);
+        if (line.empty())
+          continue;
+        string reply = handleJob(line) + "\n";
+        if (write(conn, reply.data(), reply.size()) < 0)
+          break;
+      }
+    }
+    close(conn);
+  }
+
+  close(listener);
+  unlink(socketPath);
+  return 0;
+#endif
+}
+
+void ServerUI::alert(const string &msg) {
+  std::cerr << msg << std::endl;
+  lastAlert = msg;
+}
+
+void ServerUI::usage() {
+  cerr << "usage: " << progName << " --server [options]" << endl
+       << "  -j <FILE>   set default parameters from JSON file" << endl
+       << "  -S <PATH>   listen on a UNIX socket instead of stdin/stdout"
+       << endl
+       << "  -c <n>      keep at most n scenes loaded (default 4)" << endl;
+}
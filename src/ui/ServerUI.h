@@ -0,0 +1,51 @@
+//
+// ServerUI.h
+//
+// A long-running render server. Jobs arrive one JSON object per line on
+// stdin or a local UNIX socket; loaded scenes stay resident between jobs.
+//
+
+#ifndef __ServerUI_h__
+#define __ServerUI_h__
+
+#include "TraceUI.h"
+
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <stdint.h>
+
+class Scene;
+
+class ServerUI : public TraceUI {
+public:
+  ServerUI(int argc, char **argv);
+  int run();
+
+  void alert(const string &msg);
+
+private:
+  void usage();
+
+  // Run one job request and return the single-line JSON reply.
+  string handleJob(const string &request);
+  int serveStream();
+  int serveSocket();
+  void evictScenes(const string &keep);
+
+  // A parsed scene waiting for its next job
+  struct CachedScene {
+    std::filesystem::file_time_type mtime;
+    std::shared_ptr<Scene> scene;
+    uint64_t lastUsed = 0; // jobCount when a job last used it
+  };
+  std::map<string, CachedScene> sceneCache;
+  int maxCachedScenes = 4;
+  uint64_t jobCount = 0;
+
+  char *progName;
+  const char *socketPath = nullptr;
+  string lastAlert;
+};
+
+#endif
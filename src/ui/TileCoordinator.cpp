@@ -0,0 +1,439 @@
+#include "TileCoordinator.h"
+
+#include <algorithm>
+#include <chrono>
+#include <errno.h>
+#include <fstream>
+#include <stdint.h>
+#include <string.h>
+#include <thread>
+#ifndef _MSC_VER
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "../RayTracer.h"
+
+using namespace std;
+
+/*
+ * Wire format, over one socket pair per worker: the coordinator sends a
+ * tile index as an int32 (-1 asks the worker to exit), the worker answers
+ * with the same index followed by the tile's pixels, 3 bytes each, bottom
+ * row first. With the denoiser on, the pixels are followed by the tile's
+ * aux channels, AUX_CHANNELS floats per pixel in the same order, so the
+ * coordinator can denoise the assembled image in one go. Both sides build
+ * the same tile list before the fork, so an index is all that needs to
+ * travel.
+ */
+
+namespace {
+double now() {
+  return std::chrono::duration<double>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+#ifndef _MSC_VER
+#ifdef MSG_NOSIGNAL
+const int SEND_FLAGS = MSG_NOSIGNAL; // a dead peer is an error, not SIGPIPE
+#else
+const int SEND_FLAGS = 0;
+#endif
+
+bool sendAll(int fd, const void *data, size_t size) {
+  const char *p = (const char *)data;
+  while (size > 0) {
+    ssize_t n = ::send(fd, p, size, SEND_FLAGS);
+    if (n <= 0)
+      return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool recvAll(int fd, void *data, size_t size) {
+  char *p = (char *)data;
+  while (size > 0) {
+    ssize_t n = ::recv(fd, p, size, 0);
+    if (n <= 0)
+      return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+#endif
+
+// CPUs listed in a sysfs cpulist such as "0-7,16-23".
+vector<int> readCpuList(const string &file) {
+  vector<int> cpus;
+  ifstream in(file);
+  string list;
+  if (!(in >> list))
+    return cpus;
+  size_t pos = 0;
+  while (pos < list.size()) {
+    size_t end = list.find(',', pos);
+    if (end == string::npos)
+      end = list.size();
+    string range = list.substr(pos, end - pos);
+    size_t dash = range.find('-');
+    int lo = atoi(range.c_str());
+    int hi = dash == string::npos ? lo : atoi(range.c_str() + dash + 1);
+    for (int c = lo; c <= hi; ++c)
+      cpus.push_back(c);
+    pos = end + 1;
+  }
+  return cpus;
+}
+
+// CPUs of each NUMA node; one entry covering nothing if there's no NUMA
+// information, in which case workers are left unpinned.
+vector<vector<int>> numaNodes() {
+  vector<vector<int>> nodes;
+  for (int n = 0;; ++n) {
+    vector<int> cpus = readCpuList("/sys/devices/system/node/node" +
+                                   to_string(n) + "/cpulist");
+    if (cpus.empty())
+      break;
+    nodes.push_back(cpus);
+  }
+  if (nodes.empty())
+    nodes.emplace_back();
+  return nodes;
+}
+} // namespace
+
+TileCoordinator::TileCoordinator(RayTracer *rt, int workers, int tileSize,
+                                 int threads)
+    : raytracer(rt), nWorkers(std::max(workers, 1)),
+      tileSize(std::max(tileSize, 1)), threadsPerWorker(threads) {}
+
+TileCoordinator::~TileCoordinator() {
+  for (Worker &w : workers)
+    retire(w, true);
+}
+
+bool TileCoordinator::render(int w, int h, string &error) {
+#ifdef _MSC_VER
+  error = "multi-process rendering is not supported on this platform";
+  return false;
+#else
+  width = w;
+  height = h;
+
+  // Rows go bottom-up, so hand out the top of the image first
+  tiles.clear();
+  for (int y1 = h; y1 > 0; y1 -= tileSize)
+    for (int x0 = 0; x0 < w; x0 += tileSize) {
+      Tile t;
+      t.x0 = x0;
+      t.y0 = std::max(y1 - tileSize, 0);
+      t.x1 = std::min(x0 + tileSize, w);
+      t.y1 = y1;
+      tiles.push_back(t);
+    }
+  pending.clear();
+  for (int i = (int)tiles.size() - 1; i >= 0; --i)
+    pending.push_back(i);
+  remaining = (int)tiles.size();
+  tileTimes.clear();
+  reissued = lost = 0;
+
+  // Workers are forked with the scene already loaded and the buffer sized,
+  // and there must be no tracer threads running across the fork.
+  raytracer->traceSetup(w, h);
+
+  auto nodes = numaNodes();
+  workers.assign(nWorkers, Worker());
+  for (int i = 0; i < nWorkers; ++i)
+    if (!spawn(i, (int)nodes.size(), error)) {
+      for (Worker &wk : workers)
+        retire(wk, true);
+      return false;
+    }
+
+  while (remaining > 0) {
+    double t = now();
+    bool alive = false;
+    for (Worker &wk : workers) {
+      if (wk.fd < 0)
+        continue;
+      alive = true;
+      if (wk.tile >= 0)
+        continue;
+
+      while (!pending.empty() && tiles[pending.back()].done)
+        pending.pop_back();
+      int tile = -1;
+      if (!pending.empty()) {
+        tile = pending.back();
+        pending.pop_back();
+      } else if ((tile = slowTile(t)) >= 0) {
+        ++reissued;
+      } else {
+        break;
+      }
+      if (!send(wk, tile, t)) {
+        pending.push_back(tile);
+        ++lost;
+        retire(wk, true);
+      }
+    }
+
+    if (!alive) {
+      // Every worker is gone; finish the job in this process.
+      for (Tile &tile : tiles)
+        if (!tile.done) {
+          raytracer->traceRegion(tile.x0, tile.y0, tile.x1, tile.y1);
+          tile.done = true;
+        }
+      remaining = 0;
+      break;
+    }
+
+    vector<pollfd> fds;
+    vector<Worker *> polled;
+    for (Worker &wk : workers)
+      if (wk.fd >= 0 && wk.tile >= 0) {
+        fds.push_back({wk.fd, POLLIN, 0});
+        polled.push_back(&wk);
+      }
+    if (fds.empty())
+      continue;
+    if (poll(fds.data(), fds.size(), 100) <= 0)
+      continue;
+
+    t = now();
+    for (size_t k = 0; k < fds.size(); ++k) {
+      if (!fds[k].revents)
+        continue;
+      Worker &wk = *polled[k];
+      if (!receive(wk, t)) {
+        int tile = wk.tile;
+        retire(wk, true);
+        ++lost;
+        if (!tiles[tile].done) {
+          pending.push_back(tile);
+          ++reissued;
+        }
+      }
+    }
+  }
+
+  // Idle workers are told to exit; ones still busy on a duplicate of a tile
+  // that has since come back are simply killed.
+  for (Worker &wk : workers) {
+    if (wk.fd < 0)
+      continue;
+    int32_t quit = -1;
+    bool idle = wk.tile < 0 && sendAll(wk.fd, &quit, sizeof(quit));
+    retire(wk, !idle);
+  }
+
+  // Tiles are traced but not denoised, so filter the whole image here;
+  // tiles filtered on their own would show seams along their edges.
+  raytracer->denoiseImage();
+  return true;
+#endif
+}
+
+bool TileCoordinator::spawn(int index, int nodes, string &error) {
+#ifdef _MSC_VER
+  return false;
+#else
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+    error = string("socketpair: ") + strerror(errno);
+    return false;
+  }
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    error = string("fork: ") + strerror(errno);
+    close(sv[0]);
+    close(sv[1]);
+    return false;
+  }
+
+  if (pid == 0) {
+    close(sv[0]);
+    for (Worker &wk : workers)
+      if (wk.fd >= 0)
+        close(wk.fd);
+
+    int node = index % nodes;
+    vector<int> cpus = numaNodes()[node];
+    int sharing = nWorkers / nodes + (node < nWorkers % nodes ? 1 : 0);
+    int threads = threadsPerWorker;
+    if (threads <= 0) {
+      int pool = cpus.empty() ? (int)std::thread::hardware_concurrency()
+                              : (int)cpus.size();
+      threads = std::max(pool / std::max(sharing, 1), 1);
+    }
+#ifdef __linux__
+    if (!cpus.empty()) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      for (int c : cpus)
+        CPU_SET(c, &set);
+      sched_setaffinity(0, sizeof(set), &set);
+    }
+#endif
+    raytracer->setThreadSlots(0, threads);
+    workerMain(sv[1]);
+    _exit(0);
+  }
+
+  close(sv[1]);
+  workers[index].pid = pid;
+  workers[index].fd = sv[0];
+  workers[index].tile = -1;
+  return true;
+#endif
+}
+
+// Runs in the forked child: trace tiles until told to stop or the
+// coordinator goes away.
+void TileCoordinator::workerMain(int fd) {
+#ifndef _MSC_VER
+  raytracer->traceSetup(width, height);
+  unsigned char *buf;
+  int w, h;
+  raytracer->getBuffer(buf, w, h);
+  const float *aux = raytracer->getAuxBuffer();
+
+  vector<unsigned char> pixels;
+  vector<float> auxRows;
+  int32_t index;
+  while (recvAll(fd, &index, sizeof(index)) && index >= 0 &&
+         index < (int)tiles.size()) {
+    const Tile &t = tiles[index];
+    raytracer->traceRegion(t.x0, t.y0, t.x1, t.y1);
+
+    size_t row = (t.x1 - t.x0) * 3;
+    pixels.resize(row * (t.y1 - t.y0));
+    for (int y = t.y0; y < t.y1; ++y)
+      memcpy(&pixels[row * (y - t.y0)], buf + (y * w + t.x0) * 3, row);
+    if (!sendAll(fd, &index, sizeof(index)) ||
+        !sendAll(fd, pixels.data(), pixels.size()))
+      break;
+
+    if (aux) {
+      size_t auxRow = (t.x1 - t.x0) * AUX_CHANNELS;
+      auxRows.resize(auxRow * (t.y1 - t.y0));
+      for (int y = t.y0; y < t.y1; ++y)
+        memcpy(&auxRows[auxRow * (y - t.y0)],
+               aux + (y * w + t.x0) * AUX_CHANNELS, auxRow * sizeof(float));
+      if (!sendAll(fd, auxRows.data(), auxRows.size() * sizeof(float)))
+        break;
+    }
+  }
+  close(fd);
+#endif
+}
+
+bool TileCoordinator::send(Worker &w, int tile, double t) {
+#ifdef _MSC_VER
+  return false;
+#else
+  int32_t index = tile;
+  if (!sendAll(w.fd, &index, sizeof(index)))
+    return false;
+  tiles[tile].issued++;
+  w.tile = tile;
+  w.started = t;
+  return true;
+#endif
+}
+
+// Read one finished tile from a worker. A tile that already came back from
+// another worker is read and dropped.
+bool TileCoordinator::receive(Worker &w, double t) {
+#ifdef _MSC_VER
+  return false;
+#else
+  int32_t index;
+  if (!recvAll(w.fd, &index, sizeof(index)) || index != w.tile)
+    return false;
+
+  Tile &tile = tiles[index];
+  size_t row = (tile.x1 - tile.x0) * 3;
+  vector<unsigned char> pixels(row * (tile.y1 - tile.y0));
+  if (!recvAll(w.fd, pixels.data(), pixels.size()))
+    return false;
+
+  float *aux = raytracer->getAuxBuffer();
+  size_t auxRow = (tile.x1 - tile.x0) * AUX_CHANNELS;
+  vector<float> auxRows(aux ? auxRow * (tile.y1 - tile.y0) : 0);
+  if (!recvAll(w.fd, auxRows.data(), auxRows.size() * sizeof(float)))
+    return false;
+
+  if (!tile.done) {
+    unsigned char *buf;
+    int bw, bh;
+    raytracer->getBuffer(buf, bw, bh);
+    for (int y = tile.y0; y < tile.y1; ++y)
+      memcpy(buf + (y * bw + tile.x0) * 3, &pixels[row * (y - tile.y0)], row);
+    if (aux)
+      for (int y = tile.y0; y < tile.y1; ++y)
+        memcpy(aux + (y * bw + tile.x0) * AUX_CHANNELS,
+               &auxRows[auxRow * (y - tile.y0)], auxRow * sizeof(float));
+    tile.done = true;
+    --remaining;
+    tileTimes.push_back(t - w.started);
+  }
+  w.tile = -1;
+  return true;
+#endif
+}
+
+void TileCoordinator::retire(Worker &w, bool kill) {
+#ifndef _MSC_VER
+  if (w.fd >= 0)
+    close(w.fd);
+  if (w.pid > 0) {
+    if (kill)
+      ::kill(w.pid, SIGKILL);
+    waitpid(w.pid, nullptr, 0);
+  }
+#endif
+  w.fd = -1;
+  w.pid = -1;
+  w.tile = -1;
+}
+
+// A tile worth handing to a second, idle worker: one that has been out far
+// longer than tiles usually take and hasn't been duplicated yet. Returns -1
+// if there's none, or no finished tiles to judge by yet.
+int TileCoordinator::slowTile(double t) const {
+  if (tileTimes.empty())
+    return -1;
+  vector<double> times(tileTimes);
+  auto mid = times.begin() + times.size() / 2;
+  std::nth_element(times.begin(), mid, times.end());
+  double limit = std::max(4.0 * *mid, 0.25);
+
+  int slowest = -1;
+  double longest = limit;
+  for (const Worker &w : workers) {
+    if (w.fd < 0 || w.tile < 0)
+      continue;
+    const Tile &tile = tiles[w.tile];
+    if (tile.done || tile.issued > 1)
+      continue;
+    if (t - w.started > longest) {
+      longest = t - w.started;
+      slowest = w.tile;
+    }
+  }
+  return slowest;
+}
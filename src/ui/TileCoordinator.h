@@ -0,0 +1,69 @@
+//
+// TileCoordinator.h
+//
+// Renders one image with several local worker processes. The coordinator
+// forks the workers after the scene is loaded, hands them tiles over UNIX
+// socket pairs and assembles the finished tiles in its own buffer.
+//
+
+#ifndef __TileCoordinator_h__
+#define __TileCoordinator_h__
+
+#include <string>
+#include <vector>
+
+class RayTracer;
+
+class TileCoordinator {
+public:
+  // `workers` processes, each rendering square tiles of `tileSize` pixels
+  // with `threads` threads (0 = its share of the threads on its NUMA node).
+  TileCoordinator(RayTracer *rt, int workers, int tileSize, int threads = 0);
+  ~TileCoordinator();
+
+  // Trace a w x h image into the tracer's buffer, denoising it once all the
+  // tiles are in if the denoiser is on. Tiles lost to a dead worker, or
+  // stuck on a slow one, are handed to another worker; if every worker is
+  // gone the coordinator finishes the remaining tiles itself.
+  // Returns false and sets `error` if the workers couldn't be started.
+  bool render(int w, int h, std::string &error);
+
+  int tilesReissued() const { return reissued; }
+  int workersLost() const { return lost; }
+
+private:
+  struct Tile {
+    int x0, y0, x1, y1;
+    int issued = 0;
+    bool done = false;
+  };
+
+  struct Worker {
+    int pid = -1;
+    int fd = -1;
+    int tile = -1; // tile in flight, or -1 when idle
+    double started = 0.0;
+  };
+
+  bool spawn(int index, int nodes, std::string &error);
+  void workerMain(int fd);
+  bool send(Worker &w, int tile, double now);
+  bool receive(Worker &w, double now);
+  void retire(Worker &w, bool kill);
+  int slowTile(double now) const;
+
+  RayTracer *raytracer;
+  int nWorkers, tileSize, threadsPerWorker;
+  int width = 0, height = 0;
+
+  std::vector<Tile> tiles;
+  std::vector<Worker> workers;
+  std::vector<int> pending; // tiles not yet handed out, last one first
+  std::vector<double> tileTimes;
+
+  int remaining = 0; // tiles not yet back
+  int reissued = 0;
+  int lost = 0;
+};
+
+#endif
@@ -5,6 +5,7 @@
 #else
 #include <dirent.h>
 #endif
+#include "../fileio/pngimage.h"
 #include "../scene/cubeMap.h"
 #include "../scene/material.h"
 
@@ -15,8 +16,18 @@
  */
 #include "json.hpp"
 using Json = nlohmann::json;
+#include <algorithm>
 #include <fstream>
 #include <iostream>
+#include <thread>
+
+// The active UI, and the settings the tracing core shares with it
+TraceUI *traceUI;
+int TraceUI::m_threads = std::max(std::thread::hardware_concurrency(), 1u);
+int TraceUI::rayCount[MAX_THREADS];
+int TraceUI::occluderLookups[MAX_THREADS];
+int TraceUI::occluderHits[MAX_THREADS];
+bool TraceUI::m_debug = false;
 
 namespace {
 template <typename T> void load(Json &j, const string &field, T &target) {
@@ -28,7 +39,7 @@ template <typename T> void load(Json &j, const string &field, T &target) {
 
 TraceUI::TraceUI() {
   for (unsigned int i = 0; i < MAX_THREADS; i++)
-    rayCount[i] = 0;
+    rayCount[i] = occluderLookups[i] = occluderHits[i] = 0;
 }
 
 TraceUI::~TraceUI() {}
@@ -49,9 +60,29 @@ void TraceUI::loadFromJson(const char *file) {
   load(json, "aa_threshold", m_nAaThreshold);
   load(json, "tree_depth", m_nTreeDepth);
   load(json, "leaf_size", m_nLeafSize);
+  load(json, "light_samples", m_nLightSamples);
+  load(json, "light_cutoff", m_lightCutoff);
+  load(json, "area_samples", m_nAreaLightSamples);
+  load(json, "area_probes", m_nAreaLightProbes);
+  load(json, "sample_seed", m_nSampleSeed);
+  load(json, "denoise_passes", m_nDenoisePasses);
+  load(json, "ray_log_stride", m_nRayLogStride);
+  load(json, "ray_log_region", m_rayLogRegion);
+  load(json, "ray_log_capacity", m_nRayLogCapacity);
   load(json, "filter_width", m_nFilterWidth);
+  load(json, "band_rows", m_nBandRows);
+  load(json, "png_compression", m_nPngCompression);
+  load(json, "png_filter", m_pngFilter);
+  load(json, "workers", m_nWorkers);
+  load(json, "tile_size", m_nTileSize);
   load(json, "anti_alias", m_antiAlias);
   load(json, "kdtree", m_kdTree);
+  load(json, "bvh_compress", m_bvhCompress);
+  load(json, "mesh_compress", m_meshCompress);
+  load(json, "packets", m_packets);
+  load(json, "wavefront", m_wavefront);
+  load(json, "occluder_cache", m_occluderCache);
+  load(json, "denoise", m_denoise);
   load(json, "shadows", m_shadows);
   load(json, "smoothshade", m_smoothshade);
   load(json, "backface_culling", m_backface);
@@ -66,6 +97,17 @@ void TraceUI::loadFromJson(const char *file) {
   load(json, "backface_specular", m_backfaceSpecular);
 }
 
+bool TraceUI::configurePngOutput() {
+  PNGOptions png;
+  png.compression = m_nPngCompression;
+  png.filter = pngFilterFromName(m_pngFilter.c_str());
+  png.threads = m_threads;
+  if (png.filter < -1)
+    return false;
+  setPNGOptions(png);
+  return true;
+}
+
 namespace {
 std::vector<string> image_exts = {".bmp", ".png"};
 
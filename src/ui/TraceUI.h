@@ -9,6 +9,7 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 #define MAX_THREADS 32
 
 using std::string;
@@ -39,10 +40,30 @@ public:
   int getSuperSamples() const { return m_nSuperSamples; }
   int getMaxDepth() const { return m_nTreeDepth; }
   int getLeafSize() const { return m_nLeafSize; }
+  int getLightSamples() const { return m_nLightSamples; }
+  double getLightCutoff() const { return m_lightCutoff; }
+  int getAreaLightSamples() const { return m_nAreaLightSamples; }
+  int getAreaLightProbes() const { return m_nAreaLightProbes; }
+  int getSampleSeed() const { return m_nSampleSeed; }
+  int getDenoisePasses() const { return m_nDenoisePasses; }
+  int getRayLogStride() const { return m_nRayLogStride; }
+  const std::vector<int> &getRayLogRegion() const { return m_rayLogRegion; }
+  int getRayLogCapacity() const { return m_nRayLogCapacity; }
   int getFilterWidth() const { return m_nFilterWidth; }
   int getThreads() const { return m_threads; }
+  int getBandRows() const { return m_nBandRows; }
+  int getPngCompression() const { return m_nPngCompression; }
+  const string &getPngFilter() const { return m_pngFilter; }
+  int getWorkers() const { return m_nWorkers; }
+  int getTileSize() const { return m_nTileSize; }
   bool aaSwitch() const { return m_antiAlias; }
   bool kdSwitch() const { return m_kdTree; }
+  bool bvhCompressSwitch() const { return m_bvhCompress; }
+  bool meshCompressSwitch() const { return m_meshCompress; }
+  bool packetSwitch() const { return m_packets; }
+  bool wavefrontSwitch() const { return m_wavefront; }
+  bool occluderCacheSwitch() const { return m_occluderCache; }
+  bool denoiseSwitch() const { return m_denoise; }
   bool shadowSw() const { return m_shadows; }
   bool smShadSw() const { return m_smoothshade; }
   bool bkFaceSw() const { return m_backface; }
@@ -53,15 +74,18 @@ public:
   bool backfaceSpecular() const { return m_backfaceSpecular; }
 
   // ray counter
+  // Counters outside [0, MAX_THREADS) belong to threads outside the render
+  // pool and are not kept
+  static bool counted(int ctr) { return ctr >= 0 && ctr < MAX_THREADS; }
   static void addRays(int number, int ctr) {
-    if (ctr >= 0)
+    if (counted(ctr))
       rayCount[ctr] += number;
   }
   static void addRay(int ctr) {
-    if (ctr >= 0)
+    if (counted(ctr))
       rayCount[ctr]++;
   }
-  static int getCount(int ctr) { return ctr < 0 ? -1 : rayCount[ctr]; }
+  static int getCount(int ctr) { return counted(ctr) ? rayCount[ctr] : -1; }
   static int getCount() {
     int total = 0;
     for (int i = 0; i < m_threads; i++)
@@ -69,7 +93,7 @@ public:
     return total;
   }
   static int resetCount(int ctr) {
-    if (ctr < 0)
+    if (!counted(ctr))
       return -1;
     int temp = rayCount[ctr];
     rayCount[ctr] = 0;
@@ -84,6 +108,22 @@ public:
     return total;
   }
 
+  // occluder cache counters, per thread like the ray counter
+  static void addOccluderLookup(int ctr, bool hit) {
+    if (counted(ctr)) {
+      occluderLookups[ctr]++;
+      occluderHits[ctr] += hit;
+    }
+  }
+  static void resetOccluderStats(int &lookups, int &hits) {
+    lookups = hits = 0;
+    for (int i = 0; i < m_threads; i++) {
+      lookups += occluderLookups[i];
+      hits += occluderHits[i];
+      occluderLookups[i] = occluderHits[i] = 0;
+    }
+  }
+
   static int m_threads; // number of threads to run
   static bool m_debug;
 
@@ -101,9 +141,25 @@ protected:
   int m_nAaThreshold = 100; // Pixel neighborhood difference for supersampling
   int m_nTreeDepth = 15;    // maximum kdTree depth
   int m_nLeafSize = 10;     // target number of objects per leaf
+  int m_nLightSamples = 0;  // point lights sampled per shade (0 = all)
+  double m_lightCutoff = 0.001; // skip sampled lights dimmer than this
+  int m_nAreaLightSamples = 16; // most shadow rays per area light and point
+  int m_nAreaLightProbes = 2;   // shadow rays that look for a penumbra (2-4)
+  int m_nSampleSeed = 0;    // seed for the per-pixel sample sequences
+  int m_nDenoisePasses = 5; // a-trous passes; the last spans 2^(n+1) pixels
+  int m_nRayLogStride = 0;  // log rays of every nth pixel each way (0 = off)
+  std::vector<int> m_rayLogRegion; // x0, y0, x1, y1 to log; empty for all
+  int m_nRayLogCapacity = 4096;    // newest rays logged per thread
   int m_nFilterWidth = 1;   // width of cubemap filter
+  int m_nBandRows = 0;      // scanlines per streamed output band (0 = off)
+  int m_nPngCompression = -1;     // zlib level for png output (-1 = default)
+  string m_pngFilter = "adaptive"; // png row filter, see pngFilterFromName()
+  int m_nWorkers = 0;       // worker processes for tiled rendering (0 = off)
+  int m_nTileSize = 64;     // edge length of a tile handed to a worker
 
   static int rayCount[MAX_THREADS]; // Ray counter
+  static int occluderLookups[MAX_THREADS];
+  static int occluderHits[MAX_THREADS];
 
   // Determines whether or not to show debugging information
   // for individual rays.  Disabled by default for efficiency
@@ -111,6 +167,12 @@ protected:
   bool m_displayDebuggingInfo = false;
   bool m_antiAlias = false;    // Is antialiasing on?
   bool m_kdTree = true;        // use kd-tree?
+  bool m_bvhCompress = false;  // quantize the BVH's boxes to save memory?
+  bool m_meshCompress = false; // pack mesh vertex data to save memory?
+  bool m_packets = true;       // trace camera rays in 2x2 packets?
+  bool m_wavefront = false;    // trace a bounce at a time?
+  bool m_occluderCache = true; // retest each light's last occluder first?
+  bool m_denoise = false;      // filter the finished image?
   bool m_shadows = true;       // compute shadows?
   bool m_smoothshade = true;   // turn on/off smoothshading?
   bool m_backface = true;      // cull backfaces?
@@ -124,6 +186,9 @@ protected:
 
   void loadFromJson(const char *file);
   void smartLoadCubemap(const string &file);
+  // Push the png settings to the image writer; false if the filter name is
+  // not recognized.
+  bool configurePngOutput();
 };
 
 #endif
@@ -5,6 +5,7 @@
 #include "../scene/light.h"
 #include "../scene/scene.h"
 #include "ModelerCamera.h"
+#include "glObjects.h"
 #include <iostream>
 #include <string.h>
 
@@ -345,7 +346,7 @@ void DebuggingView::lightScene() {
                      "handle 8."
                   << std::endl;
 
-      (*l)->glDrawLight(*glLightsItr);
+      glDrawLight(**l, *glLightsItr);
       ++glLightsItr;
     }
 
@@ -366,7 +367,7 @@ void DebuggingView::lightScene() {
 void DebuggingView::drawLights() {
   for (auto l = raytracer->getScene().beginLights();
        l != raytracer->getScene().endLights(); ++l)
-    (*l)->glDrawLight();
+    glDrawLight(**l);
 }
 
 void DebuggingView::drawScene() {
@@ -424,17 +425,15 @@ void DebuggingView::drawScene() {
     glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, mat);
   }
 
-  raytracer->getScene().glDraw(divisions, m_useSceneMaterials,
-                               m_useSceneTextures);
+  glDrawScene(raytracer->getScene(), divisions, m_useSceneMaterials,
+              m_useSceneTextures);
 }
 
 void DebuggingView::drawRays() {
   glDisable(GL_LIGHTING);
   // Now draw all the rays
-  for (std::vector<std::pair<ray *, isect *>>::const_iterator rayItr =
-           raytracer->getScene().intersectCache.begin();
-       rayItr != raytracer->getScene().intersectCache.end(); ++rayItr) {
-    switch (rayItr->first->type()) {
+  for (const RayRecord &rec : raytracer->getScene().getRayLog().snapshot()) {
+    switch (rec.type) {
     case ray::VISIBILITY:
       if (!m_showVisibilityRays)
         continue;
@@ -459,9 +458,9 @@ void DebuggingView::drawRays() {
       glColor4f(0.20f, 0.45f, 0.72f, 1.0f);
       break;
     }
-    glm::dvec3 p = rayItr->first->getPosition();
-    glm::dvec3 d = rayItr->first->getDirection();
-    glm::dvec3 isectPoint = p + rayItr->second->getT() * d;
+    glm::dvec3 p = rec.position;
+    glm::dvec3 d = rec.direction;
+    glm::dvec3 isectPoint = p + rec.t * d;
 
     glEnable(GL_LINE_STIPPLE);
     glLineStipple(1, 0x3333);
@@ -480,7 +479,7 @@ void DebuggingView::drawRays() {
       glBegin(GL_LINES);
       glColor4f(0.5f, 1.0f, 0.5f, 1.0f);
       glVertex3d(0.0, 0.0, 0.0);
-      glVertex3dv(&(rayItr->second->getN()[0]));
+      glVertex3dv(&rec.normal[0]);
       glEnd();
       glPopMatrix();
     }
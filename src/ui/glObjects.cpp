@@ -1,7 +1,9 @@
 #pragma warning(disable : 4786)
 
-#include <FL/gl.h>
+#include "glObjects.h"
+
 #include <FL/glu.h>
+#include <map>
 #include <math.h>
 
 #include "../scene/light.h"
@@ -20,26 +22,13 @@ using namespace std;
 const double pi =
     3.1415926535897932384626433832795028841971693993751058209749445923078164062862;
 
-void Scene::glDraw(int quality, bool actualMaterials,
-                   bool actualTextures) const {
-  // try the non-bounded objects
-  for (const auto &obj : objects) {
-    obj->glDraw(quality, actualMaterials, actualTextures);
-  }
-}
-
-void Geometry::glDraw(int quality, bool actualMaterials,
-                      bool actualTextures) const {
-  glPushMatrix();
-  {
-    // glm uses colunm major as default
-    glm::dmat4 colMajor = transform.transform();
-    glMultMatrixd(&colMajor[0][0]);
-    glDrawLocal(quality, actualMaterials, actualTextures);
-  }
-  glPopMatrix();
-}
+/*
+ * OpenGL previews of scene contents for the debugging view. The tracing
+ * core doesn't know about GL at all; everything here draws core objects
+ * from the outside through their public accessors.
+ */
 
+namespace {
 void setMaterialProperty(GLenum property, glm::dvec3 value) {
   GLfloat val[4];
   val[0] = GLfloat(value[0]);
@@ -72,26 +61,7 @@ void setGLMaterial(const Material &mat, const SceneObject *object) {
   glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, (GLfloat)mat.shininess(i));
 }
 
-void SceneObject::glDraw(int quality, bool actualMaterials,
-                         bool actualTextures) const {
-  glPushMatrix();
-  {
-    // GLM is column major by default
-    glm::dmat4 colMajor = transform.transform();
-    glMultMatrixd(&colMajor[0][0]);
-
-    if (actualMaterials) {
-      setGLMaterial(getMaterial(), this);
-    }
-
-    // Now draw the object in its local coordinate frame
-    glDrawLocal(quality, actualMaterials, actualTextures);
-  }
-  glPopMatrix();
-}
-
-void Sphere::glDrawLocal(int quality, [[maybe_unused]] bool actualMaterials,
-                         [[maybe_unused]] bool actualTextures) const {
+void drawSphere(int quality) {
   // Use this for display lists
   static std::map<int, GLuint> displayLists;
 
@@ -134,8 +104,7 @@ void drawTesselatedSquare(int quality) {
   glPopMatrix();
 }
 
-void Box::glDrawLocal(int quality, [[maybe_unused]] bool actualMaterials,
-                      [[maybe_unused]] bool actualTextures) const {
+void drawBox(int quality) {
   // Use this for display lists
   static std::map<int, GLuint> boxDisplayLists;
 
@@ -189,11 +158,10 @@ void Box::glDrawLocal(int quality, [[maybe_unused]] bool actualMaterials,
   glCallList(dispListItr->second);
 }
 
-void Cone::glDrawLocal(int quality, [[maybe_unused]] bool actualMaterials,
-                       [[maybe_unused]] bool actualTextures) const {
-  const double r1 = b_radius;
-  const double r2 = t_radius;
-  const double h = height;
+void drawCone(const Cone &cone, int quality) {
+  const double r1 = cone.getBottomRadius();
+  const double r2 = cone.getTopRadius();
+  const double h = cone.getHeight();
   const int divisions = quality;
 
   GLUquadricObj *gluq;
@@ -205,7 +173,7 @@ void Cone::glDrawLocal(int quality, [[maybe_unused]] bool actualMaterials,
   gluCylinder(gluq, r1, r2, h, divisions, divisions);
   gluDeleteQuadric(gluq);
 
-  if (capped) {
+  if (cone.isCapped()) {
     if (r1 > 0.0) {
       /* if the r1 end does not come to a point, draw a flat
          disk to cover it up. */
@@ -247,15 +215,14 @@ void Cone::glDrawLocal(int quality, [[maybe_unused]] bool actualMaterials,
   }
 }
 
-void Cylinder::glDrawLocal(int quality, [[maybe_unused]] bool actualMaterials,
-                           [[maybe_unused]] bool actualTextures) const {
-  // Use this for display lists
-  static std::map<int, GLuint> displayLists;
+void drawCylinder(bool capped, int quality) {
+  // Use this for display lists, one set each for capped and open cylinders
+  static std::map<std::pair<int, bool>, GLuint> displayLists;
 
-  std::map<int, GLuint>::iterator dispListItr = displayLists.find(quality);
+  auto key = std::make_pair(quality, capped);
+  auto dispListItr = displayLists.find(key);
   if (dispListItr == displayLists.end()) {
-    dispListItr =
-        (displayLists.insert(std::make_pair(quality, glGenLists(1)))).first;
+    dispListItr = (displayLists.insert(std::make_pair(key, glGenLists(1)))).first;
     glNewList(dispListItr->second, GL_COMPILE);
 
     const int divisions = quality;
@@ -308,8 +275,7 @@ void Cylinder::glDrawLocal(int quality, [[maybe_unused]] bool actualMaterials,
   glCallList(dispListItr->second);
 }
 
-void Square::glDrawLocal(int quality, [[maybe_unused]] bool actualMaterials,
-                         [[maybe_unused]] bool actualTextures) const {
+void drawSquare(int quality) {
   // Use this for display lists
   static std::map<int, GLuint> displayLists;
 
@@ -327,18 +293,21 @@ void Square::glDrawLocal(int quality, [[maybe_unused]] bool actualMaterials,
   glCallList(dispListItr->second);
 }
 
-void Trimesh::glDrawLocal([[maybe_unused]] int quality, bool actualMaterials,
-                          [[maybe_unused]] bool actualTextures) const {
+// Mesh display lists, one per mesh and material setting. They live here
+// rather than in the mesh so the core stays free of GL state, and are
+// dropped when a new scene is loaded.
+std::map<std::pair<const Trimesh *, bool>, GLuint> meshDisplayLists;
+bool meshDisplayListsStale = false;
+
+void drawTrimesh(const Trimesh &mesh, bool actualMaterials) {
   // Could be doing this a lot more efficiently w/ vertex arrays, but that
   // would involve changing the data storage method just for debugging
   // purposes which is probably wrong.
+  const auto &faces = mesh.getFaces();
+  const bool normals = mesh.hasNormals();
 
-  int *d;
-  if (actualMaterials)
-    d = &displayListWithMaterials;
-  else
-    d = &displayListWithoutMaterials;
-  int &displayList = *d;
+  GLuint &displayList =
+      meshDisplayLists[std::make_pair(&mesh, actualMaterials)];
 
   // We'll try to buy some time back by using display lists.
   if (displayList == 0) {
@@ -346,16 +315,16 @@ void Trimesh::glDrawLocal([[maybe_unused]] int quality, bool actualMaterials,
     glNewList(displayList, GL_COMPILE);
 
     glBegin(GL_TRIANGLES);
-    for (Faces::const_iterator itr = faces.begin(); itr != faces.end(); ++itr) {
+    for (auto itr = faces.begin(); itr != faces.end(); ++itr) {
       const int vert1 = (*(*itr))[0];
       const int vert2 = (*(*itr))[1];
       const int vert3 = (*(*itr))[2];
-      setGLMaterial(material, *itr);
+      setGLMaterial(mesh.getMaterial(), *itr);
 
-      if (normals.empty()) {
-        const glm::dvec3 &a = vertices[vert1];
-        const glm::dvec3 &b = vertices[vert2];
-        const glm::dvec3 &c = vertices[vert3];
+      if (!normals) {
+        glm::dvec3 a = mesh.vertex(vert1);
+        glm::dvec3 b = mesh.vertex(vert2);
+        glm::dvec3 c = mesh.vertex(vert3);
 
         glm::dvec3 cv = glm::cross(b - a, c - a);
 
@@ -365,19 +334,15 @@ void Trimesh::glDrawLocal([[maybe_unused]] int quality, bool actualMaterials,
           glNormal3dv(&cv[0]);
       }
 
-      if (!normals.empty())
-        glNormal3dv(&normals[vert1][0]);
-      glVertex3dv(&vertices[vert1][0]);
-
-      if (!normals.empty())
-        glNormal3dv(&normals[vert2][0]);
-
-      glVertex3dv(&vertices[vert2][0]);
-
-      if (!normals.empty())
-        glNormal3dv(&normals[vert3][0]);
-
-      glVertex3dv(&vertices[vert3][0]);
+      const int verts[3] = {vert1, vert2, vert3};
+      for (int k = 0; k < 3; ++k) {
+        if (normals) {
+          glm::dvec3 n = mesh.vertexNormal(verts[k]);
+          glNormal3dv(&n[0]);
+        }
+        glm::dvec3 v = mesh.vertex(verts[k]);
+        glVertex3dv(&v[0]);
+      }
     }
     glEnd();
 
@@ -387,7 +352,14 @@ void Trimesh::glDrawLocal([[maybe_unused]] int quality, bool actualMaterials,
   glCallList(displayList);
 }
 
-void PointLight::glDrawLight(GLenum lightID) const {
+// Area lights are previewed as a point light at their center
+template <typename PositionalLight>
+void setupPointLight(const PositionalLight &light, GLenum lightID) {
+  const glm::dvec3 &position = light.getPosition();
+  const glm::dvec3 color = light.getColor();
+  float constantTerm, linearTerm, quadraticTerm;
+  light.getAttenuationConstants(constantTerm, linearTerm, quadraticTerm);
+
   GLfloat pos[4];
   pos[0] = GLfloat(position[0]);
   pos[1] = GLfloat(position[1]);
@@ -408,7 +380,11 @@ void PointLight::glDrawLight(GLenum lightID) const {
   glLightf(lightID, GL_QUADRATIC_ATTENUATION, quadraticTerm);
 }
 
-void PointLight::glDrawLight() const {
+template <typename PositionalLight>
+void drawPointLight(const PositionalLight &light) {
+  const glm::dvec3 &position = light.getPosition();
+  const glm::dvec3 color = light.getColor();
+
   GLfloat fColor[4];
   fColor[0] = GLfloat(color[0]);
   fColor[1] = GLfloat(color[1]);
@@ -483,7 +459,10 @@ void PointLight::glDrawLight() const {
   glPopMatrix();
 }
 
-void DirectionalLight::glDrawLight(GLenum lightID) const {
+void setupDirectionalLight(const DirectionalLight &light, GLenum lightID) {
+  const glm::dvec3 &orientation = light.getOrientation();
+  const glm::dvec3 color = light.getColor();
+
   GLfloat fColor[4];
   fColor[0] = GLfloat(color[0]);
   fColor[1] = GLfloat(color[1]);
@@ -518,7 +497,11 @@ void arrow() {
   glPopMatrix();
 }
 
-void DirectionalLight::glDrawLight() const {
+void drawDirectionalLight(const DirectionalLight &light) {
+  const glm::dvec3 &orientation = light.getOrientation();
+  const glm::dvec3 color = light.getColor();
+  const Scene *scene = light.getScene();
+
   GLfloat fColor[4];
   fColor[0] = GLfloat(color[0]);
   fColor[1] = GLfloat(color[1]);
@@ -620,3 +603,61 @@ void DirectionalLight::glDrawLight() const {
   glEnable(GL_LIGHTING);
   glPopMatrix();
 }
+} // namespace
+
+void glDrawScene(const Scene &scene, int quality, bool actualMaterials,
+                 [[maybe_unused]] bool actualTextures) {
+  if (meshDisplayListsStale) {
+    for (const auto &entry : meshDisplayLists)
+      glDeleteLists(entry.second, 1);
+    meshDisplayLists.clear();
+    meshDisplayListsStale = false;
+  }
+
+  for (const Geometry *obj : scene.getAllObjects()) {
+    glPushMatrix();
+    // GLM is column major by default
+    glm::dmat4 colMajor = obj->getTransform().transform();
+    glMultMatrixd(&colMajor[0][0]);
+
+    const SceneObject *sceneObj = dynamic_cast<const SceneObject *>(obj);
+    if (sceneObj && actualMaterials)
+      setGLMaterial(sceneObj->getMaterial(), sceneObj);
+
+    // Now draw the object in its local coordinate frame. Objects of other
+    // types aren't drawn.
+    if (dynamic_cast<const Sphere *>(obj))
+      drawSphere(quality);
+    else if (dynamic_cast<const Box *>(obj))
+      drawBox(quality);
+    else if (dynamic_cast<const Square *>(obj))
+      drawSquare(quality);
+    else if (auto cyl = dynamic_cast<const Cylinder *>(obj))
+      drawCylinder(cyl->isCapped(), quality);
+    else if (auto cone = dynamic_cast<const Cone *>(obj))
+      drawCone(*cone, quality);
+    else if (auto mesh = dynamic_cast<const Trimesh *>(obj))
+      drawTrimesh(*mesh, actualMaterials);
+    glPopMatrix();
+  }
+}
+
+void glSceneChanged() { meshDisplayListsStale = true; }
+
+void glDrawLight(const Light &light, GLenum lightID) {
+  if (auto point = dynamic_cast<const PointLight *>(&light))
+    setupPointLight(*point, lightID);
+  else if (auto area = dynamic_cast<const AreaLight *>(&light))
+    setupPointLight(*area, lightID);
+  else if (auto dir = dynamic_cast<const DirectionalLight *>(&light))
+    setupDirectionalLight(*dir, lightID);
+}
+
+void glDrawLight(const Light &light) {
+  if (auto point = dynamic_cast<const PointLight *>(&light))
+    drawPointLight(*point);
+  else if (auto area = dynamic_cast<const AreaLight *>(&light))
+    drawPointLight(*area);
+  else if (auto dir = dynamic_cast<const DirectionalLight *>(&light))
+    drawDirectionalLight(*dir);
+}
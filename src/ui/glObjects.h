@@ -0,0 +1,30 @@
+//
+// glObjects.h
+//
+// OpenGL previews of scene contents for the debugging view. These live in
+// the UI layer so the tracing core builds without FLTK or OpenGL.
+//
+
+#ifndef __GLOBJECTS_H__
+#define __GLOBJECTS_H__
+
+#include <FL/gl.h>
+
+class Light;
+class Scene;
+
+// Draw every object in the scene, tesselating curved surfaces into
+// `quality` divisions.
+void glDrawScene(const Scene &scene, int quality, bool actualMaterials,
+                 bool actualTextures);
+
+// Drop cached mesh geometry; call after loading a new scene.
+void glSceneChanged();
+
+// Set up GL light `lightID` to match a scene light.
+void glDrawLight(const Light &light, GLenum lightID);
+
+// Draw a marker showing where a scene light is.
+void glDrawLight(const Light &light);
+
+#endif // __GLOBJECTS_H__